@@ -0,0 +1,381 @@
+/*
+ * Copyright 2019 Jeroen Domburg <jeroen@spritesmods.com>
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//Host-side converter from png/tga/tmx files into the raw blobs the gfx_load_blob_* functions
+//in the IPL load. See soc/ipl/syscallable/gfx_blob.h for the format.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "lodepng.h"
+extern "C" {
+#include "yxml.h"
+}
+#include "gfx_blob.h"
+#include "mach_defines.h"
+
+using namespace std;
+
+//An indexed-color image with its palette in GFXPAL format.
+typedef struct {
+	int w, h;
+	vector<uint8_t> pixels; //one byte per pixel
+	vector<uint32_t> pal;
+} image_t;
+
+static bool read_file(const char *name, vector<uint8_t> &data) {
+	FILE *f=fopen(name, "rb");
+	if (f==NULL) {
+		perror(name);
+		return false;
+	}
+	uint8_t buf[4096];
+	size_t n;
+	while ((n=fread(buf, 1, sizeof(buf), f))>0) data.insert(data.end(), buf, buf+n);
+	fclose(f);
+	return true;
+}
+
+static uint32_t rgba(int r, int g, int b, int a) {
+	return (r<<0)|(g<<8)|(b<<16)|(a<<24);
+}
+
+static bool load_png(const char *name, const vector<uint8_t> &data, image_t *img) {
+	unsigned char *decoded=NULL;
+	unsigned w, h;
+	LodePNGState st;
+	lodepng_state_init(&st);
+	st.decoder.color_convert=0;
+	unsigned err=lodepng_decode(&decoded, &w, &h, &st, data.data(), data.size());
+	if (err) {
+		fprintf(stderr, "%s: %s\n", name, lodepng_error_text(err));
+		lodepng_state_cleanup(&st);
+		return false;
+	}
+	if (st.info_png.color.colortype!=LCT_PALETTE) {
+		fprintf(stderr, "%s: not an indexed-color png\n", name);
+		free(decoded);
+		lodepng_state_cleanup(&st);
+		return false;
+	}
+	img->w=w;
+	img->h=h;
+	int bpp=st.info_png.color.bitdepth;
+	img->pixels.resize(w*h);
+	for (unsigned i=0; i<w*h; i++) {
+		//Rows of sub-byte pixels are not padded by lodepng when color_convert is off.
+		int bit=i*bpp;
+		img->pixels[i]=(decoded[bit/8]>>(8-bpp-(bit&7)))&((1<<bpp)-1);
+	}
+	const uint8_t *p=st.info_png.color.palette;
+	for (size_t i=0; i<st.info_png.color.palettesize; i++) {
+		img->pal.push_back(rgba(p[i*4], p[i*4+1], p[i*4+2], p[i*4+3]));
+	}
+	free(decoded);
+	lodepng_state_cleanup(&st);
+	return true;
+}
+
+//Indexed-color tga, type 1 or 9 (RLE), like the IPL tga loaders accept.
+static bool load_tga(const char *name, const vector<uint8_t> &data, image_t *img) {
+	if (data.size()<18) {
+		fprintf(stderr, "%s: truncated tga\n", name);
+		return false;
+	}
+	const uint8_t *d=data.data();
+	int idlen=d[0], type=d[2];
+	int maplen=d[5]|(d[6]<<8), mapdepth=d[7];
+	int w=d[12]|(d[13]<<8), h=d[14]|(d[15]<<8);
+	int bpp=d[16], from_top=d[17]&(1<<5);
+	if ((type!=1 && type!=9) || bpp!=8) {
+		fprintf(stderr, "%s: not an 8-bit indexed-color tga\n", name);
+		return false;
+	}
+	size_t pos=18+idlen;
+	int entsz=mapdepth/8;
+	if (entsz<2 || entsz>4 || pos+maplen*entsz>data.size()) {
+		fprintf(stderr, "%s: unsupported or truncated color map\n", name);
+		return false;
+	}
+	for (int i=0; i<maplen; i++) {
+		const uint8_t *p=&d[pos+i*entsz];
+		if (entsz==2) {
+			int c=p[0]|(p[1]<<8);
+			img->pal.push_back(rgba(((c>>10)&0x1f)*8, ((c>>5)&0x1f)*8, (c&0x1f)*8, (c&0x8000)?255:0));
+		} else {
+			img->pal.push_back(rgba(p[2], p[1], p[0], (entsz==4)?p[3]:255));
+		}
+	}
+	pos+=maplen*entsz;
+
+	img->w=w;
+	img->h=h;
+	img->pixels.resize(w*h);
+	vector<uint8_t> px;
+	while ((int)px.size()<w*h && pos<data.size()) {
+		if (type==1) {
+			px.push_back(d[pos++]);
+		} else {
+			int hdr=d[pos++];
+			int n=(hdr&0x7f)+1;
+			if (hdr&0x80) {
+				if (pos>=data.size()) break;
+				px.insert(px.end(), n, d[pos++]);
+			} else {
+				if (pos+n>data.size()) break;
+				px.insert(px.end(), &d[pos], &d[pos+n]);
+				pos+=n;
+			}
+		}
+	}
+	if ((int)px.size()<w*h) {
+		fprintf(stderr, "%s: truncated image data\n", name);
+		return false;
+	}
+	for (int y=0; y<h; y++) {
+		int sy=from_top?y:(h-1-y);
+		memcpy(&img->pixels[y*w], &px[sy*w], w);
+	}
+	return true;
+}
+
+static bool load_image(const char *name, image_t *img) {
+	vector<uint8_t> data;
+	if (!read_file(name, data)) return false;
+	if (data.size()>=8 && memcmp(data.data(), "\x89PNG", 4)==0) return load_png(name, data, img);
+	return load_tga(name, data, img);
+}
+
+//Same layout gfx_load_tiles_mem produces: tiles left-to-right, top-to-bottom, each tile 16 rows
+//of two words, leftmost pixel in the lowest nibble.
+static void conv_tiles(const image_t *img, vector<uint32_t> &out, int *tw, int *th) {
+	*tw=img->w/16;
+	*th=img->h/16;
+	for (int ty=0; ty<*th; ty++) {
+		for (int tx=0; tx<*tw; tx++) {
+			for (int y=0; y<16; y++) {
+				uint64_t tp=0;
+				for (int x=0; x<16; x++) {
+					int c=img->pixels[(ty*16+y)*img->w+tx*16+x];
+					if (c>15) c=0;
+					tp|=(uint64_t)c<<(x*4);
+				}
+				out.push_back(tp);
+				out.push_back(tp>>32);
+			}
+		}
+	}
+}
+
+static bool conv_fb(const image_t *img, int bpp, vector<uint8_t> &out) {
+	for (int y=0; y<img->h; y++) {
+		const uint8_t *p=&img->pixels[y*img->w];
+		if (bpp==8) {
+			out.insert(out.end(), p, p+img->w);
+		} else {
+			for (int x=0; x<img->w; x+=2) {
+				int c1=p[x], c2=(x+1<img->w)?p[x+1]:0;
+				if (c1>15 || c2>15) return false;
+				out.push_back(c1|(c2<<4));
+			}
+		}
+	}
+	return true;
+}
+
+//Converts a tiled gid (tile number + 1, with flip flags in the top bits) into a tilemap entry.
+static uint32_t tmx_tilemap_ent(uint32_t gid, int palstart) {
+	int tileno=gid&0xfffffff;
+	//Tiled uses 0 for 'no tile'; we map that (and anything out of range) to tile 0.
+	tileno=(tileno>=1 && tileno<=512)?tileno-1:0;
+	uint32_t ent=tileno|((palstart>>3)<<GFX_TILEMAP_ENT_PAL_OFF);
+	if (gid&(1U<<31)) ent|=GFX_TILEMAP_ENT_FLIP_X;
+	if (gid&(1U<<30)) ent|=GFX_TILEMAP_ENT_FLIP_Y;
+	if (gid&(1U<<29)) ent|=GFX_TILEMAP_ENT_SWAP_XY;
+	return ent;
+}
+
+//Reads the csv data of tile layer 'layerid' from a tmx file.
+static bool conv_tmx(const char *name, int layerid, int palstart, vector<uint32_t> &out, int *mw, int *mh) {
+	vector<uint8_t> data;
+	if (!read_file(name, data)) return false;
+	vector<char> stack(4096);
+	yxml_t yx;
+	yxml_init(&yx, stack.data(), stack.size());
+	string attrval, csv;
+	int cur_layer=-1, w=0, h=0;
+	bool in_data=false, found=false;
+	for (size_t i=0; i<data.size(); i++) {
+		yxml_ret_t r=yxml_parse(&yx, data[i]);
+		if (r<0) {
+			fprintf(stderr, "%s: xml error %d at offset %zu\n", name, r, i);
+			return false;
+		}
+		if (r==YXML_ELEMSTART && strcmp(yx.elem, "layer")==0) {
+			cur_layer=-1;
+		} else if (r==YXML_ATTRSTART) {
+			attrval.clear();
+		} else if (r==YXML_ATTRVAL) {
+			attrval+=yx.data;
+		} else if (r==YXML_ATTREND) {
+			if (strcmp(yx.elem, "layer")==0 && strcmp(yx.attr, "id")==0) {
+				cur_layer=atoi(attrval.c_str());
+			} else if (strcmp(yx.elem, "layer")==0 && strcmp(yx.attr, "width")==0) {
+				w=atoi(attrval.c_str());
+			} else if (strcmp(yx.elem, "layer")==0 && strcmp(yx.attr, "height")==0) {
+				h=atoi(attrval.c_str());
+			} else if (strcmp(yx.elem, "data")==0 && strcmp(yx.attr, "encoding")==0 && cur_layer==layerid) {
+				if (attrval!="csv") {
+					fprintf(stderr, "%s: layer %d has encoding %s, should be csv\n", name, layerid, attrval.c_str());
+					return false;
+				}
+				in_data=true;
+			}
+		} else if (r==YXML_CONTENT && in_data) {
+			csv+=yx.data;
+		} else if (r==YXML_ELEMEND && in_data) {
+			in_data=false;
+			found=true;
+			break;
+		}
+	}
+	if (!found || w<=0 || h<=0) {
+		fprintf(stderr, "%s: no csv tile layer with id %d\n", name, layerid);
+		return false;
+	}
+	const char *p=csv.c_str();
+	for (int i=0; i<w*h; i++) {
+		while (*p && (*p<'0' || *p>'9')) p++;
+		if (*p==0) {
+			fprintf(stderr, "%s: layer %d has less than %dx%d tiles\n", name, layerid, w, h);
+			return false;
+		}
+		out.push_back(tmx_tilemap_ent(strtoul(p, (char**)&p, 10), palstart));
+	}
+	*mw=w;
+	*mh=h;
+	return true;
+}
+
+static void put16(vector<uint8_t> &b, uint16_t v) {
+	b.push_back(v);
+	b.push_back(v>>8);
+}
+
+static void put32(vector<uint8_t> &b, uint32_t v) {
+	put16(b, v);
+	put16(b, v>>16);
+}
+
+static bool write_blob(const char *name, int type, int w, int h, int bpp, const vector<uint32_t> &pal, const vector<uint8_t> &data) {
+	vector<uint8_t> b;
+	put32(b, GFX_BLOB_MAGIC);
+	put16(b, GFX_BLOB_VERSION);
+	put16(b, type);
+	put16(b, w);
+	put16(b, h);
+	put16(b, bpp);
+	put16(b, pal.size());
+	put32(b, data.size());
+	for (uint32_t p:pal) put32(b, p);
+	b.insert(b.end(), data.begin(), data.end());
+	FILE *f=fopen(name, "wb");
+	if (f==NULL) {
+		perror(name);
+		return false;
+	}
+	bool ok=(fwrite(b.data(), 1, b.size(), f)==b.size());
+	if (fclose(f)!=0) ok=false;
+	if (!ok) perror(name);
+	return ok;
+}
+
+static vector<uint8_t> words_to_bytes(const vector<uint32_t> &w) {
+	vector<uint8_t> b;
+	for (uint32_t v:w) put32(b, v);
+	return b;
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-b bpp] [-l layer] [-p palstart] [-c colors] tiles|fb|tilemap infile outfile\n"
+		"  tiles:   png/tga tileset to GFXTILES data and palette\n"
+		"  fb:      png/tga image to framebuffer data and palette\n"
+		"  tilemap: tiled tmx map (csv layer) to GFXTILEMAPx entries\n"
+		"  -b: framebuffer bits per pixel, 4 or 8 (default 4)\n"
+		"  -l: tmx layer id to convert (default 1)\n"
+		"  -p: palette start for tilemap entries, multiple of 8 (default 0)\n"
+		"  -c: max palette entries to store (default all)\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	int bpp=4, layer=1, palstart=0, maxcolors=-1;
+	int opt;
+	while ((opt=getopt(argc, argv, "b:l:p:c:"))!=-1) {
+		switch (opt) {
+			case 'b':
+				bpp=atoi(optarg);
+				if (bpp!=4 && bpp!=8) usage(argv[0]);
+				break;
+			case 'l':
+				layer=atoi(optarg);
+				break;
+			case 'p':
+				palstart=atoi(optarg);
+				if (palstart<0 || (palstart&7)) usage(argv[0]);
+				break;
+			case 'c':
+				maxcolors=atoi(optarg);
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+	if (argc-optind!=3) usage(argv[0]);
+	const char *mode=argv[optind], *in=argv[optind+1], *out=argv[optind+2];
+
+	bool ok=false;
+	if (strcmp(mode, "tilemap")==0) {
+		vector<uint32_t> ents;
+		int w, h;
+		ok=conv_tmx(in, layer, palstart, ents, &w, &h);
+		if (ok) ok=write_blob(out, GFX_BLOB_TILEMAP, w, h, 0, vector<uint32_t>(), words_to_bytes(ents));
+	} else if (strcmp(mode, "tiles")==0 || strcmp(mode, "fb")==0) {
+		image_t img;
+		if (!load_image(in, &img)) return 1;
+		if (maxcolors>=0 && (int)img.pal.size()>maxcolors) img.pal.resize(maxcolors);
+		if (mode[0]=='t') {
+			vector<uint32_t> tiles;
+			int tw, th;
+			conv_tiles(&img, tiles, &tw, &th);
+			ok=write_blob(out, GFX_BLOB_TILES, tw, th, 0, img.pal, words_to_bytes(tiles));
+		} else {
+			vector<uint8_t> fb;
+			if (!conv_fb(&img, bpp, fb)) {
+				fprintf(stderr, "%s: image uses more than 16 colors, can't convert to 4 bpp\n", in);
+				return 1;
+			}
+			ok=write_blob(out, GFX_BLOB_FB, img.w, img.h, bpp, img.pal, fb);
+		}
+	} else {
+		usage(argv[0]);
+	}
+	return ok?0:1;
+}
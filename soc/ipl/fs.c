@@ -28,6 +28,7 @@
 #include "hexdump.h"
 #include "ff.h"
 #include "diskio.h"
+#include "fs.h"
 
 //Offset and end of the filesystem partition
 #define FS_INT_PART_START 0x380000
@@ -94,6 +95,104 @@ static bool tj_flash_program(int addr, const uint8_t *buf, int len, void *arg) {
 
 static tjftl_t *ftl[2];
 
+//Write-back cache for single-sector writes. FatFS writes the FAT and directory sectors over and over,
+//and every write to tjftl costs a fresh sector on flash. Those writes are kept here until a sync,
+//until they're pushed out by other sectors, or until the filesystem has been idle for a while.
+//Multi-sector writes (file data) go straight to the ftl, and so does everything the host writes over
+//USB: it may be unplugged as soon as it thinks the write is done.
+#define DCACHE_SECTS 16
+#define DCACHE_IDLE_TICKS 60 //fs_idle() calls without disk writes before the cache is flushed
+//Once writes stop, fs_idle() also lets the ftl garbage collect ahead of time, so a big copy over USB
+//doesn't stall on it later. A sector moved costs a few ms of flash time; keep the step small enough
+//that the menu keeps its frame rate.
+#define GC_IDLE_TICKS 3
+#define GC_STEP_SECTS 4
+
+typedef struct {
+	bool valid;
+	bool dirty;
+	BYTE pdrv;
+	DWORD sector;
+	uint32_t lru;
+	uint8_t data[512];
+} dcache_ent_t;
+
+static dcache_ent_t dcache[DCACHE_SECTS];
+static uint32_t dcache_lru_ctr;
+static int dcache_idle;
+
+static dcache_ent_t *dcache_find(BYTE pdrv, DWORD sector) {
+	for (int i=0; i<DCACHE_SECTS; i++) {
+		if (dcache[i].valid && dcache[i].pdrv==pdrv && dcache[i].sector==sector) {
+			dcache[i].lru=dcache_lru_ctr++;
+			return &dcache[i];
+		}
+	}
+	return NULL;
+}
+
+static bool dcache_writeback(dcache_ent_t *e) {
+	if (!e->valid || !e->dirty) return true;
+	if (!tjftl_write(ftl[e->pdrv], e->sector, e->data)) {
+		printf("dcache: writeback of sect %d failed\n", e->sector);
+		return false;
+	}
+	e->dirty=false;
+	return true;
+}
+
+//Writes all dirty sectors of a drive (or all drives if pdrv is -1) to the ftl.
+static bool dcache_flush(int pdrv) {
+	bool ok=true;
+	for (int i=0; i<DCACHE_SECTS; i++) {
+		if (pdrv==-1 || dcache[i].pdrv==pdrv) ok&=dcache_writeback(&dcache[i]);
+	}
+	return ok;
+}
+
+static bool dcache_write(BYTE pdrv, DWORD sector, const BYTE *buff) {
+	dcache_ent_t *e=dcache_find(pdrv, sector);
+	if (!e) {
+		//Re-use the least recently used entry
+		e=&dcache[0];
+		for (int i=0; i<DCACHE_SECTS && e->valid; i++) {
+			if (!dcache[i].valid || dcache[i].lru<e->lru) e=&dcache[i];
+		}
+		if (!dcache_writeback(e)) return false;
+		e->valid=true;
+		e->pdrv=pdrv;
+		e->sector=sector;
+		e->lru=dcache_lru_ctr++;
+	}
+	memcpy(e->data, buff, 512);
+	e->dirty=true;
+	return true;
+}
+
+//Drops cached copies of sectors that are about to be overwritten directly.
+static void dcache_invalidate(BYTE pdrv, DWORD sector, UINT count) {
+	for (int i=0; i<DCACHE_SECTS; i++) {
+		if (dcache[i].valid && dcache[i].pdrv==pdrv && dcache[i].sector-sector<count) dcache[i].valid=false;
+	}
+}
+
+void fs_sync() {
+	dcache_flush(-1);
+	dcache_idle=0;
+}
+
+void fs_idle() {
+	if (dcache_idle<DCACHE_IDLE_TICKS) {
+		dcache_idle++;
+		if (dcache_idle==DCACHE_IDLE_TICKS) dcache_flush(-1);
+	}
+	if (dcache_idle>=GC_IDLE_TICKS) {
+		for (int i=0; i<2; i++) {
+			if (ftl[i]) tjftl_gc_step(ftl[i], GC_STEP_SECTS);
+		}
+	}
+}
+
 DSTATUS disk_status (BYTE pdrv) {
 	if (pdrv>PDRV_MAX) return STA_NOINIT;
 //	printf("disk_status %d\n", pdrv);
@@ -110,31 +209,44 @@ DRESULT disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count) {
 	if (pdrv>PDRV_MAX) return RES_NOTRDY;
 //	printf("disk_read disk %d sector %d count %d\n", pdrv, sector, count);
 	bool ok=true;
-	while(count) {
-		ok&=tjftl_read(ftl[pdrv], sector, buff);
-		count--;
-		sector++;
-		buff+=512;
+	while (count && ok) {
+		//Read runs of sectors that aren't in the cache in one go
+		UINT n=0;
+		while (n<count && !dcache_find(pdrv, sector+n)) n++;
+		if (n) {
+			ok=tjftl_read_multi(ftl[pdrv], sector, n, buff);
+		} else {
+			memcpy(buff, dcache_find(pdrv, sector)->data, 512);
+			n=1;
+		}
+		count-=n;
+		sector+=n;
+		buff+=512*n;
 	}
 	if (!ok) printf("disk_read: error at sect %d count %d\n", sector, count);
 	return ok?RES_OK:RES_ERROR;
 }
 
-DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count) {
+static DRESULT disk_write_cached(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count, bool use_cache) {
 	if (pdrv>PDRV_MAX) return RES_NOTRDY;
 //	printf("disk_write disk %d sector %d count %d\n", pdrv, sector, count);
 
-	bool ok=true;
-	while(count) {
-		ok&=tjftl_write(ftl[pdrv], sector, buff);
-		count--;
-		sector++;
-		buff+=512;
+	bool ok;
+	if (count==1 && use_cache) {
+		ok=dcache_write(pdrv, sector, buff);
+	} else {
+		dcache_invalidate(pdrv, sector, count);
+		ok=tjftl_write_multi(ftl[pdrv], sector, count, buff);
 	}
+	dcache_idle=0;
 	if (!ok) printf("disk_write: error at sect %d count %d\n", sector, count);
 	return ok?RES_OK:RES_ERROR;
 }
 
+DRESULT disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count) {
+	return disk_write_cached(pdrv, buff, sector, count, true);
+}
+
 DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
 	if (pdrv>PDRV_MAX) return RES_NOTRDY;
 	if (ftl[pdrv]==NULL) return RES_NOTRDY;
@@ -151,8 +263,14 @@ DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void *buff) {
 		DWORD *s=(DWORD*)buff;
 		*s=512;
 		return RES_OK;
+	} else if (cmd==CTRL_SYNC) {
+		return dcache_flush(pdrv)?RES_OK:RES_ERROR;
 	} else if (cmd==CTRL_TRIM) {
-		//ToDo
+		//buff points to the first and last sector of the range
+		DWORD *s=(DWORD*)buff;
+		if (s[1]<s[0]) return RES_PARERR;
+		dcache_invalidate(pdrv, s[0], s[1]-s[0]+1);
+		return tjftl_trim(ftl[pdrv], s[0], s[1]-s[0]+1)?RES_OK:RES_ERROR;
 	}
 	return RES_PARERR;
 }
@@ -166,10 +284,12 @@ void usb_msc_on() {
 	//umount
 	f_mount(NULL, "int:", 0);
 	if (ftl[1]) f_mount(NULL, "cart:", 0);
+	fs_sync();
 	msc_enabled=true;
 }
 
 void usb_msc_off() {
+	fs_sync();
 	if (!msc_enabled) return;
 	int res=f_mount(&fs[0], "int:", 1); //force mount
 	if (res!=FR_OK) {
@@ -313,14 +433,17 @@ bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, boo
 {
   (void) lun;
   (void) power_condition;
+  if (load_eject && !start) fs_sync(); //host ejected the disk
   return true;
 }
 
 // Callback invoked when received READ10 command.
 // Copy disk's data to buffer (up to bufsize) and return number of copied bytes.
+// Tinyusb hands over transfers in CFG_TUD_MSC_BUFSIZE chunks and advances lba for every chunk, so
+// offset stays 0 as long as we consume whole sectors.
 int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buffer, uint32_t bufsize) {
 	if (offset!=0) printf("Eek! tud_msc_read10_cb has offset; %d\n", offset);
-	disk_read(lun, buffer, lba, bufsize/512);
+	if (disk_read(lun, buffer, lba, bufsize/512)!=RES_OK) return -1;
 	return bufsize;
 }
 
@@ -328,7 +451,7 @@ int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void* buff
 // Process data in buffer to disk's storage and return number of written bytes
 int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t* buffer, uint32_t bufsize) {
 	if (offset!=0) printf("Eek! tud_msc_write10_cb has offset; %d\n", offset);
-	disk_write(lun, buffer, lba, bufsize/512);
+	if (disk_write_cached(lun, buffer, lba, bufsize/512, false)!=RES_OK) return -1;
 	return bufsize;
 }
 
@@ -347,6 +470,10 @@ int32_t tud_msc_scsi_cb (uint8_t lun, uint8_t const scsi_cmd[16], void* buffer,
 			// Host is about to read/write etc ... better not to disconnect disk
 			resplen = 0;
 			break;
+		case 0x35: //SYNCHRONIZE CACHE (10)
+			fs_sync();
+			resplen = 0;
+			break;
 		default:
 			// Set Sense = Invalid Command Operation
 			tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, 0x20, 0x00);
@@ -3,5 +3,12 @@ void fs_init();
 void usb_msc_off();
 void usb_msc_on();
 
+//Writes cached sectors to flash.
+void fs_sync();
+//Call regularly (e.g. once a frame) from idle loops; flushes the sector cache once nothing has been
+//written for a while, and does some flash garbage collection in the background. Apps don't call this,
+//so the cache is flushed before an app starts; after that, only FatFS syncs flush it.
+void fs_idle();
+
 int fs_cart_ftl_active();
 int fs_cart_initialize_fat();
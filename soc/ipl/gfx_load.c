@@ -15,12 +15,48 @@
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include "lodepng/lodepng.h"
 #include "gfx_load.h"
 #include "user_memfn.h"
 #include "yxml/yxml.h"
 #include "mach_defines.h"
 
+//Packs a line of 4-bit pixels, left pixel in the low nibble. Writes whole words when it can.
+static void pack_4bpp_line(uint8_t *dst, const uint8_t *line, int w) {
+	int x=0;
+	if ((((uintptr_t)dst)&3)==0) {
+		uint32_t *dw=(uint32_t*)dst;
+		for (; x+8<=w; x+=8) {
+			uint32_t v=0;
+			for (int i=7; i>=0; i--) v=(v<<4)|(line[x+i]&0xf);
+			*dw++=v;
+		}
+	}
+	for (; x+1<w; x+=2) {
+		dst[x/2]=(line[x]&0xf)|(line[x+1]<<4);
+	}
+	if (x<w) dst[x/2]=line[x]&0xf;
+}
+
+//Packs row y of a tileset image, one byte per pixel, into the tiles in tilemem. Tiles are
+//numbered left-to-right, top-to-bottom; colors over 15 are mapped to 0.
+static void pack_tiles_line(uint32_t *tilemem, const uint8_t *line, int y, int w) {
+	uint32_t *tmptr=&tilemem[((y&15)+(y/16)*(w/16)*16)*2];
+	for (int x=0; x+16<=w; x+=16) {
+		uint32_t wd[2]={0, 0};
+		for (int z=15; z>=0; z--) {
+			int c=line[x+z];
+			if (c>15) c=0;
+			wd[z>>3]=(wd[z>>3]<<4)|c;
+		}
+		tmptr[0]=wd[0];
+		tmptr[1]=wd[1];
+		tmptr+=32;
+	}
+}
+
 static void set_tmx_tilemap_ent(uint32_t *tilemap, int tilemaph, int tilemapw, int tx, int ty, int tileval, int palstart) {
 	if (tx<tilemapw && ty<tilemaph) {
 		int tileno=tileval&0xfffffff;
@@ -112,7 +148,8 @@ int gfx_load_tilemap_mem(uint32_t *tilemap, int tilemaph, int tilemapw, int laye
 	return (r>=0);
 }
 
-int gfx_load_fb_mem(uint8_t *fbmem, uint32_t *palmem, int fbbpp, int pitch, char *pngstart, int pnglen) {
+//Fallback for pngs the row decoder does not handle; decodes the whole image with lodepng.
+static int gfx_load_fb_lodepng(uint8_t *fbmem, uint32_t *palmem, int fbbpp, int pitch, char *pngstart, int pnglen) {
 	unsigned char *decoded=NULL;
 	unsigned int w=0, h=0;
 	if (fbbpp!=8 && fbbpp!=4) return -1;
@@ -155,7 +192,7 @@ int gfx_load_fb_mem(uint8_t *fbmem, uint32_t *palmem, int fbbpp, int pitch, char
 	return 0;
 }
 
-int gfx_load_tiles_mem(uint32_t *tilemem, uint32_t *palettemem, char *pngstart, int pnglen) {
+static int gfx_load_tiles_lodepng(uint32_t *tilemem, uint32_t *palettemem, char *pngstart, int pnglen) {
 	unsigned char *decoded;
 	unsigned int w, h;
 	LodePNGState st={0};
@@ -201,6 +238,229 @@ int gfx_load_tiles_mem(uint32_t *tilemem, uint32_t *palettemem, char *pngstart,
 	return 0;
 }
 
+//The row decoder below handles indexed and greyscale non-interlaced pngs. Instead of having
+//lodepng decode the entire image into a buffer and picking pixels out of that, it inflates the
+//image data and then unfilters and converts it a row at a time, straight into the tile or
+//framebuffer memory. lodepng can't inflate in pieces, so the inflated data (about the size of
+//the image) is still in memory, but the decoded copy of the image is not needed anymore.
+#define PNG_ROWS_UNSUPPORTED -1
+
+//Passed to the row callback. line is a scratch buffer of w bytes.
+typedef struct {
+	int w;
+	int h;
+	int bpp;
+	uint8_t *line;
+} png_rows_t;
+
+typedef void (*png_row_fn_t)(const png_rows_t *img, const uint8_t *row, int y, void *arg);
+
+static uint32_t png_be32(const uint8_t *p) {
+	return (p[0]<<24)|(p[1]<<16)|(p[2]<<8)|p[3];
+}
+
+static int png_unfilter_row(uint8_t *row, const uint8_t *prev, int len, int filter) {
+	if (filter==0) return 0;
+	if (filter==1) {
+		for (int i=1; i<len; i++) row[i]+=row[i-1];
+	} else if (filter==2) {
+		if (prev) for (int i=0; i<len; i++) row[i]+=prev[i];
+	} else if (filter==3) {
+		if (prev) {
+			row[0]+=prev[0]>>1;
+			for (int i=1; i<len; i++) row[i]+=(row[i-1]+prev[i])>>1;
+		} else {
+			for (int i=1; i<len; i++) row[i]+=row[i-1]>>1;
+		}
+	} else if (filter==4) {
+		if (prev) {
+			row[0]+=prev[0];
+			for (int i=1; i<len; i++) {
+				int a=row[i-1], b=prev[i], c=prev[i-1];
+				int pa=abs(b-c), pb=abs(a-c), pc=abs(a+b-c-c);
+				row[i]+=(pa<=pb && pa<=pc)?a:((pb<=pc)?b:c);
+			}
+		} else {
+			//Without a previous row, Paeth is the same as Sub.
+			for (int i=1; i<len; i++) row[i]+=row[i-1];
+		}
+	} else {
+		return 1;
+	}
+	return 0;
+}
+
+//Expands a row of 1, 2 or 4-bit pixels into a byte per pixel.
+static void png_expand_row(const uint8_t *src, uint8_t *dst, int w, int bpp) {
+	int x=0;
+	if (bpp==4) {
+		for (; x+2<=w; x+=2) {
+			int b=*src++;
+			dst[x]=b>>4;
+			dst[x+1]=b&0xf;
+		}
+		if (x<w) dst[x]=*src>>4;
+	} else if (bpp==2) {
+		for (; x<w; x++) dst[x]=(src[x>>2]>>(6-(x&3)*2))&3;
+	} else if (bpp==1) {
+		for (; x<w; x++) dst[x]=(src[x>>3]>>(7-(x&7)))&1;
+	} else {
+		memcpy(dst, src, w);
+	}
+}
+
+//Decodes the png a row at a time and calls cb for every row with the unfiltered, still packed,
+//pixel data. Writes the palette to palmem for indexed pngs. Returns 0 on success, a lodepng
+//error, or PNG_ROWS_UNSUPPORTED if the png needs to be decoded the slow way.
+static int png_decode_rows(const uint8_t *png, int pnglen, uint32_t *palmem, png_row_fn_t cb, void *arg) {
+	unsigned w, h;
+	LodePNGState st;
+	lodepng_state_init(&st);
+	int r=lodepng_inspect(&w, &h, &st, png, pnglen);
+	int ct=st.info_png.color.colortype;
+	int bpp=st.info_png.color.bitdepth;
+	int interlaced=st.info_png.interlace_method;
+	lodepng_state_cleanup(&st);
+	if (r) return r;
+	if ((ct!=LCT_PALETTE && ct!=LCT_GREY) || bpp>8 || interlaced) return PNG_ROWS_UNSUPPORTED;
+
+	//Find the palette and the image data
+	uint32_t pal[256];
+	int palct=0;
+	const uint8_t *idat=NULL;
+	int idatlen=0, idatct=0;
+	for (int pos=8; pos+12<=pnglen; ) {
+		int len=png_be32(&png[pos]);
+		const uint8_t *type=&png[pos+4], *data=&png[pos+8];
+		//pnglen-pos-12 can't go negative here; pos+12+len could overflow for a bogus len.
+		if (len<0 || len>pnglen-pos-12) return PNG_ROWS_UNSUPPORTED;
+		if (memcmp(type, "PLTE", 4)==0) {
+			palct=len/3;
+			if (palct>256) palct=256;
+			for (int i=0; i<palct; i++) pal[i]=data[i*3]|(data[i*3+1]<<8)|(data[i*3+2]<<16)|(0xffU<<24);
+		} else if (memcmp(type, "tRNS", 4)==0 && ct==LCT_PALETTE) {
+			for (int i=0; i<len && i<palct; i++) pal[i]=(pal[i]&0xffffff)|(data[i]<<24);
+		} else if (memcmp(type, "IDAT", 4)==0) {
+			if (idatct==0) idat=data;
+			idatct++;
+			idatlen+=len;
+		} else if (memcmp(type, "IEND", 4)==0) {
+			break;
+		}
+		pos+=12+len;
+	}
+	if (idat==NULL) return PNG_ROWS_UNSUPPORTED;
+	if (ct==LCT_PALETTE) {
+		for (int i=0; i<palct; i++) palmem[i]=pal[i];
+	}
+
+	//Multiple IDAT chunks form one zlib stream, so they need to be glued together.
+	uint8_t *idatbuf=NULL;
+	if (idatct>1) {
+		idatbuf=user_memfn_malloc(idatlen);
+		if (idatbuf==NULL) return 83; //lodepng 'memory allocation failed'
+		int p=0;
+		for (int pos=8; pos+12<=pnglen && p<idatlen; ) {
+			int len=png_be32(&png[pos]);
+			if (memcmp(&png[pos+4], "IDAT", 4)==0) {
+				memcpy(&idatbuf[p], &png[pos+8], len);
+				p+=len;
+			}
+			pos+=12+len;
+		}
+		idat=idatbuf;
+	}
+
+	uint8_t *raw=NULL;
+	size_t rawlen=0;
+	r=lodepng_zlib_decompress(&raw, &rawlen, idat, idatlen, &lodepng_default_decompress_settings);
+	user_memfn_free(idatbuf);
+	if (r) {
+		user_memfn_free(raw);
+		return r;
+	}
+	int rowlen=(w*bpp+7)/8;
+	png_rows_t img={
+		.w=w,
+		.h=h,
+		.bpp=bpp,
+		.line=user_memfn_malloc(w),
+	};
+	if (rawlen < (size_t)(rowlen+1)*h) r=91; //lodepng 'invalid decompressed idat size'
+	if (img.line==NULL) r=83;
+	if (r) {
+		user_memfn_free(img.line);
+		user_memfn_free(raw);
+		return r;
+	}
+	//Unfilter in place; the previous row is already unfiltered by the time we need it.
+	uint8_t *prev=NULL;
+	for (int y=0; y<h; y++) {
+		uint8_t *row=&raw[y*(rowlen+1)];
+		if (png_unfilter_row(row+1, prev, rowlen, row[0])) {
+			r=36; //lodepng 'illegal PNG filter type'
+			break;
+		}
+		cb(&img, row+1, y, arg);
+		prev=row+1;
+	}
+	user_memfn_free(img.line);
+	user_memfn_free(raw);
+	return r;
+}
+
+typedef struct {
+	uint8_t *fbmem;
+	int fbbpp;
+	int pitch;
+} png_fb_ctx_t;
+
+static void png_fb_row(const png_rows_t *img, const uint8_t *row, int y, void *arg) {
+	png_fb_ctx_t *c=(png_fb_ctx_t*)arg;
+	uint8_t *dst=&c->fbmem[(y*c->pitch*c->fbbpp)/8];
+	if (img->bpp==8 && c->fbbpp==8) {
+		memcpy(dst, row, img->w);
+	} else if (img->bpp==4 && c->fbbpp==4) {
+		//png has the left pixel in the high nibble, the hardware in the low one.
+		for (int i=0; i<(img->w+1)/2; i++) dst[i]=(row[i]>>4)|(row[i]<<4);
+	} else {
+		png_expand_row(row, img->line, img->w, img->bpp);
+		if (c->fbbpp==8) {
+			memcpy(dst, img->line, img->w);
+		} else {
+			pack_4bpp_line(dst, img->line, img->w);
+		}
+	}
+}
+
+int gfx_load_fb_mem(uint8_t *fbmem, uint32_t *palmem, int fbbpp, int pitch, char *pngstart, int pnglen) {
+	if (fbbpp!=8 && fbbpp!=4) return -1;
+	png_fb_ctx_t c={
+		.fbmem=fbmem,
+		.fbbpp=fbbpp,
+		.pitch=pitch,
+	};
+	int r=png_decode_rows((uint8_t*)pngstart, pnglen, palmem, png_fb_row, &c);
+	if (r==PNG_ROWS_UNSUPPORTED) r=gfx_load_fb_lodepng(fbmem, palmem, fbbpp, pitch, pngstart, pnglen);
+	return r;
+}
+
+static void png_tiles_row(const png_rows_t *img, const uint8_t *row, int y, void *arg) {
+	//Only whole rows of tiles are loaded
+	if (y >= (img->h&~15)) return;
+	if (img->bpp!=8) {
+		png_expand_row(row, img->line, img->w, img->bpp);
+		row=img->line;
+	}
+	pack_tiles_line((uint32_t*)arg, row, y, img->w);
+}
+
+int gfx_load_tiles_mem(uint32_t *tilemem, uint32_t *palettemem, char *pngstart, int pnglen) {
+	int r=png_decode_rows((uint8_t*)pngstart, pnglen, palettemem, png_tiles_row, tilemem);
+	if (r==PNG_ROWS_UNSUPPORTED) r=gfx_load_tiles_lodepng(tilemem, palettemem, pngstart, pnglen);
+	return r;
+}
+
 typedef struct __attribute__((packed)) {
 	uint8_t idlength;
 	uint8_t colormaptype;
@@ -217,50 +477,102 @@ typedef struct __attribute__((packed)) {
 } tga_hdr_t;
 
 
-static int tga_load_clut(uint32_t *palmem, tga_hdr_t *hdr, int loadmax, tga_read_fn_t readfn, void *arg) {
-	int sz=0;
-	if (hdr->colormapdepth==16) {
-		sz=hdr->colormaplength*2;
-	} else if (hdr->colormapdepth==24) {
-		sz=hdr->colormaplength*3;
-	} else if (hdr->colormapdepth==32) {
-		sz=hdr->colormaplength*4;
+//User callbacks are promised to never be asked for more than this per call.
+#define TGA_CB_CHUNK 256
+//Read size for tga files read from a file descriptor. Large reads go through FatFS and tjftl
+//straight into the flash DMA.
+#define TGA_FD_CHUNK 4096
+
+//Decoder state. Data is pulled in through readfn in chunks of up to chunklen bytes, and is
+//decoded from there a whole packet at a time.
+typedef struct {
+	tga_read_fn_t readfn;
+	void *arg;
+	int chunklen;
+	const uint8_t *ptr;		//unread data in the current chunk
+	int avail;				//bytes left at ptr
+	int pkt_left;			//pixels left in the current RLE packet
+	uint8_t pkt_is_run;
+	uint8_t run_val;
+	uint8_t is_rle;
+} tga_decoder_t;
+
+//Makes sure there is data in the current chunk. Returns the amount available; 0 on end of file.
+static int tga_fill(tga_decoder_t *dec) {
+	if (dec->avail) return dec->avail;
+	int r=0;
+	dec->ptr=dec->readfn(dec->chunklen, &r, dec->arg);
+	if (dec->ptr==NULL || r<0) r=0;
+	dec->avail=r;
+	return r;
+}
+
+//Copies len bytes from the file into dst, or skips them if dst is NULL. Returns the amount of
+//bytes actually read.
+static int tga_read(tga_decoder_t *dec, uint8_t *dst, int len) {
+	int done=0;
+	while (done<len && tga_fill(dec)) {
+		int n=len-done;
+		if (n>dec->avail) n=dec->avail;
+		if (dst) memcpy(&dst[done], dec->ptr, n);
+		dec->ptr+=n;
+		dec->avail-=n;
+		done+=n;
 	}
-	if (sz==0) return 1;
-	uint8_t *colormap=malloc(sz);
-	//Copy over color map... we promised never to read more than 256 bytes, so this possibly needs to happen in chunks.
-	for (int i=0; i<sz; i+=256) {
-		int r;
-		int len=(sz-i);
-		if (len>256) len=256;
-		uint8_t *m=readfn(len, &r, arg);
-		if (r!=len) {
-			free(colormap);
-			return 1;
+	return done;
+}
+
+//Decodes the next n pixels into out. RLE runs are memset and raw packets are copied straight
+//from the read chunk. Returns 0 if the file ends early.
+static int tga_decode(tga_decoder_t *dec, uint8_t *out, int n) {
+	if (!dec->is_rle) return (tga_read(dec, out, n)==n);
+	while (n) {
+		if (dec->pkt_left==0) {
+			uint8_t hdr;
+			if (tga_read(dec, &hdr, 1)!=1) return 0;
+			dec->pkt_left=(hdr&0x7f)+1;
+			dec->pkt_is_run=hdr>>7;
+			if (dec->pkt_is_run && tga_read(dec, &dec->run_val, 1)!=1) return 0;
 		}
-		memcpy(&colormap[i], m, len);
+		int len=(n<dec->pkt_left)?n:dec->pkt_left;
+		if (dec->pkt_is_run) {
+			memset(out, dec->run_val, len);
+		} else if (tga_read(dec, out, len)!=len) {
+			return 0;
+		}
+		out+=len;
+		n-=len;
+		dec->pkt_left-=len;
+	}
+	return 1;
+}
+
+static int tga_load_clut(uint32_t *palmem, tga_hdr_t *hdr, int loadmax, tga_decoder_t *dec) {
+	int entsz=hdr->colormapdepth/8;
+	if (entsz<2 || entsz>4) return 1;
+	int sz=hdr->colormaplength*entsz;
+	uint8_t *colormap=malloc(sz);
+	if (colormap==NULL) return 1;
+	if (tga_read(dec, colormap, sz)!=sz) {
+		free(colormap);
+		return 1;
 	}
 	
 	uint8_t *p=colormap;
 	for (int i=0; i<hdr->colormaplength; i++) {
 		int r, g, b, a;
-		if (hdr->colormapdepth==16) {
+		if (entsz==2) {
 			int c=(*p++);
 			c|=((*p++)<<8);
 			b=((c>>0)&0x1F)*8;
 			g=((c>>5)&0x1F)*8;
 			r=((c>>10)&0x1F)*8;
 			a=((c>>15)&0x1F)*255;
-		} else if (hdr->colormapdepth==24) {
-			b=*p++;
-			g=*p++;
-			r=*p++;
-			a=255;
-		} else if (hdr->colormapdepth==32) {
+		} else {
 			b=*p++;
 			g=*p++;
 			r=*p++;
-			a=*p++;
+			a=(entsz==4)?*p++:255;
 		}
 		palmem[i]=(r<<0)|(g<<8)|(b<<16)|(a<<24);
 	}
@@ -268,141 +580,87 @@ static int tga_load_clut(uint32_t *palmem, tga_hdr_t *hdr, int loadmax, tga_read
 	return 0;
 }
 
-
-typedef struct {
-	tga_read_fn_t readfn;
-	void *arg;
-	uint8_t *bufptr;
-	int bufpos;
-	uint8_t reps;
-	uint8_t rle_byte;
-	uint8_t is_rle;
-	uint8_t running;
-} tga_decoder_t;
-
-
-static uint8_t tga_get_next_raw_byte(tga_decoder_t *dec) {
-	if (!dec->running || dec->bufpos==256) {
-		dec->running=1;
-		dec->bufpos=0;
-		int r;
-		dec->bufptr=dec->readfn(256, &r, dec->arg);
-	}
-	return dec->bufptr[dec->bufpos++];
-}
-
-static uint8_t tga_get_next_pixel(tga_decoder_t *dec) {
-	if (!dec->is_rle) {
-		return tga_get_next_raw_byte(dec);
-	} else {
-		if (dec->reps==0 || dec->reps==0x80) {
-			dec->reps=tga_get_next_raw_byte(dec);
-			dec->rle_byte=tga_get_next_raw_byte(dec);
-			return dec->rle_byte; //need to return it in both cases
-		} else {
-			dec->reps--;
-			if (dec->reps&0x80) {
-				return dec->rle_byte;
-			} else {
-				return tga_get_next_raw_byte(dec);
-			}
-		}
-	}
-}
-
-static int gfx_load_tga_common(tga_read_fn_t readfn, void *arg, tga_hdr_t *hdr, tga_decoder_t *dec) {
-	int r;
-	uint8_t buf[256];
-	uint8_t *rd=readfn(sizeof(tga_hdr_t), &r, arg);
-	if (r<sizeof(tga_hdr_t)) return 1;
-	memcpy(hdr, rd, sizeof(tga_hdr_t));
+static int gfx_load_tga_common(tga_read_fn_t readfn, void *arg, int chunklen, tga_hdr_t *hdr, tga_decoder_t *dec) {
+	memset(dec, 0, sizeof(tga_decoder_t));
+	dec->readfn=readfn;
+	dec->arg=arg;
+	dec->chunklen=chunklen;
+	if (tga_read(dec, (uint8_t*)hdr, sizeof(tga_hdr_t))!=sizeof(tga_hdr_t)) return 1;
 	if (hdr->datatypecode!=1 && hdr->datatypecode!=9) {
 		fprintf(stderr, "Not a supported TGA type.\n");
 		return 1;
 	}
-	if (hdr->idlength) {
-		//skip id field
-		readfn(hdr->idlength, &r, arg);
-		if (r!=hdr->idlength) return 1;
-	}
-	memset(dec, 0, sizeof(tga_decoder_t));
-	dec->readfn=readfn;
-	dec->arg=arg;
+	//skip id field
+	if (tga_read(dec, NULL, hdr->idlength)!=hdr->idlength) return 1;
 	dec->is_rle=(hdr->datatypecode==9);
 	return 0;
 }
 
-int gfx_load_fb_tga(uint8_t *fbmem, uint32_t *palmem, int fbbpp, int pitch, tga_read_fn_t readfn, void *arg) {
+static int gfx_load_fb_tga_chunked(uint8_t *fbmem, uint32_t *palmem, int fbbpp, int pitch, tga_read_fn_t readfn, void *arg, int chunklen) {
 	tga_hdr_t hdr;
 	tga_decoder_t dec;
-	int r=gfx_load_tga_common(readfn, arg, &hdr, &dec);
+	if (fbbpp!=4 && fbbpp!=8) return 1;
+	int r=gfx_load_tga_common(readfn, arg, chunklen, &hdr, &dec);
 	if (r) return r;
-	r=tga_load_clut(palmem, &hdr, fbbpp==4?16:256, readfn, arg);
+	r=tga_load_clut(palmem, &hdr, fbbpp==4?16:256, &dec);
 	if (r) return r;
 
 	int from_top=hdr.imagedescriptor&(1<<5);
-	
-	int p=0;
-	if (fbbpp==8) {
-		if (!from_top) p=pitch*(hdr.height-1);
-		for (int y=0; y<hdr.height; y++) {
-			for (int x=0; x<hdr.width; x++) {
-				fbmem[p+x]=tga_get_next_pixel(&dec);
-			}
-			if (from_top) {
-				p-=pitch;
-			} else {
-				p+=pitch;
-			}
-		}
-	} else { //fbbpp=4
-		if (!from_top) p=pitch*(hdr.height-1)/2;
-		for (int y=0; y<hdr.height; y++) {
-			for (int x=0; x<hdr.width/2; x++) {
-				int c1=tga_get_next_pixel(&dec);
-				int c2=tga_get_next_pixel(&dec);
-				fbmem[p+x]=(c2<<4)|c1;
+	int bpitch=(pitch*fbbpp)/8;
+	uint8_t *line=NULL;
+	if (fbbpp==4) {
+		line=malloc(hdr.width);
+		if (line==NULL) return 1;
+	}
+	for (int y=0; y<hdr.height; y++) {
+		uint8_t *row=&fbmem[(from_top?y:(hdr.height-1-y))*bpitch];
+		if (fbbpp==8) {
+			//Decode straight into the framebuffer
+			if (!tga_decode(&dec, row, hdr.width)) {
+				r=1;
+				break;
 			}
-			if (from_top) {
-				p+=pitch/2;
-			} else {
-				p-=pitch/2;
+		} else {
+			if (!tga_decode(&dec, line, hdr.width)) {
+				r=1;
+				break;
 			}
+			pack_4bpp_line(row, line, hdr.width);
 		}
 	}
-	return 0;
+	free(line);
+	return r;
 }
 
-int gfx_load_tiles_tga(uint32_t *tilemem, uint32_t *palettemem, tga_read_fn_t readfn, void *arg) {
+static int gfx_load_tiles_tga_chunked(uint32_t *tilemem, uint32_t *palettemem, tga_read_fn_t readfn, void *arg, int chunklen) {
 	tga_hdr_t hdr;
 	tga_decoder_t dec;
-	int r=gfx_load_tga_common(readfn, arg, &hdr, &dec);
+	int r=gfx_load_tga_common(readfn, arg, chunklen, &hdr, &dec);
 	if (r) return r;
-	r=tga_load_clut(palettemem, &hdr, 16, readfn, arg);
+	r=tga_load_clut(palettemem, &hdr, 16, &dec);
 	if (r) return r;
 
 	int from_top=hdr.imagedescriptor&(1<<5);
+	uint8_t *line=malloc(hdr.width);
+	if (line==NULL) return 1;
 	
-	int tilepitch=(hdr.width/16);
-	
-	int ry=from_top?0:hdr.height-1;
 	for (int y=0; y<hdr.height; y++) {
-		int in_tile_y=ry&15;
-		uint32_t *tmptr=&tilemem[((ry&15)+(ry/16)*tilepitch*16)*2];
-		for (int x=0; x<hdr.width; x+=16) {
-			uint64_t tp;
-			for (int z=0; z<16; z++) {
-				int c=tga_get_next_pixel(&dec);
-				if (c>15) c=0;
-				tp=(tp>>4)|((uint64_t)c<<60UL);
-			}
-			tmptr[0]=tp;
-			tmptr[1]=tp>>32;
-			tmptr+=32;
+		if (!tga_decode(&dec, line, hdr.width)) {
+			r=1;
+			break;
 		}
-		if (from_top) ry++; else ry--;
+		pack_tiles_line(tilemem, line, from_top?y:hdr.height-1-y, hdr.width);
 	}
-	return 0;
+	free(line);
+	return r;
+}
+
+int gfx_load_fb_tga(uint8_t *fbmem, uint32_t *palmem, int fbbpp, int pitch, tga_read_fn_t readfn, void *arg) {
+	return gfx_load_fb_tga_chunked(fbmem, palmem, fbbpp, pitch, readfn, arg, TGA_CB_CHUNK);
+}
+
+int gfx_load_tiles_tga(uint32_t *tilemem, uint32_t *palettemem, tga_read_fn_t readfn, void *arg) {
+	return gfx_load_tiles_tga_chunked(tilemem, palettemem, readfn, arg, TGA_CB_CHUNK);
 }
 
 
@@ -422,13 +680,14 @@ static uint8_t* tga_mem_rdr_cb(int len, int *retlen, void *arg) {
 	return ret;
 }
 
+//The file is in memory already, so hand it to the decoder in one chunk.
 int gfx_load_fb_tga_mem(uint8_t *fbmem, uint32_t *palmem, int fbbpp, int pitch, char *tgastart, int tgalen) {
 	tga_mem_rdr_t rdr={
 		.ptr=tgastart,
 		.len=tgalen,
 		.pos=0
 	};
-	return gfx_load_fb_tga(fbmem, palmem, fbbpp, pitch, tga_mem_rdr_cb, &rdr);
+	return gfx_load_fb_tga_chunked(fbmem, palmem, fbbpp, pitch, tga_mem_rdr_cb, &rdr, tgalen);
 }
 
 int gfx_load_tiles_tga_mem(uint32_t *tilemem, uint32_t *palmem, char *tgastart, int tgalen) {
@@ -437,6 +696,136 @@ int gfx_load_tiles_tga_mem(uint32_t *tilemem, uint32_t *palmem, char *tgastart,
 		.len=tgalen,
 		.pos=0
 	};
-	return gfx_load_tiles_tga(tilemem, palmem, tga_mem_rdr_cb, &rdr);
+	return gfx_load_tiles_tga_chunked(tilemem, palmem, tga_mem_rdr_cb, &rdr, tgalen);
+}
+
+typedef struct {
+	int fd;
+	uint8_t *buf;
+} tga_fd_rdr_t;
+
+static uint8_t* tga_fd_rdr_cb(int len, int *retlen, void *arg) {
+	tga_fd_rdr_t *rdr=(tga_fd_rdr_t*)arg;
+	*retlen=read(rdr->fd, rdr->buf, len);
+	return rdr->buf;
+}
+
+int gfx_load_fb_tga_fd(uint8_t *fbmem, uint32_t *palmem, int fbbpp, int pitch, int fd) {
+	tga_fd_rdr_t rdr={
+		.fd=fd,
+		.buf=malloc(TGA_FD_CHUNK)
+	};
+	if (rdr.buf==NULL) return 1;
+	int r=gfx_load_fb_tga_chunked(fbmem, palmem, fbbpp, pitch, tga_fd_rdr_cb, &rdr, TGA_FD_CHUNK);
+	free(rdr.buf);
+	return r;
+}
+
+int gfx_load_tiles_tga_fd(uint32_t *tilemem, uint32_t *palmem, int fd) {
+	tga_fd_rdr_t rdr={
+		.fd=fd,
+		.buf=malloc(TGA_FD_CHUNK)
+	};
+	if (rdr.buf==NULL) return 1;
+	int r=gfx_load_tiles_tga_chunked(tilemem, palmem, tga_fd_rdr_cb, &rdr, TGA_FD_CHUNK);
+	free(rdr.buf);
+	return r;
+}
+
+#define GFX_BLOB_MAX_PAL 256 //8-bit pixels can't index more
+#define GFX_BLOB_MAX_TILES 512 //what fits in tile memory
+
+//Checks a blob header and returns a pointer to the palette that follows it, or NULL if the
+//blob is not of the expected type or is truncated.
+static const uint8_t *gfx_blob_check(gfx_blob_hdr_t *hdr, int type, const void *blob, int bloblen) {
+	if (bloblen<(int)sizeof(gfx_blob_hdr_t)) return NULL;
+	memcpy(hdr, blob, sizeof(gfx_blob_hdr_t));
+	if (hdr->magic!=GFX_BLOB_MAGIC) {
+		fprintf(stderr, "gfx_load_blob: not a gfx blob\n");
+		return NULL;
+	}
+	if (hdr->version!=GFX_BLOB_VERSION || hdr->type!=type) {
+		fprintf(stderr, "gfx_load_blob: blob is version %d type %d, expected version %d type %d\n",
+				hdr->version, hdr->type, GFX_BLOB_VERSION, type);
+		return NULL;
+	}
+	if (hdr->palcount>GFX_BLOB_MAX_PAL) {
+		fprintf(stderr, "gfx_load_blob: blob has %d palette entries\n", hdr->palcount);
+		return NULL;
+	}
+	//Compare against what's left rather than adding up, so a huge datalen can't wrap around.
+	uint32_t left=bloblen-sizeof(gfx_blob_hdr_t);
+	if (hdr->palcount*4 > left) return NULL;
+	left-=hdr->palcount*4;
+	if (hdr->datalen > left) return NULL;
+	return (const uint8_t*)blob+sizeof(gfx_blob_hdr_t);
+}
+
+//Copies words to memory that needs 32-bit writes (palette, tile and tilemap memory). Binary
+//files embedded by objcopy are not necessarily word-aligned, so handle that as well.
+static void gfx_blob_copy_words(uint32_t *dst, const uint8_t *src, int words) {
+	if ((((uintptr_t)src)&3)==0) {
+		const uint32_t *s=(const uint32_t*)src;
+		for (int i=0; i<words; i++) dst[i]=s[i];
+	} else {
+		for (int i=0; i<words; i++) {
+			dst[i]=src[0]|(src[1]<<8)|(src[2]<<16)|(src[3]<<24);
+			src+=4;
+		}
+	}
+}
+
+int gfx_load_blob_tiles(uint32_t *tilemem, uint32_t *palettemem, const void *blob, int bloblen) {
+	gfx_blob_hdr_t hdr;
+	const uint8_t *p=gfx_blob_check(&hdr, GFX_BLOB_TILES, blob, bloblen);
+	if (p==NULL) return 1;
+	if ((uint32_t)hdr.width*hdr.height>GFX_BLOB_MAX_TILES || hdr.datalen>GFX_BLOB_MAX_TILES*32*4) {
+		fprintf(stderr, "gfx_load_blob_tiles: blob has more tiles than fit in tile memory\n");
+		return 1;
+	}
+	gfx_blob_copy_words(palettemem, p, hdr.palcount);
+	p+=hdr.palcount*4;
+	gfx_blob_copy_words(tilemem, p, hdr.datalen/4);
+	return 0;
 }
 
+int gfx_load_blob_fb(uint8_t *fbmem, uint32_t *palmem, int fbbpp, int pitch, const void *blob, int bloblen) {
+	gfx_blob_hdr_t hdr;
+	const uint8_t *p=gfx_blob_check(&hdr, GFX_BLOB_FB, blob, bloblen);
+	if (p==NULL) return 1;
+	if (hdr.bpp!=fbbpp) {
+		fprintf(stderr, "gfx_load_blob_fb: blob is %d bpp, framebuffer is %d bpp\n", hdr.bpp, fbbpp);
+		return 1;
+	}
+	if (hdr.width>pitch) {
+		fprintf(stderr, "gfx_load_blob_fb: blob is %d pixels wide, framebuffer pitch is %d\n", hdr.width, pitch);
+		return 1;
+	}
+	gfx_blob_copy_words(palmem, p, hdr.palcount);
+	p+=hdr.palcount*4;
+	int rowlen=(hdr.width*fbbpp+7)/8;
+	if (hdr.datalen < (uint32_t)rowlen*hdr.height) return 1;
+	int fbpitch=(pitch*fbbpp)/8;
+	if (fbpitch==rowlen) {
+		memcpy(fbmem, p, rowlen*hdr.height);
+	} else {
+		for (int y=0; y<hdr.height; y++) {
+			memcpy(&fbmem[y*fbpitch], &p[y*rowlen], rowlen);
+		}
+	}
+	return 0;
+}
+
+int gfx_load_blob_tilemap(uint32_t *tilemap, int tilemaph, int tilemapw, const void *blob, int bloblen) {
+	gfx_blob_hdr_t hdr;
+	const uint8_t *p=gfx_blob_check(&hdr, GFX_BLOB_TILEMAP, blob, bloblen);
+	if (p==NULL) return 1;
+	p+=hdr.palcount*4;
+	if (hdr.datalen < (uint32_t)hdr.width*hdr.height*4) return 1;
+	int w=(hdr.width<tilemapw)?hdr.width:tilemapw;
+	int h=(hdr.height<tilemaph)?hdr.height:tilemaph;
+	for (int y=0; y<h; y++) {
+		gfx_blob_copy_words(&tilemap[y*tilemapw], &p[y*hdr.width*4], w);
+	}
+	return 0;
+}
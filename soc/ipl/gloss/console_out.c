@@ -23,6 +23,8 @@
 #include "gloss/mach_defines.h"
 extern uint32_t GFXTILEMAPA[];
 extern uint32_t GFXTILEMAPB[];
+extern volatile uint32_t GFXREG[];
+#define GFX_REG(i) GFXREG[(i)/4]
 
 
 static int xpos=0;
@@ -38,6 +40,7 @@ static int win_x=0, win_y=0, win_w=30, win_h=20;
 #define CMD_SET_WINEND 'E'
 #define CMD_SET_MAP 'M'
 #define CMD_SET_ATTR 'A'
+#define CMD_SET_HWSCROLL 'S'
 
 #define STATE_NORM 0
 #define STATE_ESCAPED 1
@@ -48,32 +51,71 @@ static int argpos;
 static int attr=0;
 static int to_mapb=0;
 
-void console_write_char_raw(char c) {
-	uint32_t *map;
-	if (to_mapb) map=&GFXTILEMAPB[0]; else map=&GFXTILEMAPA[0];
+//Hardware scroll mode ('\0331S' to enable, '\0330S' to disable). Instead of copying the
+//window contents up a line, the console treats the tilemap as a ring of GFX_TILEMAP_H rows
+//and scrolls by moving the Y offset of the tile layer. As this moves the entire layer,
+//it's only useful if the console has the tilemap to itself; note that the window then is
+//where it is on the screen, not in the tilemap. Switching modes resets the offset and clears
+//the window. Both the mode and the offset are per tilemap.
+static int hwscroll[2]={0, 0};
+static int scroll_row[2]={0, 0}; //tilemap row at the top of the screen
 
-	if (xpos>=win_x+win_w) {
-		//Next line because we hit the end of the window.
-		xpos=win_x;
-		ypos++;
-	}
+static uint32_t *console_map() {
+	return to_mapb?&GFXTILEMAPB[0]:&GFXTILEMAPA[0];
+}
 
-	if (ypos>=win_y+win_h) {
-		//Scroll up the window
+//Returns the tilemap row that is shown at screen row y
+static uint32_t *console_row(int y) {
+	if (hwscroll[to_mapb]) y=(y+scroll_row[to_mapb])%GFX_TILEMAP_H;
+	return &console_map()[y*GFX_TILEMAP_W];
+}
+
+static void console_set_scroll(int row) {
+	int reg=to_mapb?GFX_TILEB_OFF:GFX_TILEA_OFF;
+	scroll_row[to_mapb]=row;
+	//The Y offset is in 1/64th pixels; 64 rows of 16 pixels wrap exactly at 16 bits.
+	GFX_REG(reg)=(GFX_REG(reg)&0xffff)|(((uint32_t)row*16*64)<<16);
+}
+
+static void console_clear_row(int y, uint32_t val) {
+	uint32_t *row=console_row(y);
+	for (int x=win_x; x<win_x+win_w; x++) row[x]=val;
+}
+
+static void console_scroll() {
+	if (hwscroll[to_mapb]) {
+		//The row that becomes the bottom row of the window currently is the one below it.
+		console_clear_row(win_y+win_h, ' ');
+		console_set_scroll((scroll_row[to_mapb]+1)%GFX_TILEMAP_H);
+	} else {
+		uint32_t *map=console_map();
 		for (int y=win_y; y<win_y+win_h-1; y++) {
 			for (int x=win_x; x<win_x+win_w; x++) {
 				map[y*GFX_TILEMAP_W+x]=map[(y+1)*GFX_TILEMAP_W+x];
 			}
 		}
 		//..and clear last line.
-		for (int x=win_x; x<win_x+win_w; x++) {
-			map[(win_y+win_h-1)*GFX_TILEMAP_W+x]=' ';
-		}
+		console_clear_row(win_y+win_h-1, ' ');
+	}
+}
+
+static void console_newline_if_needed() {
+	if (xpos>=win_x+win_w) {
+		//Next line because we hit the end of the window.
+		xpos=win_x;
+		ypos++;
+	}
+	if (ypos>=win_y+win_h) {
+		//Scroll up the window
+		console_scroll();
 		ypos--;
 	}
+}
 
+void console_write_char_raw(char c) {
+	console_newline_if_needed();
 	if (c!='\n') {
-		map[ypos*GFX_TILEMAP_W+xpos]=c+attr;
+		console_row(ypos)[xpos]=c+attr;
 		xpos++;
 	} else {
 		//Next line because newline.
@@ -82,6 +124,27 @@ void console_write_char_raw(char c) {
 	}
 }
 
+//Writes a run of printable characters, a line at a time.
+static void console_write_run(const char *data, int len) {
+	while (len>0) {
+		console_newline_if_needed();
+		int n=win_x+win_w-xpos;
+		if (n>len) n=len;
+		uint32_t *p=&console_row(ypos)[xpos];
+		for (int i=0; i<n; i++) p[i]=data[i]+attr;
+		xpos+=n;
+		data+=n;
+		len-=n;
+	}
+}
+
+static void console_clear() {
+	if (hwscroll[to_mapb]) console_set_scroll(0);
+	for (int y=win_y; y<win_y+win_h; y++) console_clear_row(y, ' '+attr);
+	xpos=win_x;
+	ypos=win_y;
+}
+
 static void console_write_char(char c) {
 	if (state==STATE_NORM) {
 		if (c==ESCAPE) {
@@ -111,13 +174,7 @@ static void console_write_char(char c) {
 				ypos=arg[1]+win_y;
 			} else if (c==CMD_CLEAR) {
 				//printf("console CMD_CLEAR\n");
-				xpos=win_x;
-				ypos=win_y;
-				for (int i=0; i<win_h*win_w; i++) {
-					console_write_char_raw(' ');
-				}
-				xpos=win_x;
-				ypos=win_y;
+				console_clear();
 			} else if (c==CMD_SET_WINSTART) {
 				win_x=arg[0];
 				win_y=arg[1];
@@ -128,6 +185,10 @@ static void console_write_char(char c) {
 				to_mapb=arg[0];
 			} else if (c==CMD_SET_ATTR) {
 				attr=arg[0];
+			} else if (c==CMD_SET_HWSCROLL) {
+				if (hwscroll[to_mapb]) console_set_scroll(0);
+				hwscroll[to_mapb]=arg[0]?1:0;
+				console_clear();
 			} else {
 				//Unknown escape sequence
 				console_write_char_raw(c);
@@ -139,6 +200,17 @@ static void console_write_char(char c) {
 
 
 int console_write(const char *data, int len) {
-	for (int i=0; i<len; i++) console_write_char(data[i]);
+	int i=0;
+	while (i<len) {
+		if (state==STATE_NORM && data[i]!=ESCAPE && data[i]!='\n') {
+			//Hand runs of plain characters to console_write_run in one go.
+			int n=1;
+			while (i+n<len && data[i+n]!=ESCAPE && data[i+n]!='\n') n++;
+			console_write_run(&data[i], n);
+			i+=n;
+		} else {
+			console_write_char(data[i++]);
+		}
+	}
 	return len;
 }
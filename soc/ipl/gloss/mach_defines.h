@@ -20,6 +20,11 @@
 #define MEM_IPL_START		0x40002000
 /** (Not specifically SoC-related) Start of RAM containing the application */
 #define MEM_APP_START		0x40100000
+/** (Not specifically SoC-related) When the Verilator simulation preloads an app (Vsoc -a), it
+    puts three words here: MEM_SIM_APP_MAGIC, the entry point of the app and the first address
+    past it. The IPL then starts that app instead of looking for an autoexec.elf. */
+#define MEM_SIM_APP_DESC	(MACH_RAM_START+MACH_RAM_SIZE-16)
+#define MEM_SIM_APP_MAGIC	0x50504153 //"SAPP"
 
 /* -------------- UART defines --------------------- */
 
@@ -337,6 +337,7 @@ int show_main_menu(char *app_name, int *ret_flags) {
 			}
 		}
 		old_usbstate=usbstate;
+		fs_idle();
 
 		int btn=MISC_REG(MISC_BTN_REG);
 		int need_redraw=0;
@@ -411,22 +412,41 @@ int show_main_menu(char *app_name, int *ret_flags) {
 	return 0;
 }
 
-void start_app(const char *app) {
-	uintptr_t max_app_addr=0;
-	uintptr_t la=load_new_app(app, &max_app_addr);
-	if (la==0) {
-		printf("Loading app %s failed!\n", app);
-		return;
-	}
+static void run_app(uintptr_t la, uintptr_t max_app_addr) {
 	sbrk_app_set_heap_start(max_app_addr);
 	user_memfn_set(NULL, NULL, NULL);
 	syscall_reinit();
+	//Nothing calls fs_idle() while the app runs, so don't leave anything in the sector cache.
+	fs_sync();
 	main_cb maincall=(main_cb)la;
 	maincall(0, NULL);
+	fs_sync();
 	user_memfn_set(malloc, realloc, free);
 	syscall_reinit();
 }
 
+void start_app(const char *app) {
+	uintptr_t max_app_addr=0;
+	uintptr_t la=load_new_app(app, &max_app_addr);
+	if (la==0) {
+		printf("Loading app %s failed!\n", app);
+		return;
+	}
+	run_app(la, max_app_addr);
+}
+
+//Runs the app the simulator preloaded with -a, if any. Returns false if there is none.
+static bool start_sim_app() {
+	volatile uint32_t *desc=(volatile uint32_t*)MEM_SIM_APP_DESC;
+	if (!simulated() || desc[0]!=MEM_SIM_APP_MAGIC) return false;
+	desc[0]=0; //only start it once
+	printf("Starting app preloaded by the simulator at %x\n", desc[1]);
+	load_tiles();
+	usb_msc_off();
+	run_app(desc[1], desc[2]);
+	return true;
+}
+
 static void
 usb_setup_serial_no(void)
 {
@@ -471,8 +491,11 @@ void main() {
 	SYNTHREG(0x60) = 0x00352400;	
 	SYNTHREG(0x70) = 0x00453000;	
     
-	//Skip autoexec when user is holding down the designated bypass key
-	if(!(MISC_REG(MISC_BTN_REG)&BUTTON_B)) {
+	//Skip autoexec when user is holding down the designated bypass key, or when the simulator
+	//gave us an app to run.
+	if (start_sim_app()) {
+		printf("Preloaded app done.\n");
+	} else if(!(MISC_REG(MISC_BTN_REG)&BUTTON_B)) {
 		//See if there's an autoexec.elf we can run.
 		const char *autoexec;
 		if (booted_from_cartridge()) {
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+
+/*
+Raw graphics blobs, as written by the gfxconv host tool (soc/gfxconv). These contain tiles,
+framebuffer images or tilemaps already converted into the format the graphics hardware uses,
+so loading them is a plain copy instead of decoding a png/tga or parsing a tmx file.
+
+A blob is a gfx_blob_hdr_t, followed by palcount 32-bit RGBA palette entries in GFXPAL format,
+followed by datalen bytes of data. All fields are little-endian. The data is:
+ - GFX_BLOB_TILES: width*height 16x16 tiles, 32 words each, in GFXTILES format.
+ - GFX_BLOB_FB: height rows of width pixels, bpp bits per pixel. Each row is padded to a whole
+   byte, so a row is (width*bpp+7)/8 bytes. In 4-bit images, the left pixel of each byte is in
+   the lower nibble; odd-width rows end with an unused upper nibble.
+ - GFX_BLOB_TILEMAP: height rows of width 32-bit tilemap entries, in GFXTILEMAPx format.
+*/
+
+#define GFX_BLOB_MAGIC 0x42584647 //"GFXB"
+#define GFX_BLOB_VERSION 1
+
+#define GFX_BLOB_TILES 1
+#define GFX_BLOB_FB 2
+#define GFX_BLOB_TILEMAP 3
+
+typedef struct __attribute__((packed)) {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t type;
+	uint16_t width;		//Tiles: tiles per row of the source image. FB: pixels. Tilemap: tiles.
+	uint16_t height;	//Tiles: rows of tiles. FB: pixels. Tilemap: tiles.
+	uint16_t bpp;		//FB: 4 or 8. Others: 0.
+	uint16_t palcount;	//Palette entries following the header
+	uint32_t datalen;	//Bytes of data following the palette
+} gfx_blob_hdr_t;
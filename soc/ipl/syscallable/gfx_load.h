@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include "gfx_blob.h"
 
 /**
  Load a tilemap in tmx format, as output by tiled. Only loads csv-formatted data, does not load embedded tilesets
@@ -38,6 +39,13 @@
 */
 int gfx_load_tilemap_mem(uint32_t *tilemap, int tilemaph, int tilemapw, int layerid, const char *tilemapstr, int tilemaplen, int palstart);
 
+/*
+Note on png loading: indexed and greyscale (up to 8 bit, non-interlaced) pngs are converted
+into the framebuffer or tile memory a row at a time, so apart from the png itself only the
+inflated image data needs to fit in memory. Other pngs are fully decoded by lodepng first,
+which needs a lot more memory.
+*/
+
 /**
  Load a png file, already in memory, into a buffer that can be used as a framebuffer. As a side effect,
  also writes out the palette.
@@ -101,6 +109,9 @@ less memory to load than pngs. The downside is that they tend to be larger.
 
 An added advantage is that targa files can be read using streaming techniques rather than
 needing the file to be entirely in memory, which also helps with speed and memory usage.
+The decoder handles whole RLE runs and raw packets at a time, so loading is mostly memset and
+memcpy. If the file is on the filesystem, gfx_load_*_tga_fd read it in large blocks, which is
+quicker than a callback that can only be asked for 256 bytes at a time.
 */
 
 /**
@@ -122,6 +133,7 @@ typedef uint8_t* (*tga_read_fn_t)(int len, int *retlen, void *arg);
  @param palmem Memory to write the RGBA palette data into. Data will be written
                incrementally from palmem[0] on.
  @param fbbpp Bit-per-pixel of the framebuffer memory. Either 4 or 8, for 16-color or 256-color tgas.
+ @param pitch Pitch of the framebuffer, in pixels
  @param readfn Reader function
  @param arg Opaque arg passed to readfn
  @returns 0 on success, other on failure.
@@ -135,6 +147,7 @@ int gfx_load_fb_tga(uint8_t *fbmem, uint32_t *palmem, int fbbpp, int pitch, tga_
  @param palmem Memory to write the RGBA palette data into. Data will be written
                incrementally from palmem[0] on.
  @param fbbpp Bit-per-pixel of the framebuffer memory. Either 4 or 8, for 16-color or 256-color tgas.
+ @param pitch Pitch of the framebuffer, in pixels
  @param tgastart Pointer to start of tga data
  @param tgalen Length of tga data
  @returns 0 on success, other on failure.
@@ -166,4 +179,72 @@ int gfx_load_tiles_tga(uint32_t *tilemem, uint32_t *palettemem, tga_read_fn_t re
 */
 int gfx_load_tiles_tga_mem(uint32_t *tilemem, uint32_t *palmem, char *tgastart, int tgalen);
 
+/**
+ Load a tga file from an open file descriptor into a buffer that can be used as a framebuffer. As a
+ side effect, also writes out the palette. The file is read from the current position.
+ @param fbmem Memory to write pixeldata into. Can be an actual framebuffer.
+ @param palmem Memory to write the RGBA palette data into. Data will be written
+               incrementally from palmem[0] on.
+ @param fbbpp Bit-per-pixel of the framebuffer memory. Either 4 or 8, for 16-color or 256-color tgas.
+ @param pitch Pitch of the framebuffer, in pixels
+ @param fd File descriptor, as returned by open()
+ @returns 0 on success, other on failure.
+ */
+int gfx_load_fb_tga_fd(uint8_t *fbmem, uint32_t *palmem, int fbbpp, int pitch, int fd);
+
+/**
+ Load a tga file from an open file descriptor into a buffer that can either be or be copied to tile
+ memory. As a side effect, also writes out the palette. The file is read from the current position.
+ @param tilemem Memory to write pixeldata into. Can be (a pointer into) the actual tile memory.
+ @param palettemem Memory to write the RGBA palette data into. Data will be written
+               incrementally from palmem[0] on.
+ @param fd File descriptor, as returned by open()
+ @returns 0 on success, other on failure
+*/
+int gfx_load_tiles_tga_fd(uint32_t *tilemem, uint32_t *palmem, int fd);
+
+/*
+Note on blobs: the gfxconv tool in soc/gfxconv converts png, tga and tmx files on the host
+into raw blobs in the format the hardware uses (see gfx_blob.h). Loading these is a copy,
+without any decoding or parsing, so this is by far the fastest way to get graphics on screen.
+Embed the blobs in your app using BINFILES, just like png or tga files.
+*/
+
+/**
+ Load a tile blob into a buffer that can either be or be copied to tile memory. As a side effect,
+ also writes out the palette.
+ @param tilemem Memory to write the tiles into. Can be (a pointer into) the actual tile memory.
+ @param palettemem Memory to write the RGBA palette data into. Data will be written
+               incrementally from palettemem[0] on.
+ @param blob Pointer to the blob, as written by 'gfxconv tiles'
+ @param bloblen Length of the blob
+ @returns 0 on success, other on failure, e.g. if the blob has more than the 512 tiles that fit in
+          tile memory
+*/
+int gfx_load_blob_tiles(uint32_t *tilemem, uint32_t *palettemem, const void *blob, int bloblen);
 
+/**
+ Load a framebuffer blob into a buffer that can be used as a framebuffer. As a side effect,
+ also writes out the palette.
+ @param fbmem Memory to write pixeldata into. Can be an actual framebuffer.
+ @param palmem Memory to write the RGBA palette data into. Data will be written
+               incrementally from palmem[0] on.
+ @param fbbpp Bit-per-pixel of the framebuffer memory. Must match the bpp the blob was converted with.
+ @param pitch Pitch of the framebuffer, in pixels. Must be at least the width of the image.
+ @param blob Pointer to the blob, as written by 'gfxconv fb'
+ @param bloblen Length of the blob
+ @returns 0 on success, other on failure
+*/
+int gfx_load_blob_fb(uint8_t *fbmem, uint32_t *palmem, int fbbpp, int pitch, const void *blob, int bloblen);
+
+/**
+ Load a tilemap blob into a tilemap. The palette offset and flip bits are already in the blob;
+ parts that do not fit in the target tilemap are clipped.
+ @param tilemap The tilemap to write into; GFXTILEMAPA/GFXTILEMAPB or a buffer in memory.
+ @param tilemaph Height of the target tilemap memory, in tiles. Use 64 when using GFXTILEMAP[A|B].
+ @param tilemapw Width of the target tilemap memory, in tiles. Use 64 when using GFXTILEMAP[A|B].
+ @param blob Pointer to the blob, as written by 'gfxconv tilemap'
+ @param bloblen Length of the blob
+ @returns 0 on success, other on failure
+*/
+int gfx_load_blob_tilemap(uint32_t *tilemap, int tilemaph, int tilemapw, const void *blob, int bloblen);
@@ -0,0 +1,387 @@
+/*
+ * Copyright 2019 Jeroen Domburg <jeroen@spritesmods.com>
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+//Benchmark for tjftl. Runs tjftl.c against an in-RAM flash that keeps track of how long the
+//operations would have taken on a real W25Qxx part, and reports throughput, latencies, write
+//amplification, garbage collection pauses and wear. Times are simulated flash time only; the
+//CPU time tjftl itself takes is reported separately, as host time.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include "../tjftl.h"
+
+#define BLKSZ 32768
+#define PAGESZ 256
+
+//Defaults are the internal flash partition as set up by fs.c.
+#define DEF_FLASH_SIZE (0xD00000-0x380000)
+#define SECT_CNT(size) (((size)-32868*10)/512)
+
+typedef struct {
+	int page_prog_us;	//per 256-byte page
+	int erase_us;		//per 32K block
+	int read_cmd_ns;	//command, address and dummy bytes of a read
+	int read_byte_ns;
+} flash_timing_t;
+
+typedef struct {
+	uint8_t *mem;
+	int size;
+	flash_timing_t t;
+	uint64_t now_ns;	//simulated time
+	uint64_t reads;
+	uint64_t bytes_read;
+	uint64_t data_progs;	//512-byte sector programs
+	uint64_t hdr_progs;		//block header programs
+	uint64_t bytes_progged;
+	uint64_t gc_rounds;		//headers programmed with a zero magic, i.e. blocks retired by gc
+	uint64_t erases;
+	uint32_t *erase_cnt;
+	uint64_t deadline_ns;	//writes fail after this, so a tjftl call that never ends can be caught
+	int timed_out;
+} flash_t;
+
+static void set_deadline(flash_t *f, int secs) {
+	f->deadline_ns=f->now_ns+(uint64_t)secs*1000000000ULL;
+}
+
+static bool past_deadline(flash_t *f) {
+	if (f->now_ns<=f->deadline_ns) return false;
+	f->timed_out=1;
+	return true;
+}
+
+static void check_timeout(flash_t *f) {
+	if (!f->timed_out) return;
+	printf("A single ftl operation took longer than the time limit (gc not making progress?), aborting.\n");
+	exit(1);
+}
+
+static bool flash_rd(int addr, uint8_t *buf, int len, void *arg) {
+	flash_t *f=(flash_t*)arg;
+	if (addr<0 || addr+len>f->size) return false;
+	memcpy(buf, f->mem+addr, len);
+	f->reads++;
+	f->bytes_read+=len;
+	f->now_ns+=f->t.read_cmd_ns+(uint64_t)len*f->t.read_byte_ns;
+	return true;
+}
+
+static bool flash_erase(int addr, void *arg) {
+	flash_t *f=(flash_t*)arg;
+	if (addr<0 || addr+BLKSZ>f->size || (addr%BLKSZ)!=0) return false;
+	if (past_deadline(f)) return false;
+	memset(f->mem+addr, 0xff, BLKSZ);
+	f->erase_cnt[addr/BLKSZ]++;
+	f->erases++;
+	f->now_ns+=(uint64_t)f->t.erase_us*1000;
+	return true;
+}
+
+static bool flash_program(int addr, const uint8_t *buf, int len, void *arg) {
+	flash_t *f=(flash_t*)arg;
+	if (addr<0 || addr+len>f->size) return false;
+	if (past_deadline(f)) return false;
+	for (int i=0; i<len; i++) f->mem[addr+i]&=buf[i];
+	//Programs are split up in page program commands
+	int pages=(addr+len-1)/PAGESZ-addr/PAGESZ+1;
+	f->now_ns+=(uint64_t)pages*f->t.page_prog_us*1000;
+	f->bytes_progged+=len;
+	if ((addr%BLKSZ)==0) {
+		f->hdr_progs++;
+		if (len>=4 && buf[0]==0 && buf[1]==0 && buf[2]==0 && buf[3]==0) f->gc_rounds++;
+	} else {
+		f->data_progs+=(len+511)/512;
+	}
+	return true;
+}
+
+//Latencies of one phase, in ns
+typedef struct {
+	uint64_t *lat;
+	int n;
+	uint64_t *gc_lat;	//latencies of the writes that paused for gc or an erase
+	int gc_n;
+	uint64_t gc_moved;	//sectors those writes programmed on top of their own data
+} lat_t;
+
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x=*(const uint64_t*)a, y=*(const uint64_t*)b;
+	return (x>y)-(x<y);
+}
+
+static double pct_us(uint64_t *v, int n, int pct) {
+	if (n==0) return 0;
+	int i=(int)(((int64_t)n*pct)/100);
+	if (i>=n) i=n-1;
+	return v[i]/1000.0;
+}
+
+static void print_lat(const char *name, uint64_t *v, int n) {
+	qsort(v, n, sizeof(uint64_t), cmp_u64);
+	uint64_t tot=0;
+	for (int i=0; i<n; i++) tot+=v[i];
+	printf("  %-10s n=%-7d avg %9.1f  p50 %9.1f  p99 %9.1f  max %10.1f us\n", name, n,
+			n?tot/1000.0/n:0.0, pct_us(v, n, 50), pct_us(v, n, 99), n?v[n-1]/1000.0:0.0);
+}
+
+static double host_sec() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec+ts.tv_nsec/1e9;
+}
+
+#define PH_SEQ_WRITE 0
+#define PH_RAND_WRITE 1
+#define PH_RAND_READ 2
+#define PH_SEQ_READ 3
+
+static const char *phase_name[]={"seq write", "rand write", "rand read", "seq read"};
+
+static int errors=0;
+
+static void fill_buf(uint8_t *buf, int lba, uint32_t gen) {
+	for (int i=0; i<512; i+=8) {
+		memcpy(&buf[i], &lba, 4);
+		memcpy(&buf[i+4], &gen, 4);
+	}
+}
+
+static int op_limit_s=60;
+static int seq_multi=1;
+static int idle_gc=0;
+
+static void run_phase(tjftl_t *tj, flash_t *f, int phase, int ops, int lbas, uint32_t *gen, lat_t *l) {
+	uint8_t buf[512*seq_multi], cmp[512];
+	uint64_t start_ns=f->now_ns;
+	uint64_t data_progs=f->data_progs, bytes_progged=f->bytes_progged, gc_rounds=f->gc_rounds, erases=f->erases;
+	uint64_t idle_ns=0;
+	double host_start=host_sec();
+	l->n=0;
+	l->gc_n=0;
+	l->gc_moved=0;
+	int seq_lba=0;
+	//Sequential phases do seq_multi sectors per call, using the _multi calls if that's more than 1.
+	for (int i=0; i<ops; ) {
+		int lba, cnt=1;
+		if (phase==PH_SEQ_WRITE || phase==PH_SEQ_READ) {
+			lba=seq_lba;
+			cnt=seq_multi;
+			if (cnt>lbas-lba) cnt=lbas-lba;
+			if (cnt>ops-i) cnt=ops-i;
+			seq_lba+=cnt;
+			if (seq_lba>=lbas) seq_lba=0;
+		} else {
+			lba=rand()%lbas;
+		}
+		uint64_t t=f->now_ns, op_idle_ns=0;
+		if (phase==PH_SEQ_WRITE || phase==PH_RAND_WRITE) {
+			uint64_t progs=f->data_progs, rounds=f->gc_rounds, ers=f->erases;
+			for (int j=0; j<cnt; j++) {
+				gen[lba+j]++;
+				fill_buf(&buf[j*512], lba+j, gen[lba+j]);
+			}
+			set_deadline(f, op_limit_s);
+			if (seq_multi>1) {
+				if (!tjftl_write_multi(tj, lba, cnt, buf)) errors++;
+			} else {
+				if (!tjftl_write(tj, lba, buf)) errors++;
+			}
+			check_timeout(f);
+			//A write pauses if it erased a block, retired one, or had to move or checkpoint
+			//sectors besides writing its own.
+			uint64_t moved=f->data_progs-progs-cnt;
+			if (f->gc_rounds!=rounds || f->erases!=ers || moved) {
+				l->gc_lat[l->gc_n++]=f->now_ns-t;
+				l->gc_moved+=moved;
+			}
+			if (idle_gc) {
+				//Idle time between writes; doesn't count towards the phase time.
+				uint64_t it=f->now_ns;
+				set_deadline(f, op_limit_s);
+				tjftl_gc_step(tj, idle_gc);
+				check_timeout(f);
+				op_idle_ns=f->now_ns-it;
+				idle_ns+=op_idle_ns;
+			}
+		} else {
+			if (seq_multi>1) {
+				if (!tjftl_read_multi(tj, lba, cnt, buf)) errors++;
+			} else {
+				if (!tjftl_read(tj, lba, buf)) errors++;
+			}
+			for (int j=0; j<cnt; j++) {
+				fill_buf(cmp, lba+j, gen[lba+j]);
+				if (memcmp(&buf[j*512], cmp, 512)!=0) errors++;
+			}
+		}
+		l->lat[l->n++]=f->now_ns-t-op_idle_ns;
+		i+=cnt;
+	}
+	double secs=(f->now_ns-start_ns-idle_ns)/1e9;
+	printf("%s: %d sectors in %.2f s flash time (%.2f s host time), %.1f sectors/s, %.1f KiB/s\n",
+			phase_name[phase], ops, secs, host_sec()-host_start, secs?ops/secs:0.0, secs?ops*0.5/secs:0.0);
+	print_lat("latency", l->lat, l->n);
+	if (phase==PH_SEQ_WRITE || phase==PH_RAND_WRITE) {
+		uint64_t dp=f->data_progs-data_progs;
+		printf("  write amplification: %.2f (sectors), %.2f (bytes incl. headers)\n",
+				(double)dp/ops, (double)(f->bytes_progged-bytes_progged)/(ops*512.0));
+		printf("  gc: %llu blocks retired, %llu erases; %d pauses, %.1f sectors moved per pause\n",
+				(unsigned long long)(f->gc_rounds-gc_rounds), (unsigned long long)(f->erases-erases),
+				l->gc_n, l->gc_n?(double)l->gc_moved/l->gc_n:0.0);
+		if (l->gc_n) print_lat("gc pause", l->gc_lat, l->gc_n);
+		if (idle_gc) printf("  idle gc: %.2f s flash time\n", idle_ns/1e9);
+	}
+}
+
+static void print_wear(flash_t *f, const char *csvfile) {
+	int blks=f->size/BLKSZ;
+	uint32_t min=UINT32_MAX, max=0;
+	uint64_t tot=0;
+	for (int i=0; i<blks; i++) {
+		if (f->erase_cnt[i]<min) min=f->erase_cnt[i];
+		if (f->erase_cnt[i]>max) max=f->erase_cnt[i];
+		tot+=f->erase_cnt[i];
+	}
+	printf("erase counts: %llu erases over %d blocks, min %u avg %.1f max %u\n",
+			(unsigned long long)tot, blks, min, (double)tot/blks, max);
+	if (csvfile) {
+		FILE *csv=fopen(csvfile, "w");
+		if (!csv) {
+			perror(csvfile);
+			return;
+		}
+		fprintf(csv, "block,erases\n");
+		for (int i=0; i<blks; i++) fprintf(csv, "%d,%u\n", i, f->erase_cnt[i]);
+		fclose(csv);
+	}
+}
+
+static void usage(const char *prog) {
+	fprintf(stderr, "Usage: %s [-n ops] [-m sectors] [-s size] [-l sectors] [-f fill%%] [-p us]\n"
+		"      [-e us] [-r ns] [-R ns] [-t secs] [-S seed] [-c erases.csv] [-i sectors]\n"
+		"  -n: sectors read or written per benchmark phase (default 20000)\n"
+		"  -m: sectors per call in the sequential phases, using tjftl_*_multi if >1 (default 1)\n"
+		"  -s: flash size in bytes (default: size of the internal flash partition)\n"
+		"  -l: amount of 512-byte sectors the ftl exposes (default: as fs.c does for the size)\n"
+		"  -f: percentage of the sectors the benchmark uses (default 90)\n"
+		"  -p: page (256 byte) program time in us (default 700, W25Q128JV typical)\n"
+		"  -e: 32K block erase time in us (default 120000, W25Q128JV typical)\n"
+		"  -r: read time per byte in ns (default 170, quad read at 24MHz)\n"
+		"  -R: read command overhead in ns (default 2000)\n"
+		"  -t: abort if a single ftl call takes more than this many seconds of flash time (default 60)\n"
+		"  -S: random seed\n"
+		"  -c: write the erase count of every block to this CSV file\n"
+		"  -i: after every write, call tjftl_gc_step() with this budget, as if the ftl was idle for\n"
+		"      a while (default 0: no background gc)\n", prog);
+	exit(1);
+}
+
+int main(int argc, char **argv) {
+	flash_t f={0};
+	int ops=20000, fill=90, sect_cnt=-1;
+	unsigned int seed=1;
+	const char *csvfile=NULL;
+	f.size=DEF_FLASH_SIZE;
+	f.t.page_prog_us=700;
+	f.t.erase_us=120000;
+	f.t.read_byte_ns=170;
+	f.t.read_cmd_ns=2000;
+	int opt;
+	while ((opt=getopt(argc, argv, "n:m:s:l:f:p:e:r:R:t:S:c:i:"))!=-1) {
+		switch (opt) {
+			case 'n': ops=strtol(optarg, NULL, 0); break;
+			case 'm': seq_multi=strtol(optarg, NULL, 0); break;
+			case 's': f.size=strtol(optarg, NULL, 0); break;
+			case 'l': sect_cnt=strtol(optarg, NULL, 0); break;
+			case 'f': fill=strtol(optarg, NULL, 0); break;
+			case 'p': f.t.page_prog_us=strtol(optarg, NULL, 0); break;
+			case 'e': f.t.erase_us=strtol(optarg, NULL, 0); break;
+			case 'r': f.t.read_byte_ns=strtol(optarg, NULL, 0); break;
+			case 'R': f.t.read_cmd_ns=strtol(optarg, NULL, 0); break;
+			case 't': op_limit_s=strtol(optarg, NULL, 0); break;
+			case 'S': seed=strtoul(optarg, NULL, 0); break;
+			case 'c': csvfile=optarg; break;
+			case 'i': idle_gc=strtol(optarg, NULL, 0); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (sect_cnt<0) sect_cnt=SECT_CNT(f.size);
+	if (ops<=0 || seq_multi<1 || seq_multi>64 || idle_gc<0 || f.size<BLKSZ*16 || sect_cnt<=0 || fill<=0 || fill>100) usage(argv[0]);
+	srand(seed);
+
+	f.size-=f.size%BLKSZ;
+	f.mem=malloc(f.size);
+	f.erase_cnt=calloc(f.size/BLKSZ, sizeof(uint32_t));
+	uint64_t *lat=malloc(ops*sizeof(uint64_t));
+	uint64_t *gc_lat=malloc(ops*sizeof(uint64_t));
+	uint32_t *gen=calloc(sect_cnt, sizeof(uint32_t));
+	if (!f.mem || !f.erase_cnt || !lat || !gc_lat || !gen) {
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+	memset(f.mem, 0xff, f.size);
+	int lbas=(int)(((int64_t)sect_cnt*fill)/100);
+	if (lbas<1) lbas=1;
+
+	printf("Flash: %d KiB, %d sectors exposed, %d used. Program %d us/page, erase %d us/32K, read %d ns + %d ns/byte\n",
+			f.size/1024, sect_cnt, lbas, f.t.page_prog_us, f.t.erase_us, f.t.read_cmd_ns, f.t.read_byte_ns);
+
+	uint64_t t=f.now_ns;
+	double host_start=host_sec();
+	set_deadline(&f, op_limit_s);
+	tjftl_t *tj=tjftl_init(flash_rd, flash_erase, flash_program, &f, f.size, sect_cnt, 0);
+	check_timeout(&f);
+	if (!tj) {
+		fprintf(stderr, "tjftl_init failed\n");
+		exit(1);
+	}
+	//Fill all sectors once, so the phases below run against a used ftl
+	uint8_t buf[512];
+	for (int lba=0; lba<lbas; lba++) {
+		gen[lba]++;
+		fill_buf(buf, lba, gen[lba]);
+		set_deadline(&f, op_limit_s);
+		if (!tjftl_write(tj, lba, buf)) errors++;
+		check_timeout(&f);
+	}
+	printf("Init and fill: %.2f s flash time (%.2f s host time)\n", (f.now_ns-t)/1e9, host_sec()-host_start);
+
+	lat_t l={.lat=lat, .gc_lat=gc_lat};
+	run_phase(tj, &f, PH_SEQ_WRITE, ops, lbas, gen, &l);
+	run_phase(tj, &f, PH_RAND_WRITE, ops, lbas, gen, &l);
+	run_phase(tj, &f, PH_RAND_READ, ops, lbas, gen, &l);
+	run_phase(tj, &f, PH_SEQ_READ, ops, lbas, gen, &l);
+
+	//Re-initialize; this is what happens at every boot.
+	t=f.now_ns;
+	host_start=host_sec();
+	set_deadline(&f, op_limit_s);
+	tj=tjftl_init(flash_rd, flash_erase, flash_program, &f, f.size, sect_cnt, 0);
+	check_timeout(&f);
+	if (!tj) {
+		fprintf(stderr, "tjftl_init on filled flash failed\n");
+		exit(1);
+	}
+	printf("Mount: %.2f s flash time (%.2f s host time)\n", (f.now_ns-t)/1e9, host_sec()-host_start);
+	print_wear(&f, csvfile);
+	if (errors) printf("%d ERRORS (failed calls or data mismatches)\n", errors);
+	return errors?1:0;
+}
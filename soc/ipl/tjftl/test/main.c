@@ -63,30 +63,89 @@ bool flash_program(int addr, const uint8_t *buf, int len, void *arg) {
 	return true;
 }
 
+//Builds flash as written by tjftl before it had checkpoints: every block holds data, the last one
+//included. If last_sects<63, the last block was still being written to. Blocks 100-111 are free.
+//Returns the expected contents of the lbas in realmem.
+static void make_legacy_image(flash_t *flash, uint8_t *realmem, int last_sects) {
+	int blks=BACKING_MEM/32768;
+	int lba=0;
+	uint32_t serial=1;
+	memset(flash->flash, 0xff, BACKING_MEM);
+	for (int b=0; b<blks; b++) {
+		if (b>=100 && b<112) continue;
+		uint8_t *blk=flash->flash+b*32768;
+		uint32_t hdr[128];
+		memset(hdr, 0xff, sizeof(hdr));
+		hdr[0]=0x1337B33F;
+		hdr[1]=serial++;
+		int n=(b==blks-1)?last_sects:63;
+		for (int j=0; j<n; j++) {
+			hdr[2+j*2]=lba;
+			hdr[3+j*2]=~lba;
+			for (int i=0; i<512; i++) blk[512+j*512+i]=rand();
+			memcpy(realmem+lba*512, blk+512+j*512, 512);
+			lba=(lba+1)%(STORAGE_MEM/512);
+		}
+		memcpy(blk, hdr, sizeof(hdr));
+	}
+}
+
+//Mounting flash from before checkpoints existed has to move the data out of the block that
+//becomes the anchor without losing any of it.
+static void legacy_mount_test(flash_t *flash, uint8_t *realmem) {
+	for (int last_sects=63; last_sects>0; last_sects-=23) {
+		make_legacy_image(flash, realmem, last_sects);
+		flash->fail_after=999999;
+		for (int mount=0; mount<2; mount++) {
+			tjftl_t *tj=tjftl_init(flash_rd, flash_erase, flash_program, flash, BACKING_MEM, STORAGE_MEM/512, 0);
+			if (!tj) {
+				printf("Omg! Legacy image with %d sectors in the last block doesn't mount\n", last_sects);
+				exit(1);
+			}
+			int bad=0;
+			for (int i=0; i<STORAGE_MEM/512; i++) {
+				uint8_t buf[512];
+				tjftl_read(tj, i, buf);
+				if (memcmp(buf, realmem+i*512, 512)!=0) bad++;
+			}
+			if (bad) {
+				printf("Omg! Legacy image with %d sectors in the last block: %d lbas wrong after mount %d\n", last_sects, bad, mount);
+				exit(1);
+			}
+		}
+	}
+}
+
 int main(int argc, char **argv) {
 	flash_t *flash=malloc(sizeof(flash_t));
 	flash->flash=malloc(BACKING_MEM);
 	uint8_t *realmem=malloc(STORAGE_MEM);
 	memset(realmem, 0xff, STORAGE_MEM);
+	//Trimmed sectors can read back as anything until they're written again
+	uint8_t *trimmed=calloc(STORAGE_MEM/512, 1);
+	legacy_mount_test(flash, realmem);
+	memset(realmem, 0xff, STORAGE_MEM);
 	for (int i=0; i<BACKING_MEM; i++) {
 		flash->flash[i]=rand();
 	}
 	
 	flash->fail_after=999999;
-	tjftl_t *tj=tjftl_init(flash_rd, flash_erase, flash_program, flash, BACKING_MEM, STORAGE_MEM/512);
+	tjftl_t *tj=tjftl_init(flash_rd, flash_erase, flash_program, flash, BACKING_MEM, STORAGE_MEM/512, 0);
 	flash->fail_after=rand()%1000;
 	int iter=0;
 	while(iter<(STORAGE_MEM/512)*1000) {
 		if ((iter&0xff)==0) {
 //		printf("Iter %d\n", iter);
 		bool has_err=false;
-		for (int i=0; i<STORAGE_MEM/512; i++) {
-			uint8_t buf[512];
-			memset(buf, 0xff, 512);
-			tjftl_read(tj, i, buf);
-			if (memcmp(buf, realmem+(i*512), 512)!=0) {
-				printf("Omg! Error at iter %d, lba %d\n", iter, i);
-				has_err=true;
+		for (int i=0; i<STORAGE_MEM/512; i+=64) {
+			uint8_t buf[512*64];
+			memset(buf, 0xff, sizeof(buf));
+			tjftl_read_multi(tj, i, 64, buf);
+			for (int j=0; j<64; j++) {
+				if (!trimmed[i+j] && memcmp(buf+j*512, realmem+((i+j)*512), 512)!=0) {
+					printf("Omg! Error at iter %d, lba %d\n", iter, i+j);
+					has_err=true;
+				}
 			}
 		}
 		if (has_err) exit(1);
@@ -94,18 +153,36 @@ int main(int argc, char **argv) {
 		}
 
 		int lba=rand()%(STORAGE_MEM/512);
-		uint8_t buf[512];
-		for (int i=0; i<512; i++) buf[i]=rand();
-		tjftl_write(tj, lba, buf);
-		memcpy(realmem+lba*512, buf, 512);
-//		printf("Written to LBA %d\n", lba);
+		//Mostly single sectors, sometimes a run of them
+		int cnt=(rand()%8)?1:1+rand()%64;
+		if (lba+cnt>STORAGE_MEM/512) cnt=STORAGE_MEM/512-lba;
+		uint8_t buf[512*64];
+		for (int i=0; i<512*cnt; i++) buf[i]=rand();
+		if (cnt==1) {
+			tjftl_write(tj, lba, buf);
+		} else {
+			tjftl_write_multi(tj, lba, cnt, buf);
+		}
+		memcpy(realmem+lba*512, buf, 512*cnt);
+		memset(trimmed+lba, 0, cnt);
+		if ((rand()%256)==0) {
+			//Trim a run of sectors, like deleting a file does
+			int tlba=rand()%(STORAGE_MEM/512);
+			int tcnt=1+rand()%256;
+			if (tlba+tcnt>STORAGE_MEM/512) tcnt=STORAGE_MEM/512-tlba;
+			tjftl_trim(tj, tlba, tcnt);
+			memset(trimmed+tlba, 1, tcnt);
+		}
+		//Sometimes pretend we're idle and let the background gc do some work
+		if (flash->fail_after>0 && (rand()%4)==0) tjftl_gc_step(tj, 1+rand()%16);
+//		printf("Written to LBA %d count %d\n", lba, cnt);
 		iter++;
 
 		if (flash->fail_after<=0) {
 			printf("Simulated power fail. Re-initializing ftl.\n");
 			flash->fail_after=999999;
-			tj=tjftl_init(flash_rd, flash_erase, flash_program, flash, BACKING_MEM, STORAGE_MEM/512);
-			tjftl_write(tj, lba, buf);
+			tj=tjftl_init(flash_rd, flash_erase, flash_program, flash, BACKING_MEM, STORAGE_MEM/512, 0);
+			tjftl_write_multi(tj, lba, cnt, buf);
 			flash->fail_after=(rand()%100000)+30;
 		}
 	}
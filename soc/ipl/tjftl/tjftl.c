@@ -14,6 +14,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include "tjftl.h"
 
 //Description for one block. For a valid block, lba == ~lba_inv
@@ -49,6 +50,13 @@
 //(if this frees up less than GC_MIN_FREE_BLK_CNT blocks, it will continue until that
 //amount of blocks have been freed)
 #define GC_CLEAR_BLOCKS 2
+//If there's still at least 2 blocks free, the garbage collect routine stops after this amount of
+//blocks, even if it didn't reach GC_MIN_FREE_BLK_CNT. On a nearly full disk, every block has
+//mostly valid sectors, and getting to GC_MIN_FREE_BLK_CNT can take very long or be impossible.
+#define GC_MAX_BLOCKS 16
+//tjftl_gc_step() tries to keep this many blocks free, so writes rarely have to wait for
+//garbage_collect().
+#define GC_BG_FREE_BLK_CNT (GC_MIN_FREE_BLK_CNT+4)
 
 
 
@@ -80,6 +88,66 @@ _Static_assert(sizeof(tjftl_block_t)==512, "tjftl_block_t is not 512 bytes!");
 //of the entire flash every time. This takes up 8K per megabyte cached.
 #define CACHE_LBALOC 1
 
+#if !CACHE_LBALOC
+#error The block state table needs the lba cache to keep track of valid sectors.
+#endif
+
+//Block states in the in-memory block table
+#define BLK_FREE 0		//invalid or erased; can be initialized and written to
+#define BLK_ACTIVE 1	//the block we're currently writing sectors to
+#define BLK_USED 2		//has a valid header and can't be written to anymore
+#define BLK_CKPT 3		//holds the current checkpoint
+#define BLK_ANCHOR 4	//holds the list of checkpoints
+
+//In-memory state of a flash block. This is built when initializing and kept up to date afterwards,
+//so finding a free block or a block to garbage collect does not need to read any flash.
+typedef struct {
+	uint32_t serial;
+	uint8_t state;
+	uint8_t valid; //amount of sectors in this block that hold the current version of an lba
+	uint8_t in_pool; //free block that may be written to without writing a new checkpoint first
+} tjftl_blkstate_t;
+
+//Checkpoints. Without these, mounting needs to read the header of every block on the flash to
+//figure out where each lba lives. A checkpoint stores the lba map and the block table in a few
+//blocks; the last block of the flash (the anchor) holds a log of pointers to these. It also
+//stores a pool of free blocks: until the next checkpoint is written, new data only goes
+//into those blocks, so when mounting, only the headers of the pool blocks need to be read to
+//bring the checkpoint up to date. When the pool runs dry, a record adding more free blocks to
+//it is appended to the anchor; only after CKPT_POOL_EXT_MAX of those blocks, or when the anchor
+//is full, a new checkpoint is written. If anything about the checkpoint is off, mounting falls back
+//to reading all headers, and the anchor is erased and a new checkpoint is written.
+#define CKPT_MAGIC 0x54504B43 //"CKPT"
+#define CKPT_ANCHOR_MAGIC 0x524E4341 //"ACNR"
+#define CKPT_POOL_MAGIC 0x4C4F4F50 //"POOL"
+#define CKPT_MAX_BLKS 7
+#define CKPT_POOL_BLKS 32
+#define CKPT_POOL_EXT_MAX 128
+//Checkpoint data starts after the first sector of a checkpoint block.
+#define CKPT_DATA_PER_BLK (BLKSZ-SEC_DATA_SIZE)
+
+//Header at the start of every checkpoint block
+typedef struct {
+	uint32_t magic;
+	uint32_t serial; //current_serial when the checkpoint was written
+	uint16_t idx;
+	uint16_t nblk;
+	uint32_t len;
+} tjftl_ckpt_hdr_t;
+
+//Record in the anchor block. The last valid one with CKPT_ANCHOR_MAGIC points to the current
+//checkpoint; the CKPT_POOL_MAGIC ones after it add blocks to its pool.
+typedef struct {
+	uint32_t magic;
+	uint32_t serial; //of the checkpoint
+	uint32_t crc; //of the checkpoint data
+	uint16_t nblk;
+	uint16_t blk[CKPT_MAX_BLKS]; //checkpoint blocks, or blocks added to the pool
+	uint32_t rec_crc; //of the fields above
+} tjftl_ckpt_rec_t;
+
+_Static_assert(sizeof(tjftl_ckpt_rec_t)==32, "tjftl_ckpt_rec_t is not 32 bytes!");
+
 struct tjftl_t {
 	flashcb_read_t flash_read;
 	flashcb_erase_32k_t flash_erase;
@@ -90,8 +158,20 @@ struct tjftl_t {
 	int current_serial;
 	int current_write_block;
 	int current_gc_block;
+	int bg_gc_block; //block tjftl_gc_step() is emptying, or -1
+	int bg_gc_sec; //next sector tjftl_gc_step() looks at in bg_gc_block
 	int free_blk_cnt; //This has the amount of blocks that are invalid/erased/entirely empty.
 	int prefer_first_sectors; //if this is 1, the first few sectors aren't entirely used. Prefer those so detecting a tjftl is easier.
+	tjftl_blkstate_t *blk;
+	tjftl_block_t wblk_hdr; //copy of the header of current_write_block
+	int ckpt_blks; //blocks needed for a checkpoint; 0 if this flash can't have checkpoints
+	int ckpt_on; //1 if the anchor points to a checkpoint that is current
+	int anchor_blk;
+	int anchor_ready; //1 once the anchor block holds our log; no checkpoints can be written before
+	int anchor_pos; //offset of the next free record in the anchor block
+	int ckpt_blk[CKPT_MAX_BLKS]; //blocks of the current checkpoint
+	uint32_t ckpt_serial;
+	int pool_ext; //blocks added to the pool since the checkpoint was written
 #if CACHE_LBALOC
 	uint32_t *lba_cache;
 #endif
@@ -130,10 +210,11 @@ static bool write_blkhdr(tjftl_t *tj, int blk, const tjftl_block_t *hdr) {
 	return ret;
 }
 
-static bool write_sect(tjftl_t *tj, int blk, int sect_in_blk, const uint8_t *buf) {
-	TJ_CHECK(sect_in_blk>=0 && sect_in_blk<64, "invalid sect in blk");
+//Writes cnt sectors, starting at sect_in_blk
+static bool write_sect(tjftl_t *tj, int blk, int sect_in_blk, int cnt, const uint8_t *buf) {
+	TJ_CHECK(sect_in_blk>=0 && sect_in_blk+cnt<=SEC_PER_BLK, "invalid sect in blk");
 	int addr=blk*BLKSZ+(sect_in_blk+1)*SEC_DATA_SIZE;
-	bool ret=tj->flash_program(addr, buf, SEC_DATA_SIZE, tj->flashcb_arg);
+	bool ret=tj->flash_program(addr, buf, cnt*SEC_DATA_SIZE, tj->flashcb_arg);
 	return ret;
 }
 
@@ -167,15 +248,11 @@ static bool lba_is_superseded(tjftl_t *tj, const tjfl_blockdesc_t *b, int blkno,
 	}
 }
 
+#if !CACHE_LBALOC
 static bool lba_maybe_superseded(tjftl_t *tj, const tjfl_blockdesc_t *b, int blkno, int sect_in_blk) {
-#if CACHE_LBALOC
-	//Cache marks all blocks as maybe superseded, but we can easily check if the block is _actually_ superseded as
-	//that routine is really fast.
-	return lba_is_superseded(tj, b, blkno, sect_in_blk);
-#else
 	return ((b->lba & LBA_SUPERSEDED_MSK)==0) && ((b->lba_inv & LBA_SUPERSEDED_MSK)==0);
-#endif
 }
+#endif
 
 static bool blkh_valid(const tjftl_block_t *blkh) {
 	return (blkh->magic==BLKHDR_MAGIC);
@@ -215,8 +292,12 @@ static bool blk_initialize(tjftl_t *tj, int blkno, tjftl_block_t *blkh) {
 	ret=write_blkhdr(tj, blkno, blkh);
 	if (!ret) {
 		TJ_MSG("blk_initialize: write_blkhdr of block %d failed!\n", blkno);
+		return false;
 	}
-	return ret;
+	tj->blk[blkno].state=BLK_ACTIVE;
+	tj->blk[blkno].serial=blkh->serial;
+	tj->blk[blkno].valid=0;
+	return true;
 }
 
 static void blk_fill_cache(tjftl_t *tj, tjftl_block_t *blkh, int blkno) {
@@ -226,10 +307,9 @@ static void blk_fill_cache(tjftl_t *tj, tjftl_block_t *blkh, int blkno) {
 			int lba=lba_sect(&blkh->bd[j]);
 			if (tj->lba_cache[lba]!=0) {
 				//Need to see if this lba superseded the other one
-				tjftl_block_t oblkh;
-				read_blkhdr(tj, lbacache_block(tj->lba_cache[lba]), &oblkh);
-//				printf("cache fill: already read lba %d. old ser %d new ser %d\n", lba, oblkh.serial, blkh->serial);
-				if (oblkh.serial < blkh->serial) {
+				uint32_t oserial=tj->blk[lbacache_block(tj->lba_cache[lba])].serial;
+//				printf("cache fill: already read lba %d. old ser %d new ser %d\n", lba, oserial, blkh->serial);
+				if (oserial < blkh->serial) {
 					//Yes, we supersede the old block.
 					tj->lba_cache[lba]=lbacache_pair(blkno, j);
 				}
@@ -244,10 +324,314 @@ static void blk_fill_cache(tjftl_t *tj, tjftl_block_t *blkh, int blkno) {
 
 static void cache_update(tjftl_t *tj, int lba, int blkno, int sec) {
 #if CACHE_LBALOC
+	if (tj->lba_cache[lba]!=0) tj->blk[lbacache_block(tj->lba_cache[lba])].valid--;
 	tj->lba_cache[lba]=lbacache_pair(blkno, sec);
+	tj->blk[blkno].valid++;
 #endif
 }
 
+static void cache_forget(tjftl_t *tj, int lba) {
+	if (tj->lba_cache[lba]==0) return;
+	tj->blk[lbacache_block(tj->lba_cache[lba])].valid--;
+	tj->lba_cache[lba]=0;
+}
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t *data, int len) {
+	crc=~crc;
+	for (int i=0; i<len; i++) {
+		crc^=data[i];
+		for (int j=0; j<8; j++) crc=(crc>>1)^(0xEDB88320&(-(crc&1)));
+	}
+	return ~crc;
+}
+
+//Sequential reader/writer for the data in the checkpoint blocks
+typedef struct {
+	tjftl_t *tj;
+	const int *blks;
+	int pos;
+	int bufpos;
+	uint32_t crc;
+	bool ok;
+	uint8_t buf[256];
+} ckpt_io_t;
+
+static int ckpt_io_addr(ckpt_io_t *io) {
+	return io->blks[io->pos/CKPT_DATA_PER_BLK]*BLKSZ+SEC_DATA_SIZE+(io->pos%CKPT_DATA_PER_BLK);
+}
+
+static void ckpt_flush(ckpt_io_t *io) {
+	if (io->bufpos==0) return;
+	io->ok&=io->tj->flash_program(ckpt_io_addr(io), io->buf, io->bufpos, io->tj->flashcb_arg);
+	io->pos+=io->bufpos;
+	io->bufpos=0;
+}
+
+static void ckpt_put(ckpt_io_t *io, const void *data, int len) {
+	const uint8_t *d=(const uint8_t*)data;
+	io->crc=crc32_update(io->crc, d, len);
+	for (int i=0; i<len; i++) {
+		io->buf[io->bufpos++]=d[i];
+		if (io->bufpos==sizeof(io->buf)) ckpt_flush(io);
+	}
+}
+
+static void ckpt_get(ckpt_io_t *io, void *data, int len) {
+	uint8_t *d=(uint8_t*)data;
+	for (int i=0; i<len; i++) {
+		if (io->bufpos==0 || io->bufpos==sizeof(io->buf)) {
+			io->ok&=io->tj->flash_read(ckpt_io_addr(io), io->buf, sizeof(io->buf), io->tj->flashcb_arg);
+			io->pos+=sizeof(io->buf);
+			io->bufpos=0;
+		}
+		d[i]=io->buf[io->bufpos++];
+	}
+	io->crc=crc32_update(io->crc, d, len);
+}
+
+static int ckpt_data_len(tjftl_t *tj) {
+	return tj->backing_blks*(sizeof(uint8_t)+sizeof(uint32_t))+tj->sect_cnt*sizeof(uint16_t);
+}
+
+//Writes the data of a checkpoint: per block the state and serial, then per lba the location
+//as block*64+sector, or 0xffff if it's not written.
+static uint32_t ckpt_write_data(tjftl_t *tj, const int *blks, int nblk, bool *ok) {
+	ckpt_io_t io={.tj=tj, .blks=blks, .ok=true};
+	for (int i=0; i<tj->backing_blks; i++) {
+		uint8_t st=tj->blk[i].state;
+		if (st==BLK_CKPT) {
+			//Blocks of the old checkpoint are free once this one is done
+			st=BLK_FREE;
+			for (int j=0; j<nblk; j++) if (blks[j]==i) st=BLK_CKPT;
+		}
+		if (tj->blk[i].in_pool) st|=0x80;
+		ckpt_put(&io, &st, 1);
+	}
+	for (int i=0; i<tj->backing_blks; i++) ckpt_put(&io, &tj->blk[i].serial, 4);
+	for (int i=0; i<tj->sect_cnt; i++) {
+		uint16_t v=tj->lba_cache[i]?tj->lba_cache[i]-1:0xffff;
+		ckpt_put(&io, &v, 2);
+	}
+	ckpt_flush(&io);
+	*ok=io.ok;
+	return io.crc;
+}
+
+static bool rec_valid(const tjftl_ckpt_rec_t *rec, uint32_t magic) {
+	return rec->magic==magic && rec->nblk<=CKPT_MAX_BLKS &&
+			rec->rec_crc==crc32_update(0, (const uint8_t*)rec, offsetof(tjftl_ckpt_rec_t, rec_crc));
+}
+
+static bool anchor_append(tjftl_t *tj, tjftl_ckpt_rec_t *rec) {
+	rec->rec_crc=crc32_update(0, (uint8_t*)rec, offsetof(tjftl_ckpt_rec_t, rec_crc));
+	if (tj->anchor_pos+sizeof(tjftl_ckpt_rec_t)>BLKSZ) {
+		//Anchor is full. If power fails before the record is written, the next mount does
+		//a full scan.
+		if (!tj->flash_erase(tj->anchor_blk*BLKSZ, tj->flashcb_arg)) return false;
+		tj->anchor_pos=0;
+	}
+	bool ret=tj->flash_program(tj->anchor_blk*BLKSZ+tj->anchor_pos, (uint8_t*)rec, sizeof(*rec), tj->flashcb_arg);
+	tj->anchor_pos+=sizeof(*rec);
+	return ret;
+}
+
+//Stops using checkpoints: erases the anchor, so the next mount does a full scan and any
+//free block can be used.
+static bool ckpt_disable(tjftl_t *tj) {
+	if (!tj->ckpt_on) return true;
+	TJ_MSG("Disabling checkpoints\n");
+	if (!tj->flash_erase(tj->anchor_blk*BLKSZ, tj->flashcb_arg)) return false;
+	tj->anchor_pos=0;
+	tj->ckpt_on=0;
+	for (int i=0; i<tj->ckpt_blks; i++) {
+		tj->blk[tj->ckpt_blk[i]].state=BLK_FREE;
+		tj->free_blk_cnt++;
+	}
+	return true;
+}
+
+//Writes a checkpoint and hands out a new pool of free blocks. Only call this while there's no
+//current_write_block. Returns false if there's not enough free blocks or on flash errors; in
+//that case, the old checkpoint (if any) is still current.
+static bool ckpt_write(tjftl_t *tj) {
+	int newblk[CKPT_MAX_BLKS];
+	int n=0;
+	if (tj->ckpt_blks==0 || !tj->anchor_ready || tj->current_write_block!=-1) return false;
+	//Keep checkpoints out of the first 4 blocks, tjftl_detect looks for data there.
+	int start=4+rand()%(tj->backing_blks-4);
+	for (int i=0; i<tj->backing_blks && n<tj->ckpt_blks; i++) {
+		int b=(start+i)%tj->backing_blks;
+		if (b>=4 && tj->blk[b].state==BLK_FREE && b!=tj->current_gc_block) newblk[n++]=b;
+	}
+	//Need space for the checkpoint and at least one block to write to afterwards.
+	if (n<tj->ckpt_blks || tj->free_blk_cnt<n+1) return false;
+	TJ_MSG("Writing checkpoint at serial %d\n", tj->current_serial);
+	for (int i=0; i<n; i++) {
+		if (!tj->flash_erase(newblk[i]*BLKSZ, tj->flashcb_arg)) return false;
+	}
+	//Pick the new pool from the remaining free blocks
+	start=tj->prefer_first_sectors?0:rand()%tj->backing_blks;
+	int pool=0;
+	for (int i=0; i<tj->backing_blks; i++) {
+		int b=(start+i)%tj->backing_blks;
+		bool isnew=false;
+		for (int j=0; j<n; j++) if (newblk[j]==b) isnew=true;
+		tj->blk[b].in_pool=(pool<CKPT_POOL_BLKS && tj->blk[b].state==BLK_FREE && !isnew && b!=tj->current_gc_block);
+		if (tj->blk[b].in_pool) pool++;
+	}
+	for (int i=0; i<n; i++) tj->blk[newblk[i]].state=BLK_CKPT;
+	bool ok;
+	uint32_t crc=ckpt_write_data(tj, newblk, n, &ok);
+	tjftl_ckpt_hdr_t hdr={
+		.magic=CKPT_MAGIC,
+		.serial=tj->current_serial,
+		.nblk=n,
+		.len=ckpt_data_len(tj),
+	};
+	for (int i=0; i<n && ok; i++) {
+		hdr.idx=i;
+		ok&=tj->flash_program(newblk[i]*BLKSZ, (uint8_t*)&hdr, sizeof(hdr), tj->flashcb_arg);
+	}
+	tjftl_ckpt_rec_t rec;
+	memset(&rec, 0xff, sizeof(rec));
+	rec.magic=CKPT_ANCHOR_MAGIC;
+	rec.serial=tj->current_serial;
+	rec.crc=crc;
+	rec.nblk=n;
+	for (int i=0; i<n; i++) rec.blk[i]=newblk[i];
+	if (ok) ok=anchor_append(tj, &rec);
+	if (!ok) {
+		TJ_MSG("Writing checkpoint failed\n");
+		for (int i=0; i<n; i++) tj->blk[newblk[i]].state=BLK_FREE;
+		return false;
+	}
+	//New checkpoint is live; the blocks of the old one are free now.
+	if (tj->ckpt_on) {
+		for (int i=0; i<tj->ckpt_blks; i++) tj->blk[tj->ckpt_blk[i]].state=BLK_FREE;
+		tj->free_blk_cnt+=tj->ckpt_blks;
+	}
+	for (int i=0; i<n; i++) tj->ckpt_blk[i]=newblk[i];
+	tj->free_blk_cnt-=n;
+	tj->ckpt_serial=tj->current_serial;
+	tj->pool_ext=0;
+	tj->ckpt_on=1;
+	return true;
+}
+
+//Adds some free blocks to the pool of the current checkpoint. Returns false if the pool has
+//grown enough that it's time for a new checkpoint.
+static bool ckpt_extend_pool(tjftl_t *tj) {
+	tjftl_ckpt_rec_t rec;
+	if (tj->pool_ext>=CKPT_POOL_EXT_MAX) return false;
+	if (tj->anchor_pos+sizeof(rec)>BLKSZ) return false; //anchor full
+	memset(&rec, 0xff, sizeof(rec));
+	rec.magic=CKPT_POOL_MAGIC;
+	rec.serial=tj->ckpt_serial;
+	rec.crc=0;
+	rec.nblk=0;
+	int start=tj->prefer_first_sectors?0:rand()%tj->backing_blks;
+	for (int i=0; i<tj->backing_blks && rec.nblk<CKPT_MAX_BLKS; i++) {
+		int b=(start+i)%tj->backing_blks;
+		if (tj->blk[b].state==BLK_FREE && !tj->blk[b].in_pool && b!=tj->current_gc_block) rec.blk[rec.nblk++]=b;
+	}
+	if (rec.nblk==0) return false;
+	if (!anchor_append(tj, &rec)) return false;
+	TJ_MSG("Added %d blocks to the pool\n", rec.nblk);
+	for (int i=0; i<rec.nblk; i++) tj->blk[rec.blk[i]].in_pool=1;
+	tj->pool_ext+=rec.nblk;
+	return true;
+}
+
+//Tries to load the block table and lba map from the current checkpoint, then reads the headers
+//of the pool blocks to pick up what was written after it. Returns false if there's no usable
+//checkpoint; the table and map are garbage in that case.
+static bool ckpt_load(tjftl_t *tj) {
+	tjftl_ckpt_rec_t recs[SEC_DATA_SIZE/sizeof(tjftl_ckpt_rec_t)];
+	tjftl_ckpt_rec_t cur={0};
+	int cur_pos=-1;
+	if (tj->ckpt_blks==0) return false;
+	//Find the last checkpoint record in the anchor, and the end of the log
+	tj->anchor_pos=BLKSZ;
+	for (int off=0; off<BLKSZ && tj->anchor_pos==BLKSZ; off+=sizeof(recs)) {
+		if (!tj->flash_read(tj->anchor_blk*BLKSZ+off, (uint8_t*)recs, sizeof(recs), tj->flashcb_arg)) return false;
+		for (int i=0; i<sizeof(recs)/sizeof(recs[0]); i++) {
+			if (recs[i].magic==0xFFFFFFFF) {
+				tj->anchor_pos=off+i*sizeof(recs[0]);
+				break;
+			}
+			if (rec_valid(&recs[i], CKPT_ANCHOR_MAGIC)) {
+				cur=recs[i];
+				cur_pos=off+i*sizeof(recs[0]);
+			}
+		}
+	}
+	if (cur_pos==-1 || cur.nblk!=tj->ckpt_blks) return false;
+	for (int i=0; i<cur.nblk; i++) {
+		tjftl_ckpt_hdr_t hdr;
+		tj->ckpt_blk[i]=cur.blk[i];
+		if (cur.blk[i]>=tj->backing_blks || cur.blk[i]==tj->anchor_blk) return false;
+		if (!tj->flash_read(cur.blk[i]*BLKSZ, (uint8_t*)&hdr, sizeof(hdr), tj->flashcb_arg)) return false;
+		if (hdr.magic!=CKPT_MAGIC || hdr.serial!=cur.serial || hdr.idx!=i || hdr.nblk!=cur.nblk || hdr.len!=ckpt_data_len(tj)) return false;
+	}
+	TJ_MSG("Loading checkpoint at serial %d\n", cur.serial);
+	ckpt_io_t io={.tj=tj, .blks=tj->ckpt_blk, .ok=true};
+	for (int i=0; i<tj->backing_blks; i++) {
+		uint8_t st;
+		ckpt_get(&io, &st, 1);
+		tj->blk[i].state=st&0x7f;
+		tj->blk[i].in_pool=(st&0x80)?1:0;
+		tj->blk[i].valid=0;
+		if (tj->blk[i].state>BLK_ANCHOR || tj->blk[i].state==BLK_ACTIVE) return false;
+	}
+	for (int i=0; i<tj->backing_blks; i++) ckpt_get(&io, &tj->blk[i].serial, 4);
+	for (int i=0; i<tj->sect_cnt; i++) {
+		uint16_t v;
+		ckpt_get(&io, &v, 2);
+		tj->lba_cache[i]=(v==0xffff)?0:v+1;
+		if (v!=0xffff && lbacache_block(tj->lba_cache[i])>=tj->backing_blks) return false;
+	}
+	if (!io.ok || io.crc!=cur.crc) return false;
+	tj->ckpt_serial=cur.serial;
+	tj->current_serial=cur.serial;
+	tj->pool_ext=0;
+	//Apply the records that added blocks to the pool after the checkpoint was written
+	for (int off=cur_pos+sizeof(recs[0]); off<tj->anchor_pos; off+=sizeof(recs[0])) {
+		if (!tj->flash_read(tj->anchor_blk*BLKSZ+off, (uint8_t*)&recs[0], sizeof(recs[0]), tj->flashcb_arg)) return false;
+		if (!rec_valid(&recs[0], CKPT_POOL_MAGIC) || recs[0].serial!=cur.serial) continue;
+		for (int i=0; i<recs[0].nblk; i++) {
+			int b=recs[0].blk[i];
+			if (b>=tj->backing_blks || tj->blk[b].state==BLK_CKPT || tj->blk[b].state==BLK_ANCHOR) return false;
+			tj->blk[b].in_pool=1;
+			tj->pool_ext++;
+		}
+	}
+	//Blocks added to the pool that way were in use when the checkpoint was written, but they
+	//have been garbage collected since. Anything that still lives in there is in their header.
+	for (int i=0; i<tj->sect_cnt; i++) {
+		if (tj->lba_cache[i]!=0 && tj->blk[lbacache_block(tj->lba_cache[i])].in_pool) tj->lba_cache[i]=0;
+	}
+	//Replay the pool blocks that were written after the checkpoint.
+	for (int i=0; i<tj->backing_blks; i++) {
+		if (!tj->blk[i].in_pool) continue;
+		tjftl_block_t blkh;
+		if (!read_blkhdr(tj, i, &blkh)) return false;
+		if (blkh_valid(&blkh)) {
+			TJ_MSG("Replaying block %d, serial %d\n", i, blkh.serial);
+			tj->blk[i].state=BLK_USED;
+			tj->blk[i].serial=blkh.serial;
+			if (!blkh_is_empty(&blkh)) {
+				if (blkh.serial > tj->current_serial) tj->current_serial=blkh.serial;
+				blk_fill_cache(tj, &blkh, i);
+			}
+		} else {
+			tj->blk[i].state=BLK_FREE;
+		}
+	}
+	tj->ckpt_on=1;
+	tj->anchor_ready=1;
+	return true;
+}
+
 //Check the first 4 blocks. If 2 of them have valid tjftl headers, we assume this is a tjftl
 //partition.
 int tjftl_detect(flashcb_read_t rf, void *arg) {
@@ -263,6 +647,7 @@ int tjftl_detect(flashcb_read_t rf, void *arg) {
 }
 
 static bool garbage_collect(tjftl_t *tj);
+static bool gc_block(tjftl_t *tj, int blkno);
 
 tjftl_t *tjftl_init(flashcb_read_t rf, flashcb_erase_32k_t ef, flashcb_program_t pf, void *arg, int size, int sect_cnt, int verbose) {
 	TJ_MSG("Initializing tjftl with size=%d, sect_cnt %d\n", size, sect_cnt);
@@ -274,8 +659,16 @@ tjftl_t *tjftl_init(flashcb_read_t rf, flashcb_erase_32k_t ef, flashcb_program_t
 		free(ret);
 		return NULL;
 	}
-	if (verbose) printf("tjfl: allocated %d bytes for cache\n", sect_cnt*sizeof(uint32_t));
+	if (verbose) printf("tjfl: allocated %d bytes for cache\n", (int)(sect_cnt*sizeof(uint32_t)));
 #endif
+	ret->blk=calloc(size/BLKSZ, sizeof(tjftl_blkstate_t));
+	if (!ret->blk) {
+#if CACHE_LBALOC
+		free(ret->lba_cache);
+#endif
+		free(ret);
+		return NULL;
+	}
 	ret->flash_read=rf;
 	ret->flash_erase=ef;
 	ret->flash_program=pf;
@@ -285,34 +678,80 @@ tjftl_t *tjftl_init(flashcb_read_t rf, flashcb_erase_32k_t ef, flashcb_program_t
 	ret->current_serial=0;
 	ret->current_write_block=-1;
 	ret->current_gc_block=-1;
+	ret->bg_gc_block=-1;
 	ret->free_blk_cnt=0;
 	ret->prefer_first_sectors=0;
+	//Checkpoints store lba locations as 16 bits, and need a few blocks of their own.
+	int ckpt_len=ckpt_data_len(ret);
+	ret->ckpt_blks=(ckpt_len+CKPT_DATA_PER_BLK-1)/CKPT_DATA_PER_BLK;
+	if (ret->backing_blks>1024 || ret->ckpt_blks>CKPT_MAX_BLKS || ret->backing_blks<GC_MIN_FREE_BLK_CNT*4) ret->ckpt_blks=0;
+	ret->anchor_blk=ret->ckpt_blks?ret->backing_blks-1:-1;
 	bool all_ok=true;
-	for (int i=0; i<ret->backing_blks; i++) {
+	bool from_ckpt=ckpt_load(ret);
+	if (!from_ckpt) {
+		//No (usable) checkpoint. Read all the headers instead.
+		memset(ret->blk, 0, ret->backing_blks*sizeof(tjftl_blkstate_t));
+		memset(ret->lba_cache, 0, sect_cnt*sizeof(uint32_t));
+		ret->current_serial=0;
+		ret->ckpt_on=0;
+		//Whatever ckpt_load found in the anchor block isn't ours to append to.
+		ret->anchor_ready=0;
+		ret->anchor_pos=0;
+	}
+	for (int i=0; i<ret->backing_blks && !from_ckpt; i++) {
 		tjftl_block_t blkh;
 		all_ok&=read_blkhdr(ret, i, &blkh);
 		//If block is invalid or erased it counts as a free block for free_blk_cnt.
 		if (blkh_valid(&blkh)) {
+			//Note that valid empty blocks can't be written to either, as their serial is old.
+			ret->blk[i].state=BLK_USED;
+			ret->blk[i].serial=blkh.serial;
 			if (!blkh_is_empty(&blkh)) {
 				if (blkh.serial > ret->current_serial) ret->current_serial=blkh.serial;
 				blk_fill_cache(ret, &blkh, i);
 			}
+		} else if (i==ret->anchor_blk) {
+			ret->blk[i].state=BLK_ANCHOR;
 		} else {
-			if (i<4) ret->prefer_first_sectors=1;
-			ret->free_blk_cnt++;
+			ret->blk[i].state=BLK_FREE;
+		}
+	}
+	for (int i=0; i<ret->backing_blks; i++) {
+		if (ret->blk[i].state!=BLK_FREE) continue;
+		if (i<4) ret->prefer_first_sectors=1;
+		ret->free_blk_cnt++;
+	}
+	//Now the cache knows where the current version of each lba lives, count the valid sectors.
+	for (int i=0; i<sect_cnt; i++) {
+		if (ret->lba_cache[i]!=0) ret->blk[lbacache_block(ret->lba_cache[i])].valid++;
+	}
+	if (verbose) printf("tjfl: %s; %d of %d blocks free.\n", from_ckpt?"mounted from checkpoint":"full scan", ret->free_blk_cnt, ret->backing_blks);
+	if (!from_ckpt && ret->anchor_blk!=-1 && all_ok) {
+		//Flash written without checkpoints can have data in the anchor block; move that away.
+		//The writes this does can't write a checkpoint yet, as anchor_ready is still 0.
+		if (ret->blk[ret->anchor_blk].state==BLK_USED) {
+			all_ok&=gc_block(ret, ret->anchor_blk);
+			ret->free_blk_cnt--;
 		}
+		ret->blk[ret->anchor_blk].state=BLK_ANCHOR;
+		//Now that the data is safe, erase it along with any stale checkpoint records. New data
+		//may go anywhere until the next checkpoint.
+		if (all_ok) all_ok&=ret->flash_erase(ret->anchor_blk*BLKSZ, ret->flashcb_arg);
+		ret->anchor_pos=0;
+		ret->anchor_ready=all_ok;
 	}
-	if (verbose) printf("tjfl: %d of %d blocks free.\n", ret->free_blk_cnt, ret->backing_blks);
 	if (ret->free_blk_cnt<GC_MIN_FREE_BLK_CNT) {
 		TJ_MSG("Starting initial garbage collection run...\n");
 		all_ok&=garbage_collect(ret);
 		if (verbose) printf("After garbage collection: %d blocks free.\n", ret->free_blk_cnt);
 	}
+	if (!from_ckpt && all_ok && ret->ckpt_blks) ckpt_write(ret);
 	if (!all_ok) {
 		TJ_MSG("ERROR! tjftl failed to initialize.\n");
 #if CACHE_LBALOC
 		free(ret->lba_cache);
 #endif
+		free(ret->blk);
 		free(ret);
 		return NULL;
 	} else {
@@ -368,64 +807,140 @@ static bool find_block_for_lba(tjftl_t *tj, int lba, tjftl_block_t *blkh, int *b
 }
 
 
+//Picks the block to garbage collect next, or returns -1 if there's nothing to gain. Normally, this is
+//the block with the least valid sectors (superseded or unwritten sectors can be reclaimed). Every
+//now and then, it picks the block with the oldest data instead, so static data also gets moved
+//around and its block gets its share of erases.
+static int gc_pick_block(tjftl_t *tj) {
+	int start=rand()%tj->backing_blks; //random starting point, so equal blocks get picked evenly
+	bool oldest=((rand()&0xff)==0);
+	int best=-1;
+	for (int i=0; i<tj->backing_blks; i++) {
+		int blkno=(start+i)%tj->backing_blks;
+		tjftl_blkstate_t *b=&tj->blk[blkno];
+		if (b->state!=BLK_USED || blkno==tj->bg_gc_block) continue;
+		if (oldest) {
+			if (best==-1 || b->serial<tj->blk[best].serial) best=blkno;
+		} else if (b->valid<SEC_PER_BLK) {
+			if (best==-1 || b->valid<tj->blk[best].valid) best=blkno;
+		}
+	}
+	return best;
+}
+
+//Moves the valid sectors out of a block and invalidates it, so it can be re-used.
+static bool gc_block(tjftl_t *tj, int blkno) {
+	tjftl_block_t blkh;
+	bool ret;
+	ret=read_blkhdr(tj, blkno, &blkh);
+	if (!ret) return false;
+	tj->current_gc_block=blkno;
+	//Look at all the sectors, rewrite them if needed
+	TJ_MSG("Garbage collecting blk %d (%d valid), free_cnt=%d\n", blkno, tj->blk[blkno].valid, tj->free_blk_cnt);
+	int moved=0;
+	for (int j=0; j<SEC_PER_BLK && tj->blk[blkno].valid>0 && blkh_valid(&blkh); j++) {
+		if (lba_valid(&blkh.bd[j]) && !lba_erased(&blkh.bd[j]) && !lba_is_superseded(tj, &blkh.bd[j], blkno, j)) {
+			uint8_t buf[SEC_DATA_SIZE];
+			ret=read_sect(tj, blkno, j, buf);
+			if (!ret) return false;
+//			TJ_MSG("Garbage collect: writing block %d sec %d (lba %d)\n", blkno, j, lba_sect(&blkh.bd[j]));
+			ret=tjftl_write(tj, lba_sect(&blkh.bd[j]), buf);
+			if (!ret) return false;
+			moved++;
+		}
+	}
+	//Note: invalidate instead of initialize as we don't know what the serial is going to be when we
+	//are going to use this. The write routine will erase and initialize when it gets to it.
+	//(A block that a checkpoint thinks is in use may already have been invalidated; no need
+	//to do that again.)
+	if (blkh_valid(&blkh)) {
+		blkh.magic=0; //break block
+		write_blkhdr(tj, blkno, &blkh);
+	}
+	if (tj->blk[blkno].valid!=0) {
+		//The lba map still points at sectors in here that aren't in the header anymore. This
+		//happens when they were trimmed after the checkpoint we mounted from was written. Make sure
+		//nothing refers to this block when it gets re-used.
+		TJ_MSG("Block %d still has %d stale map entries\n", blkno, tj->blk[blkno].valid);
+		for (int i=0; i<tj->sect_cnt && tj->blk[blkno].valid!=0; i++) {
+			if (tj->lba_cache[i]!=0 && lbacache_block(tj->lba_cache[i])==blkno) cache_forget(tj, i);
+		}
+	}
+	tj->blk[blkno].state=BLK_FREE;
+	tj->free_blk_cnt++; //yaaaay
+	tj->current_gc_block=-1;
+	TJ_MSG("Cleaned up blk %d by moving %d sects\n", blkno, moved);
+	return true;
+}
+
 //This will find blocks with superseeded sectors in it and re-write the non-superseeded blocks
 //to empty sectors. Once that is done, it will clear the sector so it can be re-used.
 static bool garbage_collect(tjftl_t *tj) {
-	int find_start=rand()%tj->backing_blks; //random starting point, yay wear leveling!
-	int blkno=find_start;
 	int gc_todo = GC_CLEAR_BLOCKS;
-	tjftl_block_t blkh;
-	bool ret;
-	while (gc_todo>0 || tj->free_blk_cnt < GC_MIN_FREE_BLK_CNT) {
-		read_blkhdr(tj, blkno, &blkh);
-		bool should_gc=false;
-		if (blkh_valid(&blkh) && blkno!=tj->current_write_block) {
-			//Block is valid, see if there are superseded sectors or free sectors here.
-			//We also gc on free sectors, as we cannot re-use them as the serial may be wrong.
-			//Note that sectors are marked invalid when garbage collected, and only initialized to
-			//all-empty when selected for write.
-			for (int j=0; j<SEC_PER_BLK; j++) {
-				if (lba_erased(&blkh.bd[j]) || lba_maybe_superseded(tj, &blkh.bd[j], blkno, j)) {
-					should_gc=true;
-				}
-			}
-			//every now and then, move around a static block as well
-			if ((rand()&0xff)==0) {
-				should_gc=true;
-			}
-		}
-		if (should_gc) {
-			tj->current_gc_block=blkno;
-			//Look at all the sectors, rewrite them if needed
-			TJ_MSG("Starting garbage collect round. ToDo=%d, free_cnt=%d; cleaning up blk %d\n", gc_todo, tj->free_blk_cnt, blkno);
-			int  moved=0;
-			for (int j=0; j<SEC_PER_BLK; j++) {
-				if (lba_valid(&blkh.bd[j]) && !lba_erased(&blkh.bd[j]) && !lba_is_superseded(tj, &blkh.bd[j], blkno, j)) {
-					uint8_t buf[SEC_DATA_SIZE];
-					ret=read_sect(tj, blkno, j, buf);
-					if (!ret) return false;
-//					TJ_MSG("Garbage collect: writing block %d sec %d (lba %d)\n", blkno, j, lba_sect(&blkh.bd[j]));
-					ret=tjftl_write(tj, lba_sect(&blkh.bd[j]), buf);
-					if (!ret) return false;
-					moved++;
-				}
-			}
-			//Note: invalidate instead of initialize as we don't know what the serial is going to be when we
-			//are going to use this. The write routine will erase and initialize when it gets to it.
-			blkh.magic=0; //break block
-			write_blkhdr(tj, blkno, &blkh);
-			tj->free_blk_cnt++; //yaaaay
-			gc_todo--;
-			tj->current_gc_block=-1;
-			TJ_MSG("Did garbage collect round. ToDo=%d, free_cnt=%d; cleaned up blk %d by moving %d sects\n", gc_todo, tj->free_blk_cnt, blkno, moved);
+	int done=0;
+	if (tj->bg_gc_block!=-1) {
+		//tjftl_gc_step() already moved part of this block; finish it first.
+		int blkno=tj->bg_gc_block;
+		tj->bg_gc_block=-1;
+		if (!gc_block(tj, blkno)) return false;
+		gc_todo--;
+		done++;
+	}
+	while ((gc_todo>0 || tj->free_blk_cnt < GC_MIN_FREE_BLK_CNT) && (done<GC_MAX_BLOCKS || tj->free_blk_cnt<2)) {
+		int blkno=gc_pick_block(tj);
+		if (blkno==-1) {
+			TJ_MSG("Garbage collect: no block has anything to reclaim.\n");
+			break;
 		}
-		blkno++;
-		if (blkno>=tj->backing_blks) blkno=0;
+		if (!gc_block(tj, blkno)) return false;
+		gc_todo--;
+		done++;
 	}
 	TJ_MSG("Garbage collection done; free_blk_cnt=%d.\n", tj->free_blk_cnt);
 	return true;
 }
 
+bool tjftl_gc_step(tjftl_t *tj, int max_sects) {
+	//If we're nearly out of free blocks, leave it to garbage_collect(); it needs the last ones to
+	//move sectors into.
+	if (tj->current_gc_block!=-1 || tj->free_blk_cnt<2) return false;
+	if (tj->bg_gc_block==-1) {
+		if (tj->free_blk_cnt>=GC_BG_FREE_BLK_CNT) return false;
+		int blkno=gc_pick_block(tj);
+		if (blkno==-1) return false;
+		TJ_MSG("Background gc: starting on blk %d (%d valid), free_cnt=%d\n", blkno, tj->blk[blkno].valid, tj->free_blk_cnt);
+		tj->bg_gc_block=blkno;
+		tj->bg_gc_sec=0;
+	}
+	int blkno=tj->bg_gc_block;
+	tjftl_block_t blkh;
+	if (!read_blkhdr(tj, blkno, &blkh)) return false;
+	//Same as gc_block(), but stop after moving max_sects sectors and continue from there next time.
+	//Sectors that get written by someone else in the mean time are superseded here, so they're
+	//skipped automatically.
+	tj->current_gc_block=blkno;
+	int moved=0;
+	while (tj->bg_gc_sec<SEC_PER_BLK && tj->blk[blkno].valid>0 && blkh_valid(&blkh)) {
+		int j=tj->bg_gc_sec;
+		if (lba_valid(&blkh.bd[j]) && !lba_erased(&blkh.bd[j]) && !lba_is_superseded(tj, &blkh.bd[j], blkno, j)) {
+			if (moved==max_sects) break;
+			uint8_t buf[SEC_DATA_SIZE];
+			if (!read_sect(tj, blkno, j, buf) || !tjftl_write(tj, lba_sect(&blkh.bd[j]), buf)) {
+				tj->current_gc_block=-1;
+				return false;
+			}
+			moved++;
+		}
+		tj->bg_gc_sec++;
+	}
+	tj->current_gc_block=-1;
+	if (tj->bg_gc_sec<SEC_PER_BLK && tj->blk[blkno].valid>0 && blkh_valid(&blkh)) return true;
+	//Nothing valid left; gc_block() only needs to invalidate it now.
+	tj->bg_gc_block=-1;
+	if (!gc_block(tj, blkno)) return false;
+	return (tj->free_blk_cnt<GC_BG_FREE_BLK_CNT);
+}
+
 bool tjftl_read(tjftl_t *tj, int lba, uint8_t *buf) {
 	bool ret;
 	int blkno, sect_in_blk;
@@ -441,122 +956,201 @@ bool tjftl_read(tjftl_t *tj, int lba, uint8_t *buf) {
 	}
 }
 
-
-bool tjftl_write(tjftl_t *tj, int lba, const uint8_t *buf) {
-	tjftl_block_t blkh;
-	bool ret;
-	TJ_CHECK(lba>=0 && lba<tj->sect_cnt, "lba fucky");
-	
-//	TJ_MSG("tjfl_write lba %d, current_write_block %d\n", lba, tj->current_write_block);
-	//First, find current version of the block and mark as maybe-superseded.
-	//cache doesn't get a speed boost from non-superseded sectors, so we mark everything as superseded 
-	//from the start when we initially write the sector.
-#if !CACHE_LBALOC 
-	int blkno, sect_in_blk;
-	bool found=find_block_for_lba(tj, lba, &blkh, &blkno, &sect_in_blk);
-	if (found && !lba_maybe_superseded(tj, &blkh.bd[sect_in_blk]), blkno, sect_in_blk) {
-		TJ_MSG("tjfl_write: marking old sect (blk %d sec %d) as superseded\n", blkno, sect_in_blk);
-		blkh.bd[sect_in_blk].lba &= ~LBA_SUPERSEDED_MSK;
-		blkh.bd[sect_in_blk].lba_inv &= ~LBA_SUPERSEDED_MSK;
-		ret=write_blkhdr(tj, blkno, &blkh);
-		if (!ret) return false;
-	}
+bool tjftl_read_multi(tjftl_t *tj, int lba, int count, uint8_t *buf) {
+	TJ_CHECK(lba>=0 && count>=0 && lba+count<=tj->sect_cnt, "lba fucky");
+	while (count>0) {
+		int blkno, sect_in_blk;
+		int n=1;
+		if (find_block_for_lba(tj, lba, NULL, &blkno, &sect_in_blk)) {
+#if CACHE_LBALOC
+			//Sequentially written lbas usually end up next to each other in a block; read those
+			//in one go.
+			while (n<count && sect_in_blk+n<SEC_PER_BLK && tj->lba_cache[lba+n]==tj->lba_cache[lba]+n) n++;
 #endif
-
-	if (tj->current_write_block == -1) {
-		//We don't have a block that can accept another sector. We need to do some effort to find one...
-		//Let's look for a block that is either entirely empty, is invalid, or has some empty sectors in it.
-		int find_start;
-		if (tj->prefer_first_sectors) {
-			find_start=0; //start allocating at the beginning
+			int addr=blkno*BLKSZ+(sect_in_blk+1)*SEC_DATA_SIZE;
+			if (!tj->flash_read(addr, buf, n*SEC_DATA_SIZE, tj->flashcb_arg)) return false;
 		} else {
-			find_start=rand()%tj->backing_blks; //random starting point, yay wear leveling!
+			memset(buf, 0xff, SEC_DATA_SIZE);
 		}
+		lba+=n;
+		count-=n;
+		buf+=n*SEC_DATA_SIZE;
+	}
+	return true;
+}
 
-		int blkno=find_start;
-		TJ_MSG("tjfl_write: find new empty block, start at: %d, free_cnt=%d\n", blkno, tj->free_blk_cnt);
-		do {
-			ret=read_blkhdr(tj, blkno, &blkh);
-			if (!ret) return false;
-			if (blkno!=tj->current_gc_block && !blkh_valid(&blkh)) {
-				//Found an invalid/erased block! Initialize it.
-				TJ_MSG("tjfl_write: %d is invalid or empty: using it\n", blkno);
-				ret=blk_initialize(tj, blkno, &blkh);
-				if (!ret) {
-				TJ_MSG("tjftl_write: Block initialize failed\n");
-					return false;
-				}
-				tj->current_write_block = blkno;
-			} else {
-				//No dice.
-				//Note that we don't grab any blocks that exist and may have some free sectors, as these
-				//may have an older serial and we can't update it without running the risk of making the
-				//old sectors superseded.
-				blkno++;
-				if (blkno>=tj->backing_blks) blkno=0;
-			}
-		} while (tj->current_write_block == -1 && blkno!=find_start);
-		if (blkno>4) tj->prefer_first_sectors=0;
+
+//Finds a block that can be initialized to write new sectors to. While there's a checkpoint, only
+//blocks from its pool can be used.
+//Note that we don't grab any blocks that exist and may have some free sectors, as these may have an
+//older serial and we can't update it without running the risk of making the old sectors superseded.
+static int find_free_block(tjftl_t *tj) {
+	int find_start;
+	if (tj->prefer_first_sectors) {
+		find_start=0; //start allocating at the beginning
 	} else {
-		//We already have an active block. Grab its header.
-		ret=read_blkhdr(tj, tj->current_write_block, &blkh);
-		if (!ret) {
-			TJ_MSG("Huh? Read_blkhdr failed for block %d\n", tj->current_write_block);
-			return false;
-		}
+		find_start=rand()%tj->backing_blks; //random starting point, yay wear leveling!
+	}
+	TJ_MSG("find_free_block: start at: %d, free_cnt=%d\n", find_start, tj->free_blk_cnt);
+	for (int i=0; i<tj->backing_blks; i++) {
+		int blkno=(find_start+i)%tj->backing_blks;
+		if (blkno==tj->current_gc_block || tj->blk[blkno].state!=BLK_FREE) continue;
+		if (tj->ckpt_on && !tj->blk[blkno].in_pool) continue;
+		return blkno;
+	}
+	return -1;
+}
+
+//Makes sure there's a current_write_block with at least one free sector.
+static bool get_write_block(tjftl_t *tj) {
+	if (tj->current_write_block != -1) return true;
+	//We don't have a block that can accept another sector. Find a free one.
+	if (!tj->ckpt_on && tj->ckpt_blks && tj->free_blk_cnt>=GC_MIN_FREE_BLK_CNT) {
+		//Checkpoints were disabled because we ran low on space; try again.
+		ckpt_write(tj);
+	}
+	int blkno=find_free_block(tj);
+	if (blkno==-1 && tj->ckpt_on) {
+		//Used up the pool. Add some blocks to it, or write a new checkpoint with a new
+		//pool; if that fails, stop using checkpoints so any free block can be used.
+		if (!ckpt_extend_pool(tj) && !ckpt_write(tj) && !ckpt_disable(tj)) return false;
+		blkno=find_free_block(tj);
 	}
-	if (tj->current_write_block == -1) {
+	if (blkno==-1) {
 		TJ_MSG("WtF, no free block found?\n");
 		return false;
 	}
-
-	//We have a currently-active block with some free space when we end up here.
-	//The (current) header is in blkh.
-	int free_sec_in_blk=blkh_next_free_sec(&blkh);
-	TJ_CHECK(free_sec_in_blk!=-1, "block should have free sec");
-//	TJ_MSG("Going to write data to blk %d sec %d\n", tj->current_write_block, free_sec_in_blk);
-	ret=write_sect(tj, tj->current_write_block, free_sec_in_blk, buf);
-	if (!ret) {
-		TJ_MSG("Write sect failed\n");
+	TJ_MSG("tjfl_write: %d is invalid or empty: using it\n", blkno);
+	if (!blk_initialize(tj, blkno, &tj->wblk_hdr)) {
+		TJ_MSG("tjftl_write: Block initialize failed\n");
 		return false;
 	}
-	blkh.bd[free_sec_in_blk].lba=lba;
-	blkh.bd[free_sec_in_blk].lba_inv=~lba;
+	tj->current_write_block = blkno;
+	if (blkno>4) tj->prefer_first_sectors=0;
+	return true;
+}
+
+bool tjftl_write_multi(tjftl_t *tj, int lba, int count, const uint8_t *buf) {
+	bool ret;
+	TJ_CHECK(lba>=0 && count>=0 && lba+count<=tj->sect_cnt, "lba fucky");
+	while (count>0) {
+//		TJ_MSG("tjfl_write lba %d count %d, current_write_block %d\n", lba, count, tj->current_write_block);
+		//First, find current version of the block and mark as maybe-superseded.
+		//cache doesn't get a speed boost from non-superseded sectors, so we mark everything as superseded 
+		//from the start when we initially write the sector.
+#if !CACHE_LBALOC 
+		tjftl_block_t blkh;
+		int blkno, sect_in_blk;
+		bool found=find_block_for_lba(tj, lba, &blkh, &blkno, &sect_in_blk);
+		if (found && !lba_maybe_superseded(tj, &blkh.bd[sect_in_blk]), blkno, sect_in_blk) {
+			TJ_MSG("tjfl_write: marking old sect (blk %d sec %d) as superseded\n", blkno, sect_in_blk);
+			blkh.bd[sect_in_blk].lba &= ~LBA_SUPERSEDED_MSK;
+			blkh.bd[sect_in_blk].lba_inv &= ~LBA_SUPERSEDED_MSK;
+			ret=write_blkhdr(tj, blkno, &blkh);
+			if (!ret) return false;
+		}
+#endif
+		if (!get_write_block(tj)) return false;
+
+		//We have a currently-active block with some free space when we end up here.
+		//The (current) header is in wblk_hdr. Free sectors are always at the end of a block, so
+		//we can write as many sectors as fit in one go.
+		tjftl_block_t *wblkh=&tj->wblk_hdr;
+		int free_sec_in_blk=blkh_next_free_sec(wblkh);
+		TJ_CHECK(free_sec_in_blk!=-1, "block should have free sec");
+		int n=SEC_PER_BLK-free_sec_in_blk;
 #if CACHE_LBALOC
-	//We always mark blocks as superseded.
-	blkh.bd[free_sec_in_blk].lba &= ~LBA_SUPERSEDED_MSK;
-	blkh.bd[free_sec_in_blk].lba_inv &= ~LBA_SUPERSEDED_MSK;
-	//Extra-special todo: if the old lba is in this block as well, nuke it, as the serial won't help us anymore.
-	int oldblkno, oldsec;
-	if (find_block_for_lba(tj, lba, NULL, &oldblkno, &oldsec)) {
-		if (oldblkno==tj->current_write_block) {
-			blkh.bd[oldsec].lba=0;
-			blkh.bd[oldsec].lba_inv=0;
+		if (n>count) n=count;
+#else
+		n=1; //need to mark each old sector as superseded first
+#endif
+//		TJ_MSG("Going to write %d sects to blk %d sec %d\n", n, tj->current_write_block, free_sec_in_blk);
+		ret=write_sect(tj, tj->current_write_block, free_sec_in_blk, n, buf);
+		if (!ret) {
+			TJ_MSG("Write sect failed\n");
+			return false;
 		}
-	}
+		for (int i=0; i<n; i++) {
+			tjfl_blockdesc_t *bd=&wblkh->bd[free_sec_in_blk+i];
+			bd->lba=lba+i;
+			bd->lba_inv=~(lba+i);
+#if CACHE_LBALOC
+			//We always mark blocks as superseded.
+			bd->lba &= ~LBA_SUPERSEDED_MSK;
+			bd->lba_inv &= ~LBA_SUPERSEDED_MSK;
+			//Extra-special todo: if the old lba is in this block as well, nuke it, as the serial won't help us anymore.
+			int oldblkno, oldsec;
+			if (find_block_for_lba(tj, lba+i, NULL, &oldblkno, &oldsec)) {
+				if (oldblkno==tj->current_write_block) {
+					wblkh->bd[oldsec].lba=0;
+					wblkh->bd[oldsec].lba_inv=0;
+				}
+			}
 #endif
-	ret=write_blkhdr(tj, tj->current_write_block, &blkh);
-	if (!ret) {
-		TJ_MSG("Write block header failed\n");
-		return false;
+		}
+		//One header write makes all sectors we just wrote valid.
+		ret=write_blkhdr(tj, tj->current_write_block, wblkh);
+		if (!ret) {
+			TJ_MSG("Write block header failed\n");
+			return false;
+		}
+		for (int i=0; i<n; i++) cache_update(tj, lba+i, tj->current_write_block, free_sec_in_blk+i);
+		lba+=n;
+		count-=n;
+		buf+=n*SEC_DATA_SIZE;
+		//see if we used up the current block; if so we need to find a new one next
+		//time. Also check if we need to gc.
+		if (blkh_next_free_sec(wblkh)==-1) {
+			TJ_MSG("Block %d ran out of space.\n", tj->current_write_block);
+			tj->blk[tj->current_write_block].state=BLK_USED;
+			tj->current_write_block=-1;
+			tj->free_blk_cnt--; //technically should already decrease after the first sector is written, but
+								//we can safely do it here as well.
+			//Garbage collect if we run out of free blocks, but not if we're already collecting garbage.
+			if (tj->free_blk_cnt<GC_MIN_FREE_BLK_CNT && tj->current_gc_block==-1) {
+				bool r=garbage_collect(tj);
+				if (!r) {
+					TJ_MSG("Garbage collect failed.\n");
+					return false;
+				}
+			}
+		}
 	}
-	cache_update(tj, lba, tj->current_write_block, free_sec_in_blk);
-	//see if we used up the current block; if so we need to find a new one next
-	//time. Also check if we need to gc.
-	if (blkh_next_free_sec(&blkh)==-1) {
-		TJ_MSG("Block %d ran out of space.\n", tj->current_write_block);
-		tj->current_write_block=-1;
-		tj->free_blk_cnt--; //technically should already decrease after the first sector is written, but
-							//we can safely do it here as well.
-		//Garbage collect if we run out of free blocks, but not if we're already collecting garbage.
-		if (tj->free_blk_cnt<GC_MIN_FREE_BLK_CNT && tj->current_gc_block==-1) {
-			bool r=garbage_collect(tj);
-			if (!r) {
-				TJ_MSG("Garbage collect failed.\n");
-				return false;
+	return true;
+}
+
+bool tjftl_write(tjftl_t *tj, int lba, const uint8_t *buf) {
+	return tjftl_write_multi(tj, lba, 1, buf);
+}
+
+//Marks the descriptors of trimmed sectors as invalid, so the data doesn't come back on the next mount
+//and garbage collection doesn't need to move it anymore. Programming the descriptor to all zeroes
+//can't turn it into a valid descriptor for another lba, even if power fails halfway.
+bool tjftl_trim(tjftl_t *tj, int lba, int count) {
+	TJ_CHECK(lba>=0 && count>=0 && lba+count<=tj->sect_cnt, "lba fucky");
+	tjftl_block_t blkh;
+	tjftl_block_t *h=NULL;
+	int hblk=-1; //block h is the header of
+	for (int i=lba; i<lba+count; i++) {
+		int blkno, sect_in_blk;
+		if (!find_block_for_lba(tj, i, NULL, &blkno, &sect_in_blk)) continue;
+		if (blkno!=hblk) {
+			//Sectors written sequentially are usually together in a block, so this mostly needs
+			//one header write per block.
+			if (h && !write_blkhdr(tj, hblk, h)) return false;
+			if (blkno==tj->current_write_block) {
+				h=&tj->wblk_hdr;
+			} else {
+				h=&blkh;
+				if (!read_blkhdr(tj, blkno, h)) return false;
 			}
+			hblk=blkno;
 		}
+		h->bd[sect_in_blk].lba=0;
+		h->bd[sect_in_blk].lba_inv=0;
+		cache_forget(tj, i);
 	}
+	if (h && !write_blkhdr(tj, hblk, h)) return false;
 	return true;
 }
 
@@ -12,5 +12,17 @@ int tjftl_detect(flashcb_read_t rf, void *arg);
 tjftl_t *tjftl_init(flashcb_read_t rf, flashcb_erase_32k_t ef, flashcb_program_t pf, void *arg, int size, int sect_cnt, int verbose);
 bool tjftl_read(tjftl_t *tj, int lba, uint8_t *buf);
 bool tjftl_write(tjftl_t *tj, int lba, const uint8_t *buf);
+//Read or write count consecutive sectors. These coalesce flash accesses to sectors that are next to
+//each other on flash, so they're a lot faster than calling tjftl_read/tjftl_write in a loop.
+bool tjftl_read_multi(tjftl_t *tj, int lba, int count, uint8_t *buf);
+bool tjftl_write_multi(tjftl_t *tj, int lba, int count, const uint8_t *buf);
+//Tell the ftl the data in count sectors starting at lba isn't needed anymore, so it doesn't have to be
+//preserved by garbage collection. Reading a trimmed sector returns 0xff bytes, or possibly old data
+//after a power cycle.
+bool tjftl_trim(tjftl_t *tj, int lba, int count);
+//Does a bit of garbage collection ahead of time, so writes rarely have to stop and do it themselves.
+//Moves at most max_sects sectors per call (a sector move is about one read and two flash programs,
+//plus the occasional 32K erase). Call this when idle. Returns true if there's more to do.
+bool tjftl_gc_step(tjftl_t *tj, int max_sects);
 
 
@@ -82,8 +82,9 @@
 #define CFG_TUD_CDC_RX_BUFSIZE      64
 #define CFG_TUD_CDC_TX_BUFSIZE      64
 
-// MSC Buffer size of Device Mass storage
-#define CFG_TUD_MSC_BUFSIZE         512
+// MSC Buffer size of Device Mass storage. READ10/WRITE10 are handed to fs.c in chunks of this
+// size, so a bigger buffer lets tjftl read and program several sectors per call.
+#define CFG_TUD_MSC_BUFSIZE         4096
 
 // HID buffer size Should be sufficient to hold ID (if any) + Data
 #define CFG_TUD_HID_BUFSIZE         16
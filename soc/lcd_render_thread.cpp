@@ -0,0 +1,118 @@
+/*
+ * Copyright 2019 Jeroen Domburg <jeroen@spritesmods.com>
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "lcd_render_thread.hpp"
+
+//Queue entries: db in the lower 18 bits, then rs, rd and wr.
+#define EV_RS (1<<18)
+#define EV_RD (1<<19)
+#define EV_WR (1<<20)
+
+Lcd_render_thread::Lcd_render_thread(Lcd_renderer *lcd) {
+	m_lcd=lcd;
+	m_lastwr=1;
+	m_head=0;
+	m_tail=0;
+	m_running=true;
+	m_sleeping=false;
+	m_kick=false;
+	m_frame_count=lcd->get_frame_count();
+	m_frame=new uint8_t[LCD_RENDERER_W*LCD_RENDERER_H*3]();
+	m_frame_new=false;
+	m_thread=thread(&Lcd_render_thread::thread_main, this);
+}
+
+Lcd_render_thread::~Lcd_render_thread() {
+	m_running=false;
+	wake();
+	m_thread.join();
+	delete[] m_frame;
+}
+
+//Wakes up the render thread if it's waiting for events. Callers first change something the
+//thread's wait condition looks at; as the thread sets m_sleeping before it checks that, either
+//we see m_sleeping set or it sees the change.
+void Lcd_render_thread::wake() {
+	if (!m_sleeping) return;
+	lock_guard<mutex> lock(m_mutex);
+	m_cond.notify_one();
+}
+
+void Lcd_render_thread::update(int db, int wr, int rd, int rs) {
+	if (wr==m_lastwr) return;
+	m_lastwr=wr;
+	unsigned int head=m_head.load(memory_order_relaxed);
+	//Queue full: wait for the render thread to catch up.
+	while (head-m_tail.load(memory_order_acquire)>=LCD_RENDER_THREAD_QUEUE_LEN) {
+		wake();
+		this_thread::yield();
+	}
+	m_queue[head&(LCD_RENDER_THREAD_QUEUE_LEN-1)]=(db&0x3ffff)|(rs?EV_RS:0)|(rd?EV_RD:0)|(wr?EV_WR:0);
+	m_head.store(head+1);
+	if (head+1-m_tail.load(memory_order_relaxed)>=LCD_RENDER_THREAD_BATCH) wake();
+}
+
+void Lcd_render_thread::sync() {
+	m_kick=true;
+	wake();
+	while (m_tail.load(memory_order_acquire)!=m_head.load(memory_order_relaxed)) this_thread::yield();
+}
+
+void Lcd_render_thread::present() {
+	//Events that didn't make a full batch yet may hold the end of a frame.
+	if (m_head.load(memory_order_relaxed)!=m_tail.load(memory_order_relaxed)) {
+		m_kick=true;
+		wake();
+	}
+	if (!m_frame_new.load(memory_order_relaxed)) return;
+	lock_guard<mutex> lock(m_frame_mutex);
+	m_frame_new=false;
+	m_lcd->show(m_frame);
+}
+
+void Lcd_render_thread::thread_main() {
+	while (1) {
+		unsigned int tail=m_tail.load(memory_order_relaxed);
+		unsigned int head=m_head.load(memory_order_acquire);
+		if (tail==head) {
+			if (!m_running) break;
+			//Nothing to do; sleep until update() has a batch of events for us, or someone wants
+			//the queue emptied now.
+			unique_lock<mutex> lock(m_mutex);
+			m_sleeping=true;
+			m_cond.wait(lock, [this, tail]{
+				return !m_running || m_kick || m_head-tail>=LCD_RENDER_THREAD_BATCH;
+			});
+			m_sleeping=false;
+			m_kick=false;
+			continue;
+		}
+		while (tail!=head) {
+			uint32_t ev=m_queue[tail&(LCD_RENDER_THREAD_QUEUE_LEN-1)];
+			m_lcd->update(ev&0x3ffff, (ev&EV_WR)?1:0, (ev&EV_RD)?1:0, (ev&EV_RS)?1:0);
+			tail++;
+		}
+		if (m_lcd->get_frame_count()!=m_frame_count) {
+			m_frame_count=m_lcd->get_frame_count();
+			lock_guard<mutex> lock(m_frame_mutex);
+			memcpy(m_frame, m_lcd->get_frame(), LCD_RENDERER_W*LCD_RENDERER_H*3);
+			m_frame_new=true;
+		}
+		m_tail.store(tail, memory_order_release);
+	}
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "video/lcd_renderer.hpp"
+
+using namespace std;
+
+//Must be a power of 2
+#define LCD_RENDER_THREAD_QUEUE_LEN 65536
+//A sleeping render thread is only woken up once this many events are queued.
+#define LCD_RENDER_THREAD_BATCH 1024
+
+//Runs an Lcd_renderer in its own thread, so decoding the LCD bus does not stall the main
+//simulation loop. Only edges on the wr line are queued, as those are the only things
+//Lcd_renderer reacts to. SDL has to be called from the main thread, so completed frames are
+//handed back and shown by present().
+class Lcd_render_thread {
+	public:
+	Lcd_render_thread(Lcd_renderer *lcd);
+	~Lcd_render_thread();
+	void update(int db, int wr, int rd, int rs);
+	//Wait until all queued bus events have been handed to the renderer.
+	void sync();
+	//Call regularly (but not every cycle) from the main thread; shows the last completed frame if
+	//there's a new one.
+	void present();
+
+	private:
+	void thread_main();
+	void wake();
+
+	Lcd_renderer *m_lcd;
+	int m_lastwr;
+	uint32_t m_queue[LCD_RENDER_THREAD_QUEUE_LEN];
+	atomic<unsigned int> m_head; //written by sim thread
+	atomic<unsigned int> m_tail; //written by render thread
+	atomic<bool> m_running;
+	atomic<bool> m_sleeping; //render thread is (about to be) waiting on m_cond
+	atomic<bool> m_kick; //render thread should process the queue even if it's not a full batch
+	mutex m_mutex;
+	condition_variable m_cond;
+	int m_frame_count; //frame count of the renderer when we last copied a frame
+	uint8_t *m_frame; //last completed frame, for present()
+	atomic<bool> m_frame_new;
+	mutex m_frame_mutex;
+	thread m_thread;
+};
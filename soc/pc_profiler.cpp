@@ -0,0 +1,203 @@
+/*
+ * Copyright 2019 Jeroen Domburg <jeroen@spritesmods.com>
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <elf.h>
+#include "pc_profiler.hpp"
+
+Pc_profiler::Pc_profiler(uint32_t base, uint32_t size) {
+	m_base=base;
+	m_size=size;
+	m_chunk=(uint64_t**)calloc((size+PC_PROF_CHUNK-1)/PC_PROF_CHUNK, sizeof(uint64_t*));
+	m_other=0;
+	m_sym=NULL;
+	m_sym_count=0;
+	m_files=NULL;
+	m_file_count=0;
+}
+
+Pc_profiler::~Pc_profiler() {
+	for (uint32_t i=0; i<(m_size+PC_PROF_CHUNK-1)/PC_PROF_CHUNK; i++) free(m_chunk[i]);
+	free(m_chunk);
+	for (int i=0; i<m_sym_count; i++) free((void*)m_sym[i].name);
+	free(m_sym);
+	for (int i=0; i<m_file_count; i++) free(m_files[i]);
+	free(m_files);
+}
+
+uint64_t *Pc_profiler::new_chunk(int i) {
+	m_chunk[i]=(uint64_t*)calloc(PC_PROF_CHUNK/2, sizeof(uint64_t));
+	return m_chunk[i];
+}
+
+static int sym_cmp(const void *a, const void *b) {
+	const pc_prof_sym_t *sa=(const pc_prof_sym_t*)a;
+	const pc_prof_sym_t *sb=(const pc_prof_sym_t*)b;
+	if (sa->addr<sb->addr) return -1;
+	if (sa->addr>sb->addr) return 1;
+	return 0;
+}
+
+int Pc_profiler::add_elf(const char *file) {
+	FILE *f=fopen(file, "rb");
+	if (f==NULL) {
+		perror(file);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	long fsize=ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *buf=(uint8_t*)malloc(fsize);
+	fread(buf, 1, fsize, f);
+	fclose(f);
+
+	Elf32_Ehdr *eh=(Elf32_Ehdr*)buf;
+	if (fsize<(long)sizeof(Elf32_Ehdr) || memcmp(eh->e_ident, ELFMAG, SELFMAG)!=0 ||
+			eh->e_ident[EI_CLASS]!=ELFCLASS32 ||
+			eh->e_shoff+eh->e_shnum*sizeof(Elf32_Shdr)>(unsigned long)fsize) {
+		printf("%s: not a usable 32-bit ELF file\n", file);
+		free(buf);
+		return 1;
+	}
+	m_files=(char**)realloc(m_files, (m_file_count+1)*sizeof(char*));
+	m_files[m_file_count]=strdup(file);
+	const char *symfile=m_files[m_file_count++];
+
+	Elf32_Shdr *sh=(Elf32_Shdr*)&buf[eh->e_shoff];
+	int added=0;
+	for (int i=0; i<eh->e_shnum; i++) {
+		if (sh[i].sh_type!=SHT_SYMTAB || sh[i].sh_link>=eh->e_shnum) continue;
+		Elf32_Sym *sym=(Elf32_Sym*)&buf[sh[i].sh_offset];
+		const char *str=(const char*)&buf[sh[i].sh_link==0?0:sh[sh[i].sh_link].sh_offset];
+		int n=sh[i].sh_size/sizeof(Elf32_Sym);
+		for (int j=0; j<n; j++) {
+			if (ELF32_ST_TYPE(sym[j].st_info)!=STT_FUNC || sym[j].st_value==0) continue;
+			m_sym=(pc_prof_sym_t*)realloc(m_sym, (m_sym_count+1)*sizeof(pc_prof_sym_t));
+			m_sym[m_sym_count].addr=sym[j].st_value;
+			m_sym[m_sym_count].size=sym[j].st_size;
+			m_sym[m_sym_count].name=strdup(&str[sym[j].st_name]);
+			m_sym[m_sym_count].file=symfile;
+			m_sym_count++;
+			added++;
+		}
+	}
+	free(buf);
+	qsort(m_sym, m_sym_count, sizeof(pc_prof_sym_t), sym_cmp);
+	printf("Profiler: %d functions from %s\n", added, file);
+	return 0;
+}
+
+//Finds the function the address is in. Symbols without a size are assumed to extend
+//up to the next symbol.
+const pc_prof_sym_t *Pc_profiler::find_sym(uint32_t addr) {
+	int lo=0, hi=m_sym_count;
+	while (lo<hi) {
+		int mid=(lo+hi)/2;
+		if (m_sym[mid].addr<=addr) lo=mid+1; else hi=mid;
+	}
+	if (lo==0) return NULL;
+	const pc_prof_sym_t *s=&m_sym[lo-1];
+	if (s->size && addr>=s->addr+s->size) return NULL;
+	return s;
+}
+
+typedef struct {
+	const pc_prof_sym_t *sym;
+	uint64_t count;
+} flat_ent_t;
+
+static int flat_cmp(const void *a, const void *b) {
+	const flat_ent_t *ea=(const flat_ent_t*)a;
+	const flat_ent_t *eb=(const flat_ent_t*)b;
+	if (ea->count>eb->count) return -1;
+	if (ea->count<eb->count) return 1;
+	return 0;
+}
+
+int Pc_profiler::write_flat(const char *file) {
+	FILE *f=fopen(file, "w");
+	if (f==NULL) {
+		perror(file);
+		return 1;
+	}
+	//Entry m_sym_count is for samples outside any known function.
+	flat_ent_t *ent=(flat_ent_t*)calloc(m_sym_count+1, sizeof(flat_ent_t));
+	for (int i=0; i<m_sym_count; i++) ent[i].sym=&m_sym[i];
+	ent[m_sym_count].count=m_other;
+	uint64_t total=m_other;
+	for (uint32_t i=0; i<(m_size+PC_PROF_CHUNK-1)/PC_PROF_CHUNK; i++) {
+		if (!m_chunk[i]) continue;
+		for (int j=0; j<PC_PROF_CHUNK/2; j++) {
+			if (!m_chunk[i][j]) continue;
+			const pc_prof_sym_t *s=find_sym(m_base+i*PC_PROF_CHUNK+j*2);
+			ent[s?(s-m_sym):m_sym_count].count+=m_chunk[i][j];
+			total+=m_chunk[i][j];
+		}
+	}
+	qsort(ent, m_sym_count+1, sizeof(flat_ent_t), flat_cmp);
+	fprintf(f, "# %llu samples\n", (unsigned long long)total);
+	fprintf(f, "#      %%      samples  function\n");
+	for (int i=0; i<m_sym_count+1; i++) {
+		if (!ent[i].count) break;
+		fprintf(f, "%8.2f %12llu  ", (ent[i].count*100.0)/total, (unsigned long long)ent[i].count);
+		if (ent[i].sym) {
+			fprintf(f, "%s (%s)\n", ent[i].sym->name, ent[i].sym->file);
+		} else {
+			fprintf(f, "[unknown]\n");
+		}
+	}
+	free(ent);
+	fclose(f);
+	return 0;
+}
+
+int Pc_profiler::write_callgrind(const char *file) {
+	FILE *f=fopen(file, "w");
+	if (f==NULL) {
+		perror(file);
+		return 1;
+	}
+	fprintf(f, "version: 1\ncreator: soc verilator sim\n");
+	fprintf(f, "positions: instr\nevents: Samples\n\n");
+	//Functions are numbered by symbol index plus one; objects by file index plus one.
+	const pc_prof_sym_t *cur=NULL;
+	bool cur_valid=false;
+	for (uint32_t i=0; i<(m_size+PC_PROF_CHUNK-1)/PC_PROF_CHUNK; i++) {
+		if (!m_chunk[i]) continue;
+		for (int j=0; j<PC_PROF_CHUNK/2; j++) {
+			if (!m_chunk[i][j]) continue;
+			uint32_t addr=m_base+i*PC_PROF_CHUNK+j*2;
+			const pc_prof_sym_t *s=find_sym(addr);
+			if (!cur_valid || s!=cur) {
+				if (s) {
+					int fi=0;
+					while (m_files[fi]!=s->file) fi++;
+					fprintf(f, "ob=(%d) %s\n", fi+1, s->file);
+					fprintf(f, "fn=(%d) %s\n", (int)(s-m_sym)+1, s->name);
+				} else {
+					fprintf(f, "ob=(%d) [unknown]\nfn=(%d) [unknown]\n", m_file_count+1, m_sym_count+1);
+				}
+				cur=s;
+				cur_valid=true;
+			}
+			fprintf(f, "0x%X %llu\n", addr, (unsigned long long)m_chunk[i][j]);
+		}
+	}
+	fclose(f);
+	return 0;
+}
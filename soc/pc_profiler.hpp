@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+//PC samples are kept per 2 bytes (compressed instructions) in chunks of this many bytes of
+//address space, which are allocated when first hit.
+#define PC_PROF_CHUNK 4096
+
+typedef struct {
+	uint32_t addr;
+	uint32_t size;
+	const char *name;
+	const char *file;
+} pc_prof_sym_t;
+
+//Histograms the program counter of the CPU and writes the result as a flat profile
+//and as a callgrind file, for use with e.g. kcachegraph. There is no call graph: the
+//callgrind file has the cost per instruction only.
+class Pc_profiler {
+	public:
+	//Samples are taken for PCs between base and base+size.
+	Pc_profiler(uint32_t base, uint32_t size);
+	~Pc_profiler();
+	//Adds the function symbols of an ELF file. Returns 1 on error.
+	int add_elf(const char *file);
+	void sample(uint32_t pc) {
+		uint32_t off=pc-m_base;
+		if (off>=m_size) {
+			m_other++;
+			return;
+		}
+		uint64_t *c=m_chunk[off/PC_PROF_CHUNK];
+		if (!c) c=new_chunk(off/PC_PROF_CHUNK);
+		c[(off%PC_PROF_CHUNK)/2]++;
+	}
+	int write_flat(const char *file);
+	int write_callgrind(const char *file);
+
+	private:
+	uint64_t *new_chunk(int i);
+	const pc_prof_sym_t *find_sym(uint32_t addr);
+
+	uint32_t m_base;
+	uint32_t m_size;
+	uint64_t **m_chunk;
+	uint64_t m_other; //samples outside of base..base+size
+	pc_prof_sym_t *m_sym;
+	int m_sym_count;
+	char **m_files;
+	int m_file_count;
+};
@@ -16,18 +16,27 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <cstdlib>
+#include <string.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <elf.h>
 #include "psram_emu.hpp"
+#include "sim_checkpoint.hpp"
 
 Psram_emu::Psram_emu(int memsize) {
 	m_size=memsize;
 	m_mem=new uint8_t[memsize];
-	m_roflag=new uint8_t[memsize]();
-	for (int i=0; i<m_size; i++) m_mem[i]=rand();
+	m_roflag_size=(memsize/PSRAM_RO_PAGE+7)/8;
+	m_roflag=new uint8_t[m_roflag_size]();
+	//Fill with garbage, like real PSRAM after powerup.
+	for (int i=0; i<m_size; i+=sizeof(int)) {
+		int r=rand();
+		memcpy(&m_mem[i], &r, (m_size-i<(int)sizeof(int))?m_size-i:sizeof(int));
+	}
 	m_qpi_mode=0;
+	m_oldncs=-1;
 }
 
 const uint8_t *Psram_emu::get_mem() {
@@ -38,6 +47,15 @@ void Psram_emu::force_qpi() {
 	m_qpi_mode=1;
 }
 
+//Marks chip addresses start up to end as read-only. As this works on whole pages, partial
+//pages at the edges stay writable.
+void Psram_emu::mark_ro(uint32_t start, uint32_t end) {
+	if (end>(uint32_t)m_size) end=m_size;
+	for (uint32_t p=(start+PSRAM_RO_PAGE-1)/PSRAM_RO_PAGE; p<end/PSRAM_RO_PAGE; p++) {
+		m_roflag[p/8]|=(1<<(p&7));
+	}
+}
+
 int Psram_emu::load_file(const char *file, int offset, bool is_ro) {
 	FILE *f=fopen(file, "rb");
 	if (f==NULL) {
@@ -46,9 +64,7 @@ int Psram_emu::load_file(const char *file, int offset, bool is_ro) {
 	}
 	int size=fread(&m_mem[offset], 1, m_size-offset, f);
 	fclose(f);
-	if (is_ro) {
-		for (int i=offset; i<offset+size; i++) m_roflag[i]=1;
-	}
+	if (is_ro) mark_ro(offset, offset+size);
 	printf("Loaded file %s to 0x%X - 0x%X\n", file, offset, offset+size);
 	return 0;
 }
@@ -72,17 +88,142 @@ int Psram_emu::load_file_interleaved(const char *file, int offset, bool is_ro, b
 			m_mem[(offset+i)/2]= buf[i];
 		}
 	}
+	if (is_ro) mark_ro(offset/2, (offset+fsize)/2);
+	free(buf);
+	printf("Loaded file %s to 0x%X - 0x%X\n", file, offset, offset+(fsize/2));
+	return 0;
+}
+
+
+void Psram_emu::write_interleaved(uint32_t offset, const uint8_t *buf, int len, bool msb) {
+	for (int i=(msb?1:0); i<len; i+=2) m_mem[(offset+i)/2]=buf[i];
+}
+
+//Only 32-bit little-endian ELF files, as generated by the RISC-V toolchain, are supported.
+int Psram_emu::load_elf_interleaved(const char *file, uint32_t base, bool is_ro, bool msb,
+		uint32_t *entry, uint32_t *end) {
+	FILE *f=fopen(file, "rb");
+	if (f==NULL) {
+		perror(file);
+		exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	long fsize=ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t *buf=(uint8_t*)malloc(fsize);
+	fread(buf, 1, fsize, f);
+	fclose(f);
+
+	Elf32_Ehdr *eh=(Elf32_Ehdr*)buf;
+	if (fsize<(long)sizeof(Elf32_Ehdr) || memcmp(eh->e_ident, ELFMAG, SELFMAG)!=0 ||
+			eh->e_ident[EI_CLASS]!=ELFCLASS32 || eh->e_ident[EI_DATA]!=ELFDATA2LSB) {
+		printf("%s: not a 32-bit little-endian ELF file\n", file);
+		exit(1);
+	}
+	if (eh->e_phoff+eh->e_phnum*sizeof(Elf32_Phdr)>(unsigned long)fsize ||
+			eh->e_shoff+eh->e_shnum*sizeof(Elf32_Shdr)>(unsigned long)fsize) {
+		printf("%s: truncated ELF file\n", file);
+		exit(1);
+	}
+
+	if (entry) *entry=eh->e_entry;
+	if (end) *end=0;
+	Elf32_Phdr *ph=(Elf32_Phdr*)&buf[eh->e_phoff];
+	for (int i=0; i<eh->e_phnum; i++) {
+		if (ph[i].p_type!=PT_LOAD || ph[i].p_memsz==0) continue;
+		uint32_t start=ph[i].p_paddr-base;
+		if (ph[i].p_paddr<base || start+ph[i].p_memsz>(uint32_t)m_size*2 ||
+				ph[i].p_offset+ph[i].p_filesz>(unsigned long)fsize) {
+			printf("%s: segment at 0x%X does not fit in psram\n", file, ph[i].p_paddr);
+			exit(1);
+		}
+		//Anything in memsz but not in filesz (.bss) is zeroed.
+		for (uint32_t j=(msb?1:0); j<ph[i].p_memsz; j+=2) {
+			uint8_t b=0;
+			if (j<ph[i].p_filesz) b=buf[ph[i].p_offset+j];
+			m_mem[(start+j)/2]=b;
+		}
+		printf("Loaded %s segment to 0x%X - 0x%X\n", file, start, start+ph[i].p_memsz);
+		if (end && ph[i].p_paddr+ph[i].p_memsz>*end) *end=ph[i].p_paddr+ph[i].p_memsz;
+	}
+
 	if (is_ro) {
-		for (int i=offset/2; i<(offset+fsize)/2; i++) m_roflag[i]=1;
+		Elf32_Shdr *sh=(Elf32_Shdr*)&buf[eh->e_shoff];
+		for (int i=0; i<eh->e_shnum; i++) {
+			if (sh[i].sh_type==SHT_NOBITS || sh[i].sh_size==0) continue;
+			if ((sh[i].sh_flags&SHF_ALLOC)==0 || (sh[i].sh_flags&SHF_WRITE)) continue;
+			if (sh[i].sh_addr<base) continue;
+			uint32_t start=sh[i].sh_addr-base;
+			mark_ro((start+1)/2, (start+sh[i].sh_size)/2);
+		}
 	}
 	free(buf);
-	printf("Loaded file %s to 0x%X - 0x%X\n", file, offset, offset+(fsize/2));
 	return 0;
 }
 
+int Psram_emu::save(FILE *f) {
+	CP_SAVE(f, m_size);
+	CP_SAVE_BUF(f, m_mem, m_size);
+	CP_SAVE_BUF(f, m_roflag, m_roflag_size);
+	CP_SAVE(f, m_nib);
+	CP_SAVE(f, m_cmd);
+	CP_SAVE(f, m_addr);
+	CP_SAVE(f, m_qpi_mode);
+	CP_SAVE(f, m_sout_next);
+	CP_SAVE(f, m_sout_cur);
+	CP_SAVE(f, m_oldclk);
+	CP_SAVE(f, m_writebyte);
+	return CP_RESULT(f);
+}
+
+int Psram_emu::restore(FILE *f) {
+	int size;
+	CP_RESTORE(f, size);
+	if (size!=m_size) {
+		printf("psram: checkpoint is for a %d byte device, this one has %d bytes\n", size, m_size);
+		return 1;
+	}
+	CP_RESTORE_BUF(f, m_mem, m_size);
+	CP_RESTORE_BUF(f, m_roflag, m_roflag_size);
+	CP_RESTORE(f, m_nib);
+	CP_RESTORE(f, m_cmd);
+	CP_RESTORE(f, m_addr);
+	CP_RESTORE(f, m_qpi_mode);
+	CP_RESTORE(f, m_sout_next);
+	CP_RESTORE(f, m_sout_cur);
+	CP_RESTORE(f, m_oldclk);
+	CP_RESTORE(f, m_writebyte);
+	m_oldncs=-1;
+	return CP_RESULT(f);
+}
+
+//Bulk access for the transaction-level model. Same error semantics as eval(): returns 1
+//if the sim should be aborted.
+int Psram_emu::read_burst(uint32_t addr, uint8_t *buf, int len) {
+	if (addr+len>m_size) {
+		printf("ERROR! Read past size of device at addr 0x%X!\n", addr+len);
+		return 1;
+	}
+	memcpy(buf, &m_mem[addr], len);
+	return 0;
+}
 
+int Psram_emu::write_burst(uint32_t addr, const uint8_t *buf, int len) {
+	if (addr+len>m_size) {
+		printf("ERROR! Write past size of device at addr 0x%X!\n", addr+len);
+		return 1;
+	}
+	for (int i=0; i<len; i++) {
+		if (m_mem[addr+i]!=buf[i] && is_ro(addr+i)) {
+			printf("ERROR! Overwriting ro-marked data at addr 0x%X (which is 0x%02X) with 0x%02X!\n", addr+i, m_mem[addr+i], buf[i]);
+			return 1;
+		}
+	}
+	memcpy(&m_mem[addr], buf, len);
+	return 0;
+}
 
-int Psram_emu::eval(int clk, int ncs, int sin, int oe, int *sout) {
+int Psram_emu::eval_edge(int clk, int ncs, int sin, int oe, int *sout) {
 	if (ncs==1) {
 		m_nib=0;
 		m_cmd=0;
@@ -128,14 +269,14 @@ int Psram_emu::eval(int clk, int ncs, int sin, int oe, int *sout) {
 					m_writebyte=(sin<<4);
 				} else {
 					m_writebyte|=sin;
-					if (m_mem[m_addr]!=m_writebyte && m_roflag[m_addr]) {
-						printf("ERROR! Overwriting ro-marked data at addr 0x%X (which is 0x%02X) with 0x%02X!\n", m_addr, m_mem[m_addr], m_writebyte);
-						return 1;
-					}
 					if (m_addr>=m_size) {
 						printf("ERROR! Write past size of device at addr 0x%X!\n", m_addr);
 						return 1;
 					}
+					if (m_mem[m_addr]!=m_writebyte && is_ro(m_addr)) {
+						printf("ERROR! Overwriting ro-marked data at addr 0x%X (which is 0x%02X) with 0x%02X!\n", m_addr, m_mem[m_addr], m_writebyte);
+						return 1;
+					}
 					m_mem[m_addr]=m_writebyte;
 					m_addr++;
 				}
@@ -160,6 +301,7 @@ int Psram_emu::eval(int clk, int ncs, int sin, int oe, int *sout) {
 		m_sout_cur=m_sout_next;
 	}
 	m_oldclk=clk;
+	m_oldncs=ncs;
 	*sout=ncs?0:m_sout_cur;
 	return 0;
 }
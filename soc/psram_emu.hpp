@@ -1,19 +1,54 @@
+#pragma once
+
 #include <stdint.h>
+#include <stdio.h>
 
 using namespace std;
+
+//Granularity of read-only marking, in bytes of chip memory. Only pages that are completely
+//covered by a read-only region get marked.
+#define PSRAM_RO_PAGE 64
+
 class Psram_emu {
 	public:
 	Psram_emu(int memsize);
 	int load_file(const char *file, int offset, bool is_ro);
 	int load_file_interleaved(const char *file, int offset, bool is_ro, bool msb);
-	int eval(int clk, int ncs, int sin, int oe, int *sout);
+	//Loads the PT_LOAD segments of an ELF file; SoC address 'base' ends up at chip address 0.
+	//If is_ro is set, allocated sections that are not writable (e.g. .text) are marked read-only.
+	//If entry/end are given, they're set to the entry point and the first address past the
+	//highest segment.
+	int load_elf_interleaved(const char *file, uint32_t base, bool is_ro, bool msb,
+			uint32_t *entry=NULL, uint32_t *end=NULL);
+	//Writes len bytes, starting at SoC offset 'offset', into this chip's half of an interleaved pair.
+	void write_interleaved(uint32_t offset, const uint8_t *buf, int len, bool msb);
+	//Called for every sub-step of the sim, but only clk and ncs changes do anything; skip the
+	//full model when neither changed.
+	int eval(int clk, int ncs, int sin, int oe, int *sout) {
+		if (clk==m_oldclk && ncs==m_oldncs) {
+			*sout=ncs?0:m_sout_cur;
+			return 0;
+		}
+		return eval_edge(clk, ncs, sin, oe, sout);
+	}
+	int save(FILE *f);
+	int restore(FILE *f);
+	int read_burst(uint32_t addr, uint8_t *buf, int len);
+	int write_burst(uint32_t addr, const uint8_t *buf, int len);
 	const uint8_t *get_mem();
 	void force_qpi();
 
 	private:
+	int eval_edge(int clk, int ncs, int sin, int oe, int *sout);
+	void mark_ro(uint32_t start, uint32_t end);
+	bool is_ro(uint32_t addr) {
+		return m_roflag[addr/PSRAM_RO_PAGE/8] & (1<<((addr/PSRAM_RO_PAGE)&7));
+	}
+
 	int m_size;
 	uint8_t *m_mem;
-	uint8_t *m_roflag;
+	uint8_t *m_roflag; //one bit per PSRAM_RO_PAGE bytes
+	int m_roflag_size;
 
 	int m_nib;
 	uint8_t m_cmd;
@@ -21,6 +56,7 @@ class Psram_emu {
 	bool m_qpi_mode;
 	int m_sout_next, m_sout_cur;
 	bool m_oldclk;
+	int m_oldncs; //-1 if eval() needs to run the full model next time
 	uint8_t m_writebyte;
 };
 
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2019 Jeroen Domburg <jeroen@spritesmods.com>
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include "psram_xact_emu.hpp"
+#include "sim_checkpoint.hpp"
+
+//This replaces qpimem_iface_2x2w, both PHYs and both Psram_emu::eval state machines by a
+//model that works on the qpi_* transaction interface. It is not bit-accurate wrt the QPI
+//bus; use the normal Psram_emu::eval path if you need to debug the PHY.
+
+//Cycles between a request and the first data word. The real iface needs a few more for
+//the command, address and dummy bytes, but the masters do not depend on that.
+#define XACT_SETUP_CYCLES 4
+//Cycles per word. Each chip clocks in or out a byte per clk48m cycle, so a 32-bit word
+//takes two cycles. Note that the qpimem_cache writeback needs this to be at least 2, as
+//its write data comes out of a registered blockram.
+#define XACT_WORD_CYCLES 2
+
+#define XACT_IDLE 0
+#define XACT_READ 1
+#define XACT_WRITE 2
+
+Psram_xact_emu::Psram_xact_emu(Psram_emu *chip_lo, Psram_emu *chip_hi) {
+	m_chip_lo=chip_lo;
+	m_chip_hi=chip_hi;
+	m_state=XACT_IDLE;
+	m_delay=0;
+	m_addr=0;
+	m_line_pos=0;
+}
+
+int Psram_xact_emu::save(FILE *f) {
+	CP_SAVE(f, m_state);
+	CP_SAVE(f, m_delay);
+	CP_SAVE(f, m_addr);
+	CP_SAVE(f, m_line);
+	CP_SAVE(f, m_line_pos);
+	return CP_RESULT(f);
+}
+
+int Psram_xact_emu::restore(FILE *f) {
+	CP_RESTORE(f, m_state);
+	CP_RESTORE(f, m_delay);
+	CP_RESTORE(f, m_addr);
+	CP_RESTORE(f, m_line);
+	CP_RESTORE(f, m_line_pos);
+	return CP_RESULT(f);
+}
+
+//Each chip holds 16 bits of a word: the low chip has byte 0 and 2, the high chip byte 1 and 3.
+//This is the same interleave as Psram_emu::load_file_interleaved uses.
+int Psram_xact_emu::fetch_line() {
+	uint8_t lo[PSRAM_XACT_LINE_WORDS*2], hi[PSRAM_XACT_LINE_WORDS*2];
+	if (m_chip_lo->read_burst(m_addr, lo, sizeof(lo))) return 1;
+	if (m_chip_hi->read_burst(m_addr, hi, sizeof(hi))) return 1;
+	for (int i=0; i<PSRAM_XACT_LINE_WORDS; i++) {
+		m_line[i]=lo[i*2] | (hi[i*2]<<8) | (lo[i*2+1]<<16) | (hi[i*2+1]<<24);
+	}
+	return 0;
+}
+
+int Psram_xact_emu::commit_line() {
+	uint8_t lo[PSRAM_XACT_LINE_WORDS*2], hi[PSRAM_XACT_LINE_WORDS*2];
+	for (int i=0; i<m_line_pos; i++) {
+		lo[i*2]=m_line[i];
+		hi[i*2]=m_line[i]>>8;
+		lo[i*2+1]=m_line[i]>>16;
+		hi[i*2+1]=m_line[i]>>24;
+	}
+	if (m_chip_lo->write_burst(m_addr, lo, m_line_pos*2)) return 1;
+	if (m_chip_hi->write_burst(m_addr, hi, m_line_pos*2)) return 1;
+	return 0;
+}
+
+int Psram_xact_emu::eval(int do_read, int do_write, uint32_t addr, uint32_t wdata, uint32_t *rdata, int *next_word, int *is_idle) {
+	int ret=0;
+	*next_word=0;
+	if (m_state==XACT_IDLE) {
+		if (do_read || do_write) {
+			m_addr=addr;
+			m_line_pos=0;
+			m_delay=XACT_SETUP_CYCLES;
+			if (do_read) {
+				m_state=XACT_READ;
+				ret=fetch_line();
+			} else {
+				m_state=XACT_WRITE;
+			}
+		}
+	} else if (m_delay) {
+		m_delay--;
+	} else if (m_state==XACT_READ) {
+		if (!do_read) {
+			m_state=XACT_IDLE;
+		} else {
+			if (m_line_pos==PSRAM_XACT_LINE_WORDS) {
+				m_addr+=PSRAM_XACT_LINE_WORDS*2;
+				m_line_pos=0;
+				ret=fetch_line();
+			}
+			*rdata=m_line[m_line_pos++];
+			*next_word=1;
+			m_delay=XACT_WORD_CYCLES-1;
+		}
+	} else {
+		if (m_line_pos==PSRAM_XACT_LINE_WORDS) {
+			ret=commit_line();
+			m_addr+=PSRAM_XACT_LINE_WORDS*2;
+			m_line_pos=0;
+		}
+		//Like the real iface, we take one more word after the master releases do_write:
+		//the master presents the next word as soon as it sees next_word.
+		m_line[m_line_pos++]=wdata;
+		*next_word=1;
+		if (!do_write) {
+			ret|=commit_line();
+			m_state=XACT_IDLE;
+		} else {
+			m_delay=XACT_WORD_CYCLES-1;
+		}
+	}
+	*is_idle=(m_state==XACT_IDLE)?1:0;
+	return ret;
+}
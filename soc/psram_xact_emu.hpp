@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include "psram_emu.hpp"
+
+using namespace std;
+
+//Words fetched from / committed to the Psram_emu memories in one go. Equals a qpimem_cache line.
+#define PSRAM_XACT_LINE_WORDS 16
+
+//Transaction-level stand-in for qpimem_iface_2x2w plus the two PSRAM chips. Instead of
+//decoding every QPI nibble, this services the qpi_* request/response signals of the iface
+//directly out of the memory of the two Psram_emu instances.
+class Psram_xact_emu {
+	public:
+	Psram_xact_emu(Psram_emu *chip_lo, Psram_emu *chip_hi);
+	//Call once per clk48m cycle, after the rising edge has been evaluated.
+	int eval(int do_read, int do_write, uint32_t addr, uint32_t wdata, uint32_t *rdata, int *next_word, int *is_idle);
+	//Only saves the transaction state; the chips need to be saved separately.
+	int save(FILE *f);
+	int restore(FILE *f);
+
+	private:
+	int fetch_line();
+	int commit_line();
+
+	Psram_emu *m_chip_lo; //bytes 0 and 2 of each word
+	Psram_emu *m_chip_hi; //bytes 1 and 3 of each word
+
+	int m_state;
+	int m_delay;
+	uint32_t m_addr; //chip address of m_line[0]; each word is 2 bytes per chip
+	uint32_t m_line[PSRAM_XACT_LINE_WORDS];
+	int m_line_pos;
+};
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2019 Jeroen Domburg <jeroen@spritesmods.com>
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "qpimem_stats.hpp"
+
+//The boot ROM and IPL live in the first megabyte of PSRAM, see ipl/gloss/ldscript.ld
+#define QS_IPL_END 0x100000
+//Bus clock
+#define QS_CLK_HZ 48000000.0
+//Read-only throughput bypassing the cache, see notes.txt. Nothing will go faster than this.
+#define QS_MAX_MBPS 20.4
+
+static const char *region_name[QS_REGION_CT]={"ipl", "app", "fb", "vid"};
+
+Qpimem_stats::Qpimem_stats(FILE *out) {
+	m_out=out;
+	m_cycle=0;
+	m_frame_start=0;
+	m_frame=0;
+	for (int i=0; i<2; i++) m_in_burst[i]=false;
+	m_vid_min=0xffffffff;
+	m_vid_max=0;
+	m_fb_min=0xffffffff;
+	m_fb_max=0;
+	memset(m_total, 0, sizeof(m_total));
+	memset(m_cur, 0, sizeof(m_cur));
+	fprintf(m_out, "# frame cycles");
+	for (int i=0; i<QS_REGION_CT; i++) {
+		fprintf(m_out, " %s_acc %s_miss %s_wb %s_rd %s_wr", region_name[i], region_name[i],
+				region_name[i], region_name[i], region_name[i]);
+	}
+	fprintf(m_out, " mbps pct_of_max\n");
+}
+
+int Qpimem_stats::region(uint32_t addr) {
+	if (addr>=m_fb_min && addr<m_fb_max) return QS_FB;
+	if (addr<QS_IPL_END) return QS_IPL;
+	return QS_APP;
+}
+
+void Qpimem_stats::eval(int do_read, int do_write, int next_word, int is_idle,
+			uint32_t cache_addr, uint32_t vid_addr, int cpu_access, uint32_t cpu_addr) {
+	m_cycle++;
+	if (cpu_access) {
+		m_cur[region(cpu_addr)].accesses++;
+	}
+	for (int m=0; m<2; m++) {
+		int rd=(do_read>>m)&1;
+		int wr=(do_write>>m)&1;
+		if (!m_in_burst[m]) {
+			if (!rd && !wr) continue;
+			//Burst starts
+			uint32_t addr=m?vid_addr:cache_addr;
+			m_in_burst[m]=true;
+			m_burst_words[m]=0;
+			m_burst_write[m]=wr;
+			m_burst_addr[m]=addr;
+			if (m) {
+				m_burst_region[m]=QS_VID;
+				if (addr<m_vid_min) m_vid_min=addr;
+				if (addr>m_vid_max) m_vid_max=addr;
+			} else {
+				m_burst_region[m]=region(addr);
+				if (wr) {
+					m_cur[m_burst_region[m]].writebacks++;
+				} else {
+					m_cur[m_burst_region[m]].misses++;
+				}
+			}
+		}
+		//The iface takes one more word after do_write goes low, so the burst only ends
+		//when the master sees the iface idle again.
+		if ((next_word>>m)&1) m_burst_words[m]++;
+		if (!rd && !wr && ((is_idle>>m)&1)) {
+			qpimem_region_stats_t *st=&m_cur[m_burst_region[m]];
+			int w=m_burst_words[m];
+			if (m_burst_write[m]) st->wr_bytes+=w*4; else st->rd_bytes+=w*4;
+			st->burst_len[w>QS_MAX_BURST?QS_MAX_BURST:w]++;
+			if (m) {
+				uint32_t end=m_burst_addr[m]+w*4;
+				if (end>m_vid_max) m_vid_max=end;
+			}
+			m_in_burst[m]=false;
+		}
+	}
+}
+
+void Qpimem_stats::end_frame() {
+	uint64_t cycles=m_cycle-m_frame_start;
+	uint64_t bytes=0;
+	fprintf(m_out, "%d %llu", m_frame, (unsigned long long)cycles);
+	for (int i=0; i<QS_REGION_CT; i++) {
+		qpimem_region_stats_t *c=&m_cur[i];
+		fprintf(m_out, " %llu %llu %llu %llu %llu", (unsigned long long)c->accesses,
+				(unsigned long long)c->misses, (unsigned long long)c->writebacks,
+				(unsigned long long)c->rd_bytes, (unsigned long long)c->wr_bytes);
+		bytes+=c->rd_bytes+c->wr_bytes;
+		qpimem_region_stats_t *t=&m_total[i];
+		t->accesses+=c->accesses;
+		t->misses+=c->misses;
+		t->writebacks+=c->writebacks;
+		t->rd_bytes+=c->rd_bytes;
+		t->wr_bytes+=c->wr_bytes;
+		for (int j=0; j<=QS_MAX_BURST; j++) t->burst_len[j]+=c->burst_len[j];
+	}
+	double mbps=cycles?(bytes/(cycles/QS_CLK_HZ))/1000000.0:0;
+	fprintf(m_out, " %.2f %.1f\n", mbps, (mbps*100.0)/QS_MAX_MBPS);
+	memset(m_cur, 0, sizeof(m_cur));
+	m_frame_start=m_cycle;
+	m_frame++;
+	//Whatever the video DMA read this frame is the framebuffer for the next one.
+	if (m_vid_min<m_vid_max) {
+		m_fb_min=m_vid_min;
+		m_fb_max=m_vid_max;
+	}
+	m_vid_min=0xffffffff;
+	m_vid_max=0;
+}
+
+//Prints the summary lines of one region; cycles is the time the stats were collected over.
+void Qpimem_stats::print_stats(const char *name, qpimem_region_stats_t *st, uint64_t cycles) {
+	uint64_t hits=(st->accesses>st->misses)?st->accesses-st->misses:0;
+	double mbps=cycles?((st->rd_bytes+st->wr_bytes)/(cycles/QS_CLK_HZ))/1000000.0:0;
+	fprintf(m_out, "# %-3s accesses %llu hits %llu misses %llu hit_pct %.2f writebacks %llu rd_bytes %llu wr_bytes %llu mbps %.2f\n",
+			name, (unsigned long long)st->accesses, (unsigned long long)hits,
+			(unsigned long long)st->misses, st->accesses?(hits*100.0)/st->accesses:0.0,
+			(unsigned long long)st->writebacks, (unsigned long long)st->rd_bytes,
+			(unsigned long long)st->wr_bytes, mbps);
+	fprintf(m_out, "# %-3s burst_len", name);
+	for (int j=0; j<=QS_MAX_BURST; j++) {
+		if (st->burst_len[j]) fprintf(m_out, " %d%s:%llu", j, j==QS_MAX_BURST?"+":"", (unsigned long long)st->burst_len[j]);
+	}
+	fprintf(m_out, "\n");
+}
+
+void Qpimem_stats::report() {
+	//Account whatever happened since the last full frame as well.
+	if (m_cycle!=m_frame_start) end_frame();
+	fprintf(m_out, "# summary: %llu cycles, %d frames\n", (unsigned long long)m_cycle, m_frame);
+	uint64_t bytes=0;
+	for (int i=0; i<QS_REGION_CT; i++) {
+		print_stats(region_name[i], &m_total[i], m_cycle);
+		bytes+=m_total[i].rd_bytes+m_total[i].wr_bytes;
+	}
+	double mbps=m_cycle?(bytes/(m_cycle/QS_CLK_HZ))/1000000.0:0;
+	fprintf(m_out, "# average %.2f MB/s, %.1f%% of %.1f MB/s\n", mbps, (mbps*100.0)/QS_MAX_MBPS, QS_MAX_MBPS);
+}
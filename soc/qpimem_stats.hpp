@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+//Address regions traffic is accounted to. Addresses are PSRAM offsets.
+enum qpimem_region_t {
+	QS_IPL,		//boot ROM plus IPL: the first megabyte
+	QS_APP,		//everything else the CPU touches...
+	QS_FB,		//...except what the video DMA read during the last frame
+	QS_VID,		//traffic of the video DMA itself
+	QS_REGION_CT
+};
+
+//Longest burst that gets its own histogram bucket; longer ones go in the last one.
+#define QS_MAX_BURST 32
+
+typedef struct {
+	uint64_t accesses;	//CPU accesses through the cache
+	uint64_t misses;	//cache line reads
+	uint64_t writebacks;	//dirty cache line writes
+	uint64_t rd_bytes;
+	uint64_t wr_bytes;
+	uint64_t burst_len[QS_MAX_BURST+1]; //in words
+} qpimem_region_stats_t;
+
+//Counts what goes over the QPI bus between the qpimem_arbiter masters and the PSRAM, using
+//the qpimon_* outputs of the SoC. Writes a line per video frame plus a summary at the end.
+class Qpimem_stats {
+	public:
+	Qpimem_stats(FILE *out);
+	//Call once per clk48m cycle, after the rising edge has been evaluated. Masters are
+	//bits in the do_read...is_idle args: 0 is the cache, 1 the video DMA.
+	void eval(int do_read, int do_write, int next_word, int is_idle,
+			uint32_t cache_addr, uint32_t vid_addr, int cpu_access, uint32_t cpu_addr);
+	void end_frame();
+	void report();
+
+	private:
+	int region(uint32_t addr);
+	void print_stats(const char *name, qpimem_region_stats_t *st, uint64_t cycles);
+
+	FILE *m_out;
+	uint64_t m_cycle;
+	uint64_t m_frame_start;
+	int m_frame;
+	//Per-master burst tracking
+	bool m_in_burst[2];
+	int m_burst_words[2];
+	int m_burst_region[2];
+	uint32_t m_burst_addr[2];
+	bool m_burst_write[2];
+	//Video DMA address range in this and the previous frame
+	uint32_t m_vid_min, m_vid_max;
+	uint32_t m_fb_min, m_fb_max;
+
+	qpimem_region_stats_t m_total[QS_REGION_CT];
+	qpimem_region_stats_t m_cur[QS_REGION_CT];
+};
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdio.h>
+
+//Helpers for the save()/restore() methods of the C++ simulation models. Checkpoints are
+//only ever read back by the same binary, so everything is written in host format.
+#define CP_SAVE(f, v) fwrite(&(v), sizeof(v), 1, (f))
+#define CP_SAVE_BUF(f, p, len) fwrite((p), 1, (len), (f))
+#define CP_RESTORE(f, v) fread(&(v), sizeof(v), 1, (f))
+#define CP_RESTORE_BUF(f, p, len) fread((p), 1, (len), (f))
+
+//Save/restore methods return this; nonzero means the file is unusable.
+#define CP_RESULT(f) ((ferror(f) || feof(f))?1:0)
@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+#
+# Runs a set of simulations of the SoC in parallel and reports which ones pass.
+#
+# The manifest has one test per line:
+#   name  app.elf|-  max_cycles  [uart="expected output"]  [hash=frame hash]
+# An app of '-' runs the IPL only. The uart string has to show up in the UART output
+# (max 63 chars), the hash is the one printed by the sim as 'Frame hash: ...' for the
+# video frame that should show up. Empty lines and lines starting with # are ignored.
+#
+# A hash of '?' means it hasn't been recorded yet: the test runs for max_cycles and fails
+# with NOREF. --update-hashes then writes the hash of the last frame into the manifest, so
+# pick max_cycles such that the screen has settled by then.
+#
+# Exit code is 0 if all tests passed, 1 otherwise.
+
+import argparse
+import os
+import re
+import shlex
+import subprocess
+import sys
+import time
+from concurrent.futures import ThreadPoolExecutor
+
+
+def parse_manifest(filename):
+	tests = []
+	with open(filename) as f:
+		for lineno, line in enumerate(f, 1):
+			line = line.strip()
+			if line == "" or line.startswith("#"):
+				continue
+			words = shlex.split(line)
+			if len(words) < 3:
+				sys.exit("%s:%d: need at least name, app and max cycles" % (filename, lineno))
+			test = {"name": words[0], "app": words[1], "cycles": int(words[2], 0),
+					"uart": None, "hash": None}
+			for w in words[3:]:
+				key, sep, val = w.partition("=")
+				if not sep or key not in ("uart", "hash"):
+					sys.exit("%s:%d: unknown field '%s'" % (filename, lineno, w))
+				test[key] = val
+			if test["uart"] is None and test["hash"] is None:
+				sys.exit("%s:%d: test needs a uart or hash expectation" % (filename, lineno))
+			tests.append(test)
+	return tests
+
+
+def run_test(test, args):
+	outdir = os.path.join(args.outdir, test["name"])
+	os.makedirs(outdir, exist_ok=True)
+	cmd = [args.sim] + shlex.split(args.sim_args) + ["-o", outdir, "-c", str(test["cycles"])]
+	if test["app"] != "-":
+		cmd += ["-a", test["app"]]
+	record = (test["hash"] == "?")
+	if test["uart"] is not None and not record:
+		cmd += ["-u", test["uart"]]
+	if test["hash"] is not None and not record:
+		cmd += ["-H", test["hash"]]
+	start = time.time()
+	with open(os.path.join(outdir, "sim.log"), "w") as log:
+		r = subprocess.run(cmd, stdin=subprocess.DEVNULL, stdout=subprocess.PIPE,
+				stderr=subprocess.STDOUT, universal_newlines=True, errors="replace")
+		log.write(r.stdout)
+	secs = time.time() - start
+	m = re.search(r"^Result: (\w+).* after (\d+) cycles", r.stdout, re.M)
+	if m:
+		result, cycles = m.group(1), int(m.group(2))
+	elif record and r.returncode == 0:
+		result, cycles = "NOREF", test["cycles"]
+	else:
+		result, cycles = "CRASH", 0
+	m = re.search(r"^Frame hash: (\w+)", r.stdout, re.M)
+	framehash = m.group(1) if m else "-"
+	return (test["name"], result, r.returncode, cycles, secs, framehash)
+
+
+def update_hashes(filename, hashes):
+	with open(filename) as f:
+		lines = f.readlines()
+	with open(filename, "w") as f:
+		for line in lines:
+			words = line.split()
+			if words and not line.startswith("#") and words[0] in hashes:
+				line = line.replace("hash=?", "hash=" + hashes[words[0]])
+			f.write(line)
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Run SoC simulation regression tests")
+	parser.add_argument("manifest", help="test manifest")
+	parser.add_argument("-j", "--jobs", type=int, default=os.cpu_count(),
+			help="amount of simulations to run in parallel")
+	parser.add_argument("--sim", default="./verilator-build-headless/Vsoc",
+			help="simulator binary")
+	parser.add_argument("--sim-args", default="-p xact",
+			help="extra arguments to pass to the simulator")
+	parser.add_argument("-o", "--outdir", default="regress-out",
+			help="directory for the per-test logs and output files")
+	parser.add_argument("--update-hashes", action="store_true",
+			help="write the frame hashes of tests with hash=? into the manifest")
+	args = parser.parse_args()
+
+	tests = parse_manifest(args.manifest)
+	failed = 0
+	recorded = {}
+	print("%-24s %-8s %12s %9s  %s" % ("test", "result", "cycles", "time", "frame hash"))
+	with ThreadPoolExecutor(max_workers=args.jobs) as ex:
+		for name, result, code, cycles, secs, framehash in ex.map(lambda t: run_test(t, args), tests):
+			if result != "PASS" or code != 0:
+				failed += 1
+			if result == "NOREF" and framehash != "-":
+				recorded[name] = framehash
+			print("%-24s %-8s %12d %8.1fs  %s" % (name, result, cycles, secs, framehash))
+			sys.stdout.flush()
+	print("%d of %d tests passed" % (len(tests) - failed, len(tests)))
+	if args.update_hashes and recorded:
+		update_hashes(args.manifest, recorded)
+		print("Recorded frame hashes for %s in %s" % (", ".join(sorted(recorded)), args.manifest))
+	sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+	main()
@@ -109,6 +109,30 @@ module soc(
 		output reg [7:0] pmod_oe,
 		
 		output reg trace_en
+`ifdef verilator
+		,
+		// Simulation-only transaction-level PSRAM hookup. If psram_xact_en is set, the
+		// qpimem_iface_2x2w is kept idle and the C++ side (Psram_xact_emu) services
+		// the QPI memory transactions directly.
+		input psram_xact_en,
+		output psram_xact_do_read,
+		output psram_xact_do_write,
+		output [23:0] psram_xact_addr,
+		output [31:0] psram_xact_wdata,
+		input [31:0] psram_xact_rdata,
+		input psram_xact_next_word,
+		input psram_xact_is_idle,
+		// Simulation-only monitor of the two QPI arbiter masters (bit 0: qpimem_cache,
+		// bit 1: video linerenderer) and of the CPU side of the cache, for traffic stats.
+		output [1:0] qpimon_do_read,
+		output [1:0] qpimon_do_write,
+		output [1:0] qpimon_next_word,
+		output [1:0] qpimon_is_idle,
+		output [23:0] qpimon_cache_addr,
+		output [23:0] qpimon_vid_addr,
+		output qpimon_cpu_access,
+		output [23:0] qpimon_cpu_addr
+`endif
 	);
 
 
@@ -745,6 +769,18 @@ module soc(
 		.s_next_word(qpi_next_word)
 	);
 
+`ifdef verilator
+	assign qpimon_do_read = qpimem_arb_do_read;
+	assign qpimon_do_write = qpimem_arb_do_write;
+	assign qpimon_next_word = qpimem_arb_next_word;
+	assign qpimon_is_idle = qpimem_arb_is_idle;
+	assign qpimon_cache_addr = qpimem_arb_addr[23:0];
+	assign qpimon_vid_addr = qpimem_arb_addr[32+23:32];
+	//A finished CPU read or write through the cache; writes above 16M are flushes.
+	assign qpimon_cpu_access = ram_ready && mem_addr[24]==0;
+	assign qpimon_cpu_addr = mem_addr[23:0];
+`endif
+
 	wire [4:0] mem_wen;
 	assign mem_wen = (mem_valid && !mem_ready && mem_select) ? mem_wstrb : 4'b0;
 
@@ -821,6 +857,43 @@ module soc(
 	wire [1:0] psram_sck_o;
 	wire psram_cs_o;
 
+	wire psram_iface_do_read;
+	wire psram_iface_do_write;
+	wire psram_iface_is_idle;
+	wire [31:0] psram_iface_rdata;
+	wire psram_iface_next_word;
+
+`ifdef verilator
+	//In transaction-level mode, the PHY never sees a transaction; the simulator answers instead.
+	assign psram_iface_do_read = qpi_do_read && !psram_xact_en;
+	assign psram_iface_do_write = qpi_do_write && !psram_xact_en;
+	assign psram_xact_do_read = qpi_do_read && psram_xact_en;
+	assign psram_xact_do_write = qpi_do_write && psram_xact_en;
+	assign psram_xact_addr = {1'b0, qpi_addr[23:2], 1'b0};
+	assign psram_xact_wdata = qpi_wdata;
+
+	always @(*) begin
+		if (psram_xact_en) begin
+			qpi_is_idle = psram_xact_is_idle;
+			qpi_rdata = psram_xact_rdata;
+			qpi_next_word = psram_xact_next_word;
+		end else begin
+			qpi_is_idle = psram_iface_is_idle;
+			qpi_rdata = psram_iface_rdata;
+			qpi_next_word = psram_iface_next_word;
+		end
+	end
+`else
+	assign psram_iface_do_read = qpi_do_read;
+	assign psram_iface_do_write = qpi_do_write;
+
+	always @(*) begin
+		qpi_is_idle = psram_iface_is_idle;
+		qpi_rdata = psram_iface_rdata;
+		qpi_next_word = psram_iface_next_word;
+	end
+`endif
+
 	// Controller
 	qpimem_iface_2x2w qpi_psram_I (
 		.spi_io_i(psram_io_i),
@@ -828,13 +901,13 @@ module soc(
 		.spi_io_t(psram_io_t),
 		.spi_sck_o(psram_sck_o),
 		.spi_cs_o(psram_cs_o),
-		.qpi_do_read(qpi_do_read),
-		.qpi_do_write(qpi_do_write),
+		.qpi_do_read(psram_iface_do_read),
+		.qpi_do_write(psram_iface_do_write),
 		.qpi_addr({1'b0, qpi_addr[23:2], 1'b0}),
-		.qpi_is_idle(qpi_is_idle),
+		.qpi_is_idle(psram_iface_is_idle),
 		.qpi_wdata(qpi_wdata),
-		.qpi_rdata(qpi_rdata),
-		.qpi_next_word(qpi_next_word),
+		.qpi_rdata(psram_iface_rdata),
+		.qpi_next_word(psram_iface_next_word),
 		.bus_addr(mem_addr[5:2]),
 		.bus_wdata(mem_wdata),
 		.bus_rdata(psram_rdata),
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2019 Jeroen Domburg <jeroen@spritesmods.com>
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include "trace_ctl.hpp"
+
+Trace_ctl::Trace_ctl(Vsoc *tb, const char *name, uint64_t window) {
+	m_window=window;
+	m_window_pos=0;
+	m_triggered=(window==0);
+	snprintf(m_file, sizeof(m_file), "%s.%s", name, TRACE_EXT);
+	snprintf(m_prefile, sizeof(m_prefile), "%s-pre.%s", name, TRACE_EXT);
+	//Verilator only allows hooking up a model to a trace file once, so rotating re-opens this
+	//same file object.
+	m_trace=new Trace_file;
+#if VERILATOR_USE_VCD
+	tb->trace(m_trace, 3);
+#else
+	tb->trace(m_trace, 99);
+#endif
+	m_trace->open(m_file);
+}
+
+Trace_ctl::~Trace_ctl() {
+	close();
+	delete m_trace;
+}
+
+void Trace_ctl::close() {
+	if (!m_trace->isOpen()) return;
+	m_trace->flush();
+	m_trace->close();
+}
+
+//Closes the current trace, moves it out of the way and starts a new one.
+void Trace_ctl::rotate() {
+	close();
+	if (rename(m_file, m_prefile)!=0) perror(m_prefile);
+	m_trace->open(m_file);
+}
+
+bool Trace_ctl::cycle(bool want_trace) {
+	if (m_triggered) return want_trace;
+	if (want_trace) {
+		printf("Trace: trigger hit, keeping pre-trigger window\n");
+		m_triggered=true;
+		return true;
+	}
+	m_window_pos++;
+	if (m_window_pos==m_window) {
+		rotate();
+		m_window_pos=0;
+	}
+	return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include "Vsoc.h"
+#include <verilated.h>
+#if VERILATOR_USE_VCD
+#include <verilated_vcd_c.h>
+typedef VerilatedVcdC Trace_file;
+#define TRACE_EXT "vcd"
+#else
+#include <verilated_fst_c.h>
+typedef VerilatedFstC Trace_file;
+#define TRACE_EXT "fst"
+#endif
+
+//Owns the trace file and decides which cycles end up in it. Without a pre-trigger window, a
+//cycle is dumped when the caller wants it traced. With a window, everything is dumped until
+//the first time the caller wants a trace; to keep the file size bounded, the trace is rotated
+//every 'window' cycles into <name>-pre.<ext>. Together, <name>-pre.<ext> and <name>.<ext> then
+//contain at least 'window' cycles leading up to the trigger.
+class Trace_ctl {
+	public:
+	Trace_ctl(Vsoc *tb, const char *name, uint64_t window);
+	~Trace_ctl();
+	//Call once per clk48m cycle. Returns true if the cycle should be dumped.
+	bool cycle(bool want_trace);
+	void dump(uint64_t time) { m_trace->dump(time); }
+	void close();
+
+	private:
+	void rotate();
+
+	Trace_file *m_trace;
+	char m_file[256];
+	char m_prefile[256];
+	uint64_t m_window;
+	uint64_t m_window_pos;
+	bool m_triggered;
+};
@@ -15,8 +15,15 @@
  */
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/select.h>
 #include "uart_emu.hpp"
+#include "sim_checkpoint.hpp"
+
+//Checking stdin costs a syscall. Only do that every this many clock cycles; that's still
+//far faster than anyone can type.
+#define UART_POLL_INTERVAL 4096
 
 Uart_emu::Uart_emu(int divisor) {
 	m_divisor=divisor;
@@ -28,13 +35,124 @@ Uart_emu::Uart_emu(int divisor) {
 	m_oldclk=1;
 	m_txbit=0;
 	m_curr_tx=1;
+	m_out_count=0;
+	m_outbuf_len=0;
+	m_cycles=0;
+	m_poll_ctr=0;
+	m_script=NULL;
+	m_script_len=0;
+	m_script_pos=0;
+	m_send_pos=0;
+	m_step_start=0;
+	m_last_match=0;
+}
+
+void Uart_emu::flush() {
+	if (m_outbuf_len) fwrite(m_outbuf, 1, m_outbuf_len, stderr);
+	m_outbuf_len=0;
 }
 
+//Output is written per line, or when the buffer is full.
 void Uart_emu::char_to_host(char c) {
-	fprintf(stderr, "%c", c);
+	m_outbuf[m_outbuf_len++]=c;
+	if (c=='\n' || m_outbuf_len==UART_OUTBUF_SIZE) flush();
+}
+
+//Decodes C-style escapes in place. Returns the resulting length.
+static int unescape(char *s) {
+	char *start=s;
+	char *out=s;
+	while (*s) {
+		if (*s!='\\' || s[1]==0) {
+			*out++=*s++;
+			continue;
+		}
+		s++;
+		switch (*s) {
+			case 'n': *out++='\n'; s++; break;
+			case 'r': *out++='\r'; s++; break;
+			case 't': *out++='\t'; s++; break;
+			case 'e': *out++=27; s++; break;
+			case 'x': {
+				char hex[3]={0}, *end;
+				strncpy(hex, s+1, 2);
+				*out++=strtol(hex, &end, 16);
+				s+=1+(end-hex);
+				break;
+			}
+			default: *out++=*s++; break;
+		}
+	}
+	*out=0;
+	return out-start;
+}
+
+int Uart_emu::load_script(const char *file) {
+	FILE *f=fopen(file, "r");
+	if (f==NULL) {
+		perror(file);
+		return 1;
+	}
+	char line[1024];
+	int lineno=0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		line[strcspn(line, "\r\n")]=0;
+		if (line[0]==0 || line[0]=='#') continue;
+		uart_script_step_t step={UART_SCRIPT_DELAY, 0, NULL, 0};
+		if (strncmp(line, "delay ", 6)==0) {
+			step.cycles=strtoull(line+6, NULL, 0);
+		} else if (strncmp(line, "wait ", 5)==0 || strncmp(line, "send ", 5)==0) {
+			step.cmd=(line[0]=='w')?UART_SCRIPT_WAIT:UART_SCRIPT_SEND;
+			step.str=strdup(line+5);
+			step.len=unescape(step.str);
+			if (step.len==0 || (step.cmd==UART_SCRIPT_WAIT && step.len>=UART_OUT_HIST)) {
+				printf("%s:%d: string empty or too long\n", file, lineno);
+				fclose(f);
+				return 1;
+			}
+		} else {
+			printf("%s:%d: expected delay, wait or send\n", file, lineno);
+			fclose(f);
+			return 1;
+		}
+		m_script=(uart_script_step_t*)realloc(m_script, (m_script_len+1)*sizeof(uart_script_step_t));
+		m_script[m_script_len++]=step;
+	}
+	fclose(f);
+	printf("UART: %d step script %s\n", m_script_len, file);
+	return 0;
+}
+
+//Returns the next character of the script to send, or -1 if there is none (yet).
+int Uart_emu::script_next_char() {
+	while (m_script_pos<m_script_len) {
+		uart_script_step_t *step=&m_script[m_script_pos];
+		if (step->cmd==UART_SCRIPT_DELAY) {
+			if (m_cycles-m_step_start<step->cycles) return -1;
+		} else if (step->cmd==UART_SCRIPT_WAIT) {
+			if (m_out_count==m_last_match || !out_ends_with(step->str)) return -1;
+			m_last_match=m_out_count;
+		} else {
+			int c=(uint8_t)step->str[m_send_pos++];
+			if (m_send_pos==step->len) {
+				m_send_pos=0;
+				m_script_pos++;
+				m_step_start=m_cycles;
+			}
+			return c;
+		}
+		m_script_pos++;
+		m_step_start=m_cycles;
+	}
+	return -1;
 }
 
 int Uart_emu::char_from_host() {
+	if (m_script) return script_next_char();
+	if (++m_poll_ctr<UART_POLL_INTERVAL) return -1;
+	m_poll_ctr=0;
+	flush(); //so prompts without a newline show up
 	fd_set rfd;
 	FD_ZERO(&rfd);
 	FD_SET(0, &rfd);
@@ -44,8 +162,60 @@ int Uart_emu::char_from_host() {
 	return fgetc(stdin);
 }
 
+bool Uart_emu::out_ends_with(const char *str) {
+	uint64_t len=strlen(str);
+	if (len>=UART_OUT_HIST || len>m_out_count) return false;
+	for (uint64_t i=0; i<len; i++) {
+		if (m_out_hist[(m_out_count-len+i)%UART_OUT_HIST]!=str[i]) return false;
+	}
+	return true;
+}
+
+int Uart_emu::save(FILE *f) {
+	CP_SAVE(f, m_oldclk);
+	CP_SAVE(f, m_divisor);
+	CP_SAVE(f, m_rxctr);
+	CP_SAVE(f, m_rxbit);
+	CP_SAVE(f, m_rxdata);
+	CP_SAVE(f, m_txdata);
+	CP_SAVE(f, m_txbit);
+	CP_SAVE(f, m_txctr);
+	CP_SAVE(f, m_curr_tx);
+	CP_SAVE(f, m_out_hist);
+	CP_SAVE(f, m_out_count);
+	CP_SAVE(f, m_cycles);
+	CP_SAVE(f, m_poll_ctr);
+	CP_SAVE(f, m_script_pos);
+	CP_SAVE(f, m_send_pos);
+	CP_SAVE(f, m_step_start);
+	CP_SAVE(f, m_last_match);
+	return CP_RESULT(f);
+}
+
+int Uart_emu::restore(FILE *f) {
+	CP_RESTORE(f, m_oldclk);
+	CP_RESTORE(f, m_divisor);
+	CP_RESTORE(f, m_rxctr);
+	CP_RESTORE(f, m_rxbit);
+	CP_RESTORE(f, m_rxdata);
+	CP_RESTORE(f, m_txdata);
+	CP_RESTORE(f, m_txbit);
+	CP_RESTORE(f, m_txctr);
+	CP_RESTORE(f, m_curr_tx);
+	CP_RESTORE(f, m_out_hist);
+	CP_RESTORE(f, m_out_count);
+	CP_RESTORE(f, m_cycles);
+	CP_RESTORE(f, m_poll_ctr);
+	CP_RESTORE(f, m_script_pos);
+	CP_RESTORE(f, m_send_pos);
+	CP_RESTORE(f, m_step_start);
+	CP_RESTORE(f, m_last_match);
+	return CP_RESULT(f);
+}
+
 int Uart_emu::eval(int clk, int rx, int *tx) {
 	if (clk && (clk!=m_oldclk)) {
+		m_cycles++;
 		if (m_txbit==0) {
 			m_txdata=this->char_from_host();
 			if (m_txdata!=-1) {
@@ -87,6 +257,8 @@ int Uart_emu::eval(int clk, int rx, int *tx) {
 				if (!rx) {
 					printf("Uart: Error! Stop bit high!\n");
 				} else {
+					m_out_hist[m_out_count%UART_OUT_HIST]=m_rxdata;
+					m_out_count++;
 					this->char_to_host(m_rxdata);
 					m_rxbit=0;
 				}
@@ -1,14 +1,49 @@
 
 #pragma once
 
+#include <stdio.h>
+#include <stdint.h>
+
+//Amount of SoC output kept around for out_ends_with()
+#define UART_OUT_HIST 64
+//Output to the host is written in chunks of at most this size
+#define UART_OUTBUF_SIZE 4096
+
+enum uart_script_cmd_t {
+	UART_SCRIPT_DELAY,	//wait this many clock cycles
+	UART_SCRIPT_WAIT,	//wait until the SoC output ends with this string
+	UART_SCRIPT_SEND,	//send this string to the SoC
+};
+
+typedef struct {
+	uart_script_cmd_t cmd;
+	uint64_t cycles;
+	char *str;
+	int len;
+} uart_script_step_t;
+
 using namespace std;
 
 class Uart_emu {
 	public:
 	Uart_emu(int divisor);
 	int eval(int clk, int rx, int *tx);
+	int save(FILE *f);
+	int restore(FILE *f);
+	//Number of characters the SoC sent so far
+	uint64_t get_out_count() { return m_out_count; }
+	//Returns true if the last characters sent by the SoC match str. Only the last
+	//UART_OUT_HIST-1 characters are remembered.
+	bool out_ends_with(const char *str);
+	//Instead of from stdin, take input from a script. Returns 1 on error. Each line of the
+	//script is 'delay <cycles>', 'wait <string>' or 'send <string>'; the strings can have
+	//C-style escapes. Waits only match output that came after the previous wait matched.
+	int load_script(const char *file);
+	//Writes out buffered output
+	void flush();
 
 	private:
+	int script_next_char();
 	virtual void char_to_host(char c);
 	virtual int char_from_host(); //-1 is no char
 	
@@ -22,4 +57,19 @@ class Uart_emu {
 	int m_txbit;
 	int m_txctr;
 	int m_curr_tx;
+
+	char m_out_hist[UART_OUT_HIST];
+	uint64_t m_out_count;
+
+	char m_outbuf[UART_OUTBUF_SIZE];
+	int m_outbuf_len;
+	uint64_t m_cycles;
+	int m_poll_ctr;
+
+	uart_script_step_t *m_script;
+	int m_script_len;
+	int m_script_pos;
+	int m_send_pos;
+	uint64_t m_step_start;
+	uint64_t m_last_match;
 };
@@ -15,33 +15,219 @@
  */
 
 #include <stdlib.h>
+#include <signal.h>
+#include <time.h>
 #include "Vsoc.h"
 #include <verilated.h>
-#include <verilated_vcd_c.h>
-#include <verilated_fst_c.h>
+#if VERILATOR_SAVABLE
+#include <verilated_save.h>
+#endif
 #include "psram_emu.hpp"
+#include "psram_xact_emu.hpp"
 #include "uart_emu.hpp"
 #include "uart_emu_gdb.hpp"
 #include "video/video_renderer.hpp"
 #include "video/lcd_renderer.hpp"
+#include "lcd_render_thread.hpp"
+#include "verilator_options.hpp"
+#include "sim_checkpoint.hpp"
+#include "trace_ctl.hpp"
+#include "pc_profiler.hpp"
+#include "qpimem_stats.hpp"
+#include "ipl/gloss/mach_defines.h"
 
 int uart_get(int ts) {
 	return 1;
 }
 
 int do_abort=0;
+volatile sig_atomic_t do_frame_dump=0;
 #define TAGMEM0 soc__DOT__qpimem_cache__DOT__genblk0__BRA__1__KET____DOT__tagdata__DOT__mem
 #define TAGMEM1 soc__DOT__qpimem_cache__DOT__genblk1__BRA__1__KET____DOT__tagdata__DOT__mem
 
 uint64_t ts=0;
 uint64_t tracepos=0;
 
+//Exit code in test mode (-u/-H) when the sim ran out of cycles
+#define EXIT_TIMEOUT 2
+
+//Output files go into the directory given with -o
+static const char *out_dir=".";
+
+static void out_file(char *buf, size_t len, const char *name) {
+	snprintf(buf, len, "%s/%s", out_dir, name);
+}
+
 
 double sc_time_stamp() {
 	return ts;
 }
 
+//Kill -USR1 the simulator to get the last completed frames of both renderers written to disk.
+static void frame_dump_sighandler(int sig) {
+	do_frame_dump=1;
+}
+
+static void frame_dump(Video_renderer *vid, Lcd_renderer *lcd, Lcd_render_thread *lcd_thread) {
+	char name[64], buf[1024];
+	if (lcd_thread) lcd_thread->sync();
+	if (vid) {
+		sprintf(name, "vid_%04d.ppm", vid->get_frame_count());
+		out_file(buf, sizeof(buf), name);
+		if (vid->write_ppm(buf)==0) printf("Wrote %s\n", buf);
+	}
+	if (lcd) {
+		sprintf(name, "lcd_%04d.ppm", lcd->get_frame_count());
+		out_file(buf, sizeof(buf), name);
+		if (lcd->write_ppm(buf)==0) printf("Wrote %s\n", buf);
+	}
+}
+
+//Returns true if the trigger hits this cycle. led_changed and uart_changed say if the LEDs or the
+//UART output changed this cycle; LED and UART triggers only fire on changes.
+static bool trigger_hit(const trigger_t *t, Vsoc *tb, Uart_emu *uart, bool led_changed, bool uart_changed) {
+	switch (t->type) {
+		case TRIG_CYCLE:
+			return ts==t->val;
+		case TRIG_PC:
+			return tb->soc__DOT__cpu__DOT__reg_pc==t->val;
+		case TRIG_LED:
+			return led_changed && tb->led==t->val;
+		case TRIG_UART:
+			return uart_changed && uart->out_ends_with(t->str);
+		default:
+			return false;
+	}
+}
+
+//Everything that needs to go into a checkpoint
+typedef struct {
+	Vsoc *tb;
+	Psram_emu *psrama;
+	Psram_emu *psramb;
+	Psram_xact_emu *psram_xact;
+	Uart_emu *uart;
+	Video_renderer *vid;
+	Lcd_renderer *lcd;
+	Lcd_render_thread *lcd_thread;
+	int **loop_vars; //NULL-terminated list of main loop state
+} sim_models_t;
+
+#define CHECKPOINT_MAGIC 0x43504D53
+
+//The Verilated model is saved to <file>.vlmodel by Verilators own --savable machinery; the state
+//of the C++ side goes into <file> itself.
+static int checkpoint_save(const char *file, sim_models_t *m) {
+#if VERILATOR_SAVABLE
+	char vlfile[1024];
+	snprintf(vlfile, sizeof(vlfile), "%s.vlmodel", file);
+	VerilatedSave os;
+	os.open(vlfile);
+	if (!os.isOpen()) {
+		perror(vlfile);
+		return 1;
+	}
+	os << *m->tb;
+	os.close();
+
+	FILE *f=fopen(file, "wb");
+	if (f==NULL) {
+		perror(file);
+		return 1;
+	}
+	if (m->lcd_thread) m->lcd_thread->sync();
+	uint32_t magic=CHECKPOINT_MAGIC;
+	int has_xact=m->psram_xact?1:0;
+	int has_vid=m->vid?1:0;
+	int has_lcd=m->lcd?1:0;
+	CP_SAVE(f, magic);
+	CP_SAVE(f, ts);
+	CP_SAVE(f, tracepos);
+	for (int i=0; m->loop_vars[i]; i++) CP_SAVE(f, *m->loop_vars[i]);
+	CP_SAVE(f, has_xact);
+	CP_SAVE(f, has_vid);
+	CP_SAVE(f, has_lcd);
+	int r=CP_RESULT(f);
+	if (!r) r=m->psrama->save(f);
+	if (!r) r=m->psramb->save(f);
+	if (!r && m->psram_xact) r=m->psram_xact->save(f);
+	if (!r) r=m->uart->save(f);
+	if (!r && m->vid) r=m->vid->save(f);
+	if (!r && m->lcd) r=m->lcd->save(f);
+	fclose(f);
+	if (r) {
+		printf("Error writing checkpoint %s\n", file);
+	} else {
+		printf("Wrote checkpoint %s at cycle %llu\n", file, (unsigned long long)ts);
+	}
+	return r;
+#else
+	printf("Simulator was built without --savable; can't write checkpoint.\n");
+	return 1;
+#endif
+}
+
+static int checkpoint_restore(const char *file, sim_models_t *m) {
+#if VERILATOR_SAVABLE
+	char vlfile[1024];
+	snprintf(vlfile, sizeof(vlfile), "%s.vlmodel", file);
+	VerilatedRestore os;
+	os.open(vlfile);
+	if (!os.isOpen()) {
+		perror(vlfile);
+		return 1;
+	}
+	os >> *m->tb;
+	os.close();
+
+	FILE *f=fopen(file, "rb");
+	if (f==NULL) {
+		perror(file);
+		return 1;
+	}
+	uint32_t magic=0;
+	int has_xact, has_vid, has_lcd;
+	CP_RESTORE(f, magic);
+	if (magic!=CHECKPOINT_MAGIC) {
+		printf("%s is not a checkpoint file\n", file);
+		fclose(f);
+		return 1;
+	}
+	CP_RESTORE(f, ts);
+	CP_RESTORE(f, tracepos);
+	for (int i=0; m->loop_vars[i]; i++) CP_RESTORE(f, *m->loop_vars[i]);
+	CP_RESTORE(f, has_xact);
+	CP_RESTORE(f, has_vid);
+	CP_RESTORE(f, has_lcd);
+	int r=CP_RESULT(f);
+	if (!r && (has_xact!=(m->psram_xact?1:0) || has_vid!=(m->vid?1:0) || has_lcd!=(m->lcd?1:0))) {
+		printf("Checkpoint %s was made with a different PSRAM model or renderer setup\n", file);
+		r=1;
+	}
+	if (!r) r=m->psrama->restore(f);
+	if (!r) r=m->psramb->restore(f);
+	if (!r && m->psram_xact) r=m->psram_xact->restore(f);
+	if (!r) r=m->uart->restore(f);
+	if (!r && m->vid) r=m->vid->restore(f);
+	if (!r && m->lcd) r=m->lcd->restore(f);
+	fclose(f);
+	if (r) {
+		printf("Error reading checkpoint %s\n", file);
+	} else {
+		printf("Restored checkpoint %s; continuing at cycle %llu\n", file, (unsigned long long)ts);
+	}
+	return r;
+#else
+	printf("Simulator was built without --savable; can't restore checkpoint.\n");
+	return 1;
+#endif
+}
+
 int main(int argc, char **argv) {
+	CmdLineOptions options = CmdLineOptions::parse(argc, argv);
+	out_dir=options.out_dir;
+	char fname[1024];
+
 	// Initialize Verilators variables
 	Verilated::commandArgs(argc, argv);
 	Verilated::traceEverOn(true);
@@ -49,37 +235,77 @@ int main(int argc, char **argv) {
 	// Create an instance of our module under test
 	Vsoc *tb = new Vsoc;
 	//Create trace
-
-#if VERILATOR_USE_VCD
-	VerilatedVcdC *trace = new VerilatedVcdC;
-	tb->trace(trace, 3);
-	trace->open("soctrace.vcd");
-#else
-	VerilatedFstC *trace = new VerilatedFstC;
-	tb->trace(trace, 99);
-	trace->open("soctrace.fst");
-#endif
+	out_file(fname, sizeof(fname), "soctrace");
+	Trace_ctl *trace=new Trace_ctl(tb, fname, options.trace_window);
 
 	tb->btn=0xff; //no buttons pressed
-	int do_trace=1;
+	//Without triggers, the SoC decides what gets traced by writing its trace_en register.
+	//With triggers, tracing runs between start and stop trigger; no start trigger means
+	//trace from the beginning.
+	bool trace_triggers=(options.trace_start.type!=TRIG_NONE || options.trace_stop.type!=TRIG_NONE);
+	int trace_trig_active=(options.trace_start.type==TRIG_NONE);
+	int do_trace=trace_triggers?trace_trig_active:1;
 
 	Psram_emu psrama=Psram_emu(8*1024*1024);
 	Psram_emu psramb=Psram_emu(8*1024*1024);
 	psrama.force_qpi(); psramb.force_qpi();
-	//ToDo: load elfs so we can mark ro sections as read-only
-	psrama.load_file_interleaved("boot/rom.bin", 0, false, false);
-	psramb.load_file_interleaved("boot/rom.bin", 0, false, true);
+	//Code is marked read-only, so the sim stops when something scribbles over it.
+	psrama.load_elf_interleaved("boot/rom.elf", MACH_RAM_START, true, false);
+	psramb.load_elf_interleaved("boot/rom.elf", MACH_RAM_START, true, true);
 
-	psrama.load_file_interleaved("ipl/ipl.bin", 0x2000, false, false);
-	psramb.load_file_interleaved("ipl/ipl.bin", 0x2000, false, true);
+	psrama.load_elf_interleaved("ipl/ipl.elf", MACH_RAM_START, true, false);
+	psramb.load_elf_interleaved("ipl/ipl.elf", MACH_RAM_START, true, true);
+
+	if (options.app_elf) {
+		uint32_t desc[3]={MEM_SIM_APP_MAGIC};
+		psrama.load_elf_interleaved(options.app_elf, MACH_RAM_START, true, false, &desc[1], &desc[2]);
+		psramb.load_elf_interleaved(options.app_elf, MACH_RAM_START, true, true);
+		//Tell the IPL to start it
+		psrama.write_interleaved(MEM_SIM_APP_DESC-MACH_RAM_START, (uint8_t*)desc, sizeof(desc), false);
+		psramb.write_interleaved(MEM_SIM_APP_DESC-MACH_RAM_START, (uint8_t*)desc, sizeof(desc), true);
+	}
+
+	Psram_xact_emu *psram_xact=NULL;
+	if (options.psram_model==PSRAM_MODEL_XACT) {
+		printf("Using transaction-level PSRAM model\n");
+		psram_xact=new Psram_xact_emu(&psrama, &psramb);
+	}
+	tb->psram_xact_en=psram_xact?1:0;
 
 	Uart_emu uart=Uart_emu(64);
 //	Uart_emu_gdb uart=Uart_emu_gdb(64);
 //	Uart_emu uart=Uart_emu(416);
+	if (options.uart_script && uart.load_script(options.uart_script)) exit(EXIT_FAILURE);
 
 	Video_renderer *vid=new Video_renderer(false);
 	Lcd_renderer *lcd=new Lcd_renderer();
 //	Lcd_renderer *lcd=NULL;
+	Lcd_render_thread *lcd_thread=lcd?new Lcd_render_thread(lcd):NULL;
+	if (options.expect_frame && !vid) {
+		printf("Can't check frame hash without a video renderer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	Pc_profiler *prof=NULL;
+	if (options.profile_interval) {
+		prof=new Pc_profiler(MACH_RAM_START, MACH_RAM_SIZE);
+		prof->add_elf("boot/rom.elf");
+		prof->add_elf("ipl/ipl.elf");
+		if (options.app_elf) prof->add_elf(options.app_elf);
+	}
+
+	Qpimem_stats *qstats=NULL;
+	FILE *qstats_file=NULL;
+	if (options.qpimem_stats) {
+		qstats_file=fopen(options.qpimem_stats, "w");
+		if (qstats_file==NULL) {
+			perror(options.qpimem_stats);
+			exit(1);
+		}
+		qstats=new Qpimem_stats(qstats_file);
+	}
+
+	signal(SIGUSR1, frame_dump_sighandler);
 
 	int oldled=0;
 	int fetch_next=0;
@@ -88,20 +314,44 @@ int main(int argc, char **argv) {
 	int pixel_clk=0;
 	int clkint=0;
 	int abort_timer=0;
+	int rx=1;
 	tb->rst = 1;
 
+	int *loop_vars[]={&do_trace, &trace_trig_active, &oldled, &fetch_next, &next_line, &next_field, &pixel_clk, &clkint, &rx, NULL};
+	sim_models_t models={tb, &psrama, &psramb, psram_xact, &uart, vid, lcd, lcd_thread, loop_vars};
+	if (options.checkpoint_restore) {
+		if (checkpoint_restore(options.checkpoint_restore, &models)) exit(1);
+		tb->psram_xact_en=psram_xact?1:0;
+	}
+	bool checkpoint_pending=false;
+	int vid_frame=vid?vid->get_frame_count():0;
+	uint64_t uart_count=uart.get_out_count();
+	//Test mode state
+	bool test_mode=(options.expect_uart || options.expect_frame);
+	bool uart_ok=!options.expect_uart;
+	bool frame_ok=!options.expect_frame;
+	bool timed_out=false;
+	int sim_error=0;
+
+	struct timespec start_time;
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+
 	while(1) {
 		ts++;
 		clkint+=123;
 		tb->clkint=(clkint&0x100)?1:0;
-		if (do_trace) tracepos++;
+		bool dump_cycle=trace->cycle(do_trace);
+		if (dump_cycle) tracepos++;
 		if (do_abort) {
 			//Continue for a bit after abort has been signalled.
 			abort_timer++;
 			if (abort_timer==32) break;
 		}
+		if (options.max_cycles && ts>options.max_cycles) {
+			timed_out=true;
+			break;
+		}
 		tb->uart_rx=uart_get(ts*21);
-		int rx;
 
 		if (ts > 10)
 			tb->rst = 0;
@@ -118,56 +368,139 @@ int main(int argc, char **argv) {
 		{
 			int v;
 
-			do_abort |= psrama.eval(tb->psrama_sclk, tb->psrama_nce,
-					tb->soc__DOT__qspi_phy_psrama_I__DOT__spi_io_or,
-					tb->soc__DOT__qspi_phy_psrama_I__DOT__spi_io_tr,
-					&v);
-			tb->soc__DOT__qspi_phy_psrama_I__DOT__spi_io_ir = v;
+			if (!psram_xact) {
+				sim_error |= psrama.eval(tb->psrama_sclk, tb->psrama_nce,
+						tb->soc__DOT__qspi_phy_psrama_I__DOT__spi_io_or,
+						tb->soc__DOT__qspi_phy_psrama_I__DOT__spi_io_tr,
+						&v);
+				tb->soc__DOT__qspi_phy_psrama_I__DOT__spi_io_ir = v;
 
-			do_abort |= psramb.eval(tb->psramb_sclk, tb->psramb_nce,
-					tb->soc__DOT__qspi_phy_psramb_I__DOT__spi_io_or,
-					tb->soc__DOT__qspi_phy_psramb_I__DOT__spi_io_tr,
-					&v);
-			tb->soc__DOT__qspi_phy_psramb_I__DOT__spi_io_ir = v;
+				sim_error |= psramb.eval(tb->psramb_sclk, tb->psramb_nce,
+						tb->soc__DOT__qspi_phy_psramb_I__DOT__spi_io_or,
+						tb->soc__DOT__qspi_phy_psramb_I__DOT__spi_io_tr,
+						&v);
+				tb->soc__DOT__qspi_phy_psramb_I__DOT__spi_io_ir = v;
+			}
 
-			uart.eval(tb->clk48m, tb->uart_tx, &rx);
+			//Uart only acts on the rising edge of clk48m; it needs to see it high and low once per cycle.
+			if (c&1) uart.eval(tb->clk48m, tb->uart_tx, &rx);
 
 			tb->clk48m = (c >> 1) & 1;
 			tb->clk96m = (c     ) & 1;
 			tb->eval();
 
-			if (do_trace) trace->dump(tracepos*20 + c*5);
+			if (psram_xact && c==2) {
+				//clk48m just went high; answer whatever the qpi master wants now.
+				uint32_t rdata=tb->psram_xact_rdata;
+				int next_word, is_idle;
+				sim_error |= psram_xact->eval(tb->psram_xact_do_read, tb->psram_xact_do_write,
+						tb->psram_xact_addr, tb->psram_xact_wdata, &rdata, &next_word, &is_idle);
+				tb->psram_xact_rdata=rdata;
+				tb->psram_xact_next_word=next_word;
+				tb->psram_xact_is_idle=is_idle;
+			}
+			if (qstats && c==2) {
+				qstats->eval(tb->qpimon_do_read, tb->qpimon_do_write, tb->qpimon_next_word, tb->qpimon_is_idle,
+						tb->qpimon_cache_addr, tb->qpimon_vid_addr, tb->qpimon_cpu_access, tb->qpimon_cpu_addr);
+			}
+
+			if (dump_cycle) trace->dump(tracepos*20 + c*5);
 		}
 
-		do_trace = tb->trace_en;
 		if (vid && pixel_clk) {
 			vid->next_pixel(tb->vid_red, tb->vid_green, tb->vid_blue, &fetch_next, &next_line, &next_field);
 			tb->vid_fetch_next=fetch_next;
 			tb->vid_next_line=next_line;
 			tb->vid_next_field=next_field;
 		}
-		if (lcd) lcd->update(tb->lcd_db, tb->lcd_wr, tb->lcd_rd, tb->lcd_rs);
+		if (sim_error) do_abort=1;
+		if (vid && vid->get_frame_count()!=vid_frame) {
+			vid_frame=vid->get_frame_count();
+			if (qstats) qstats->end_frame();
+			if (options.expect_frame && vid->get_frame_hash()==options.expect_frame_hash) frame_ok=true;
+		}
+		if (lcd_thread) {
+			lcd_thread->update(tb->lcd_db, tb->lcd_wr, tb->lcd_rd, tb->lcd_rs);
+			if ((ts&0xffff)==0) lcd_thread->present();
+		}
+		if (do_frame_dump) {
+			do_frame_dump=0;
+			frame_dump(vid, lcd, lcd_thread);
+		}
+		bool led_changed=false;
 		if (oldled != tb->led) {
 			oldled=tb->led;
+			led_changed=true;
 			printf("LEDs: 0x%X\n", oldled);
 			if (tb->led==0x2a) do_abort=1;
-			//if (oldled == 0x3A) do_trace=1;
 		}
-/*
-		if (tb->soc__DOT__cpu__DOT__reg_pc==0x400060f4) {
-			do_trace=1;
-			printf("Trace start\n");
+		bool uart_changed=(uart.get_out_count()!=uart_count);
+		uart_count=uart.get_out_count();
+		if (uart_changed && options.expect_uart && uart.out_ends_with(options.expect_uart)) uart_ok=true;
+
+		if (trace_triggers) {
+			if (!trace_trig_active && trigger_hit(&options.trace_start, tb, &uart, led_changed, uart_changed)) {
+				trace_trig_active=1;
+				printf("Trace start at cycle %llu\n", (unsigned long long)ts);
+			}
+			if (trace_trig_active && trigger_hit(&options.trace_stop, tb, &uart, led_changed, uart_changed)) {
+				trace_trig_active=0;
+				printf("Trace stop at cycle %llu\n", (unsigned long long)ts);
+			}
+			do_trace = trace_trig_active || tb->trace_en;
+		} else {
+			do_trace = tb->trace_en;
 		}
-		if (tb->soc__DOT__cpu__DOT__reg_pc==0x400002d4) {
-			do_trace=0;
-			printf("Trace stop\n");
+		if (prof && (ts%options.profile_interval)==0) prof->sample(tb->soc__DOT__cpu__DOT__reg_pc);
+		if (options.checkpoint_save && trigger_hit(&options.checkpoint_save_at, tb, &uart, led_changed, uart_changed)) {
+			checkpoint_pending=true;
 		}
-*/
-//		printf("%X\n", tb->soc__DOT__cpu__DOT__reg_pc);
+		if (checkpoint_pending) {
+			checkpoint_save(options.checkpoint_save, &models);
+			checkpoint_pending=false;
+			options.checkpoint_save=NULL; //only once
+		}
+		if (test_mode && uart_ok && frame_ok) break;
 	};
 //	printf("Verilator sim exited, pc 0x%08X\n", tb->soc__DOT__cpu__DOT__reg_pc);
-	trace->flush();
+	struct timespec end_time;
+	clock_gettime(CLOCK_MONOTONIC, &end_time);
+	double secs=(end_time.tv_sec-start_time.tv_sec)+(end_time.tv_nsec-start_time.tv_nsec)/1000000000.0;
+	printf("Sim speed: %llu cycles in %.2f s, %.0f cycles/s\n", (unsigned long long)ts, secs, ts/secs);
+	uart.flush();
+	delete lcd_thread;
+	if (qstats) {
+		qstats->report();
+		fclose(qstats_file);
+		printf("Wrote PSRAM traffic statistics to %s\n", options.qpimem_stats);
+		delete qstats;
+	}
+	if (prof) {
+		out_file(fname, sizeof(fname), "pcprof.txt");
+		if (prof->write_flat(fname)==0) printf("Wrote flat profile to %s\n", fname);
+		out_file(fname, sizeof(fname), "callgrind.out.pcprof");
+		if (prof->write_callgrind(fname)==0) printf("Wrote callgrind profile to %s\n", fname);
+		delete prof;
+	}
+	delete trace;
 
-	trace->close();
-	exit(EXIT_SUCCESS);
+	//The runner (sim_regress.py) parses these lines.
+	if (vid) printf("Frame hash: %016llx\n", (unsigned long long)vid->get_frame_hash());
+	int ret=sim_error?EXIT_FAILURE:EXIT_SUCCESS;
+	if (test_mode) {
+		if (sim_error) {
+			printf("Result: FAIL (sim error) after %llu cycles\n", (unsigned long long)ts);
+		} else if (uart_ok && frame_ok) {
+			printf("Result: PASS after %llu cycles\n", (unsigned long long)ts);
+		} else if (timed_out) {
+			printf("Result: TIMEOUT after %llu cycles%s%s\n", (unsigned long long)ts,
+					uart_ok?"":", UART output not seen", frame_ok?"":", frame not seen");
+			ret=EXIT_TIMEOUT;
+		} else {
+			printf("Result: FAIL after %llu cycles%s%s\n", (unsigned long long)ts,
+					uart_ok?"":", UART output not seen", frame_ok?"":", frame not seen");
+			ret=EXIT_FAILURE;
+		}
+	}
+	exit(ret);
 }
@@ -0,0 +1,136 @@
+#include "verilator_options.hpp"
+#include "uart_emu.hpp"
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+CmdLineOptions::CmdLineOptions():
+	psram_model(PSRAM_MODEL_PIN), max_cycles(0),
+	checkpoint_save(NULL), checkpoint_save_at({TRIG_NONE, 0, NULL}),
+	checkpoint_restore(NULL),
+	trace_start({TRIG_NONE, 0, NULL}), trace_stop({TRIG_NONE, 0, NULL}), trace_window(0),
+	app_elf(NULL), profile_interval(0),
+	qpimem_stats(NULL), out_dir("."), expect_uart(NULL), expect_frame(false), expect_frame_hash(0),
+	uart_script(NULL) {}
+
+static void errExit(char *prog_name, const char *msg, char opt) {
+	fprintf(stderr, "Option '%c': %s\n"
+		"Usage: %s [-p pin|xact] [-c cycles] [-S file -s trig] [-R file]\n"
+		"       [-t trig] [-T trig] [-w cycles] [-a app.elf] [-P interval] [-m file]\n"
+		"       [-o dir] [-u string] [-H hash] [-i script]\n"
+		"  -p: PSRAM model: bit-accurate QPI bus (pin, default) or transaction-level (xact)\n"
+		"  -c: stop after this many clk48m cycles\n"
+		"  -S: write a checkpoint of the simulation to this file...\n"
+		"  -s: ...when this trigger hits\n"
+		"  -R: start from this checkpoint instead of from reset\n"
+		"  -t: start tracing when this trigger hits\n"
+		"  -T: stop tracing when this trigger hits\n"
+		"  -w: also keep at least this many cycles of trace from before the -t trigger\n"
+		"  -a: preload this app ELF into PSRAM; the IPL starts it instead of autoexec.elf\n"
+		"  -P: profile the CPU by sampling its PC every this many cycles\n"
+		"  -m: write per-frame PSRAM traffic and cache statistics to this file\n"
+		"  -o: write output files to this directory instead of the current one\n"
+		"  -u: test mode: expect the UART output to contain this string (max %d chars)\n"
+		"  -H: test mode: expect a video frame with this hash\n"
+		"  -i: feed the UART from this script instead of from stdin\n"
+		"In test mode, the exit code is 0 if all expectations are met, 1 on failure and 2 if\n"
+		"-c cycles passed first.\n"
+		"Triggers are cycle:n, pc:n, led:n or uart:string.\n",
+		opt, msg, prog_name, UART_OUT_HIST-1);
+	exit(EXIT_FAILURE);
+}
+
+static trigger_t parseTrigger(char *prog_name, char opt, char *s) {
+	trigger_t result={TRIG_NONE, 0, NULL};
+	if (strncmp(s, "cycle:", 6)==0) {
+		result.type = TRIG_CYCLE;
+		result.val = strtoull(s+6, NULL, 0);
+	} else if (strncmp(s, "pc:", 3)==0) {
+		result.type = TRIG_PC;
+		result.val = strtoull(s+3, NULL, 0);
+	} else if (strncmp(s, "led:", 4)==0) {
+		result.type = TRIG_LED;
+		result.val = strtoull(s+4, NULL, 0);
+	} else if (strncmp(s, "uart:", 5)==0 && s[5]!=0) {
+		result.type = TRIG_UART;
+		result.str = s+5;
+	} else {
+		errExit(prog_name, "Trigger must be cycle:n, pc:n, led:n or uart:string", opt);
+	}
+	return result;
+}
+
+CmdLineOptions CmdLineOptions::parse(int argc, char**argv) {
+	CmdLineOptions result;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:c:S:s:R:t:T:w:a:P:m:o:u:H:i:")) != -1) {
+		switch (opt) {
+			case 'p':
+				if (strcmp(optarg, "pin")==0) {
+					result.psram_model = PSRAM_MODEL_PIN;
+				} else if (strcmp(optarg, "xact")==0) {
+					result.psram_model = PSRAM_MODEL_XACT;
+				} else {
+					errExit(argv[0], "Must be 'pin' or 'xact'", opt);
+				}
+				break;
+			case 'c':
+				result.max_cycles = strtoull(optarg, NULL, 0);
+				if (result.max_cycles == 0) errExit(argv[0], "Must provide a positive number", opt);
+				break;
+			case 'S':
+				result.checkpoint_save = optarg;
+				break;
+			case 's':
+				result.checkpoint_save_at = parseTrigger(argv[0], opt, optarg);
+				break;
+			case 'R':
+				result.checkpoint_restore = optarg;
+				break;
+			case 't':
+				result.trace_start = parseTrigger(argv[0], opt, optarg);
+				break;
+			case 'T':
+				result.trace_stop = parseTrigger(argv[0], opt, optarg);
+				break;
+			case 'w':
+				result.trace_window = strtoull(optarg, NULL, 0);
+				if (result.trace_window == 0) errExit(argv[0], "Must provide a positive number", opt);
+				break;
+			case 'a':
+				result.app_elf = optarg;
+				break;
+			case 'P':
+				result.profile_interval = strtoull(optarg, NULL, 0);
+				if (result.profile_interval == 0) errExit(argv[0], "Must provide a positive number", opt);
+				break;
+			case 'm':
+				result.qpimem_stats = optarg;
+				break;
+			case 'o':
+				result.out_dir = optarg;
+				break;
+			case 'u':
+				result.expect_uart = optarg;
+				if (strlen(optarg)==0 || strlen(optarg)>=UART_OUT_HIST) errExit(argv[0], "String empty or too long", opt);
+				break;
+			case 'H':
+				result.expect_frame = true;
+				result.expect_frame_hash = strtoull(optarg, NULL, 16);
+				break;
+			case 'i':
+				result.uart_script = optarg;
+				break;
+			default: /* '?' */
+				errExit(argv[0], "Unknown", opt);
+		}
+	}
+	if (result.checkpoint_save && result.checkpoint_save_at.type==TRIG_NONE) {
+		errExit(argv[0], "Need -s to say when to write the checkpoint", 'S');
+	}
+	if (result.trace_window && result.trace_start.type==TRIG_NONE) {
+		errExit(argv[0], "A pre-trigger window needs a -t trigger", 'w');
+	}
+	return result;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+
+// PSRAM model to use, see Psram_emu and Psram_xact_emu
+enum psram_model_t {
+	PSRAM_MODEL_PIN,	// Bit-accurate QPI bus model; use this when debugging the PHY
+	PSRAM_MODEL_XACT,	// Transaction-level model; a lot faster
+};
+
+// Something happening in the simulation; used to start/stop tracing and to write checkpoints.
+// On the command line, this is one of cycle:n, pc:n, led:n or uart:string.
+enum trigger_type_t {
+	TRIG_NONE,
+	TRIG_CYCLE,	// clk48m cycle number reached
+	TRIG_PC,	// CPU program counter has this value
+	TRIG_LED,	// LEDs change to this value
+	TRIG_UART,	// UART output ends with this string
+};
+
+typedef struct {
+	trigger_type_t type;
+	uint64_t val;
+	const char *str;
+} trigger_t;
+
+// Contains found command line options
+class CmdLineOptions {
+public:
+	CmdLineOptions();
+
+	// Option fields - all public
+	// Which PSRAM model to use
+	psram_model_t psram_model;
+
+	// Stop after this many clk48m cycles; 0 means run until the LEDs say so
+	uint64_t max_cycles;
+
+	// Checkpoint to write, and when to write it. NULL if no checkpoint should be written.
+	const char *checkpoint_save;
+	trigger_t checkpoint_save_at;
+
+	// Checkpoint to start from instead of reset; NULL to start from reset.
+	const char *checkpoint_restore;
+
+	// Tracing starts when trace_start hits and stops when trace_stop hits; this can happen
+	// multiple times. If neither is set, tracing is controlled by the SoCs trace_en register.
+	trigger_t trace_start;
+	trigger_t trace_stop;
+	// If nonzero, keep at least this many clk48m cycles of trace before trace_start hits.
+	uint64_t trace_window;
+
+	// App ELF to preload into PSRAM next to the IPL; NULL if none.
+	const char *app_elf;
+
+	// If nonzero, sample the CPU program counter every this many clk48m cycles and write a profile.
+	uint64_t profile_interval;
+
+	// If not NULL, write PSRAM traffic and cache statistics to this file.
+	const char *qpimem_stats;
+
+	// Directory to write output files (traces, profiles, frame dumps) to.
+	const char *out_dir;
+
+	// Test mode: the sim stops as soon as all given expectations are met, and the exit code
+	// says if they were. Expected string in the UART output, NULL if none.
+	const char *expect_uart;
+	// Expected hash (see Video_renderer::get_frame_hash) of a video frame; only valid if expect_frame is set.
+	bool expect_frame;
+	uint64_t expect_frame_hash;
+
+	// UART input script (see Uart_emu::load_script); NULL to read stdin.
+	const char *uart_script;
+
+	// Factory method: creates from command line
+	static CmdLineOptions parse(int argc, char**argv);
+};
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+//64-bit FNV-1a hash of a frame; used to compare frames against known-good ones.
+static inline uint64_t frame_hash(const uint8_t *rgb, int w, int h) {
+	uint64_t hash=0xcbf29ce484222325ULL;
+	for (int i=0; i<w*h*3; i++) {
+		hash^=rgb[i];
+		hash*=0x100000001b3ULL;
+	}
+	return hash;
+}
@@ -1,11 +1,15 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/select.h>
 #include "lcd_renderer.hpp"
+#include "ppm_write.hpp"
+#include "../sim_checkpoint.hpp"
 
 #define SCALE 2
 
 Lcd_renderer::Lcd_renderer() {
+#if !HEADLESS
 	if (SDL_Init(SDL_INIT_VIDEO) < 0) {
 		printf("Error initializing sdl!\n");
 		exit(1);
@@ -22,11 +26,54 @@ Lcd_renderer::Lcd_renderer() {
 	}
 	SDL_FillRect(screen_surf, NULL, SDL_MapRGB(screen_surf->format, 0xff, 0, 0xff));
 	SDL_UpdateWindowSurface(window);
+#endif
+	frame_cur=new uint8_t[LCD_RENDERER_W*LCD_RENDERER_H*3]();
+	frame_done=new uint8_t[LCD_RENDERER_W*LCD_RENDERER_H*3]();
+	frame_count=0;
 	lastwr=1;
 	xpos=0;
 	ypos=0;
 }
 
+const uint8_t *Lcd_renderer::get_frame() {
+	return frame_done;
+}
+
+int Lcd_renderer::get_frame_count() {
+	return frame_count;
+}
+
+int Lcd_renderer::write_ppm(const char *file) {
+	return ppm_write(file, frame_done, LCD_RENDERER_W, LCD_RENDERER_H);
+}
+
+void Lcd_renderer::show(const uint8_t *frame) {
+#if !HEADLESS
+	SDL_Surface *s=SDL_CreateRGBSurfaceWithFormatFrom((void*)frame, LCD_RENDERER_W, LCD_RENDERER_H, 24,
+			LCD_RENDERER_W*3, SDL_PIXELFORMAT_RGB24);
+	if (!s) return;
+	SDL_BlitScaled(s, NULL, screen_surf, NULL);
+	SDL_FreeSurface(s);
+	SDL_UpdateWindowSurface(window);
+#endif
+}
+
+int Lcd_renderer::save(FILE *f) {
+	CP_SAVE(f, xpos);
+	CP_SAVE(f, ypos);
+	CP_SAVE(f, lastwr);
+	CP_SAVE(f, frame_count);
+	return CP_RESULT(f);
+}
+
+int Lcd_renderer::restore(FILE *f) {
+	CP_RESTORE(f, xpos);
+	CP_RESTORE(f, ypos);
+	CP_RESTORE(f, lastwr);
+	CP_RESTORE(f, frame_count);
+	return CP_RESULT(f);
+}
+
 void Lcd_renderer::update(int db, int wr, int rd, int rs) {
 	if (lastwr==wr || wr==1) {
 		lastwr=wr;
@@ -43,30 +90,29 @@ void Lcd_renderer::update(int db, int wr, int rd, int rs) {
 		xpos=0;
 		ypos=0;
 	} else {
-		SDL_Rect r;
 		if (xpos<480 && ypos<320) {
 			int red=((db>>0)&0x1f)<<3;
 			int green=((db>>5)&0x3f)<<2;
 			int blue=((db>>10)&0x1f)<<3;
-			r.x=xpos*SCALE;
-			r.y=ypos*SCALE;
-			r.w=SCALE;
-			r.h=SCALE;
-			SDL_FillRect(screen_surf, &r, SDL_MapRGB(screen_surf->format, red, green, blue));
+			uint8_t *p=&frame_cur[(ypos*LCD_RENDERER_W+xpos)*3];
+			p[0]=red;
+			p[1]=green;
+			p[2]=blue;
 		} else {
 			printf("LCD: Hmm, got data for %d, %d\n", xpos, ypos);
 		}
 		xpos++;
 		if (xpos==480) {
-			Uint32 time_since_last=SDL_GetTicks()-last_update;
-			if (time_since_last>100) {
-				SDL_UpdateWindowSurface(window);
-				last_update=SDL_GetTicks();
-			}
 			xpos=0;
 			ypos++;
+			if (ypos==320) {
+				//Full frame received.
+				uint8_t *t=frame_done;
+				frame_done=frame_cur;
+				frame_cur=t;
+				frame_count++;
+			}
 		}
 	}
 	return;
 }
-
@@ -1,21 +1,42 @@
-
 #pragma once
 
+#include <stdint.h>
+#include <stdio.h>
+#if !HEADLESS
 #include <SDL.h>
+#endif
 
 
 using namespace std;
 
+#define LCD_RENDERER_W 480
+#define LCD_RENDERER_H 320
+
 class Lcd_renderer {
 	public:
 	Lcd_renderer();
 	void update(int db, int wr, int rd, int rs);
+	//Last completed frame, LCD_RENDERER_W*LCD_RENDERER_H packed RGB pixels.
+	const uint8_t *get_frame();
+	//Amount of frames completed so far
+	int get_frame_count();
+	int write_ppm(const char *file);
+	//Puts a frame (as returned by get_frame()) in the window. SDL wants this to be called from the
+	//thread that created the renderer; update() doesn't touch SDL so it can run elsewhere.
+	void show(const uint8_t *frame);
+	//Only the position of the beam/write pointer is saved, not the image itself.
+	int save(FILE *f);
+	int restore(FILE *f);
 
 	private:
+#if !HEADLESS
 	SDL_Surface *screen_surf;
 	SDL_Window *window;
+#endif
+	uint8_t *frame_cur;
+	uint8_t *frame_done;
+	int frame_count;
 	int xpos;
 	int ypos;
 	int lastwr;
-	Uint32 last_update;
 };
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+//Writes a buffer of packed RGB pixels to a binary PPM file. Returns 0 on success.
+static inline int ppm_write(const char *file, const uint8_t *rgb, int w, int h) {
+	FILE *f=fopen(file, "wb");
+	if (f==NULL) {
+		perror(file);
+		return 1;
+	}
+	fprintf(f, "P6\n%d %d\n255\n", w, h);
+	int ok=(fwrite(rgb, 3, w*h, f)==(size_t)(w*h));
+	fclose(f);
+	return ok?0:1;
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright 2019 Jeroen Domburg <jeroen@spritesmods.com>
+ * This is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this software.  If not, see <https://www.gnu.org/licenses/>.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qpi_mem_model.hpp"
+
+#define QM_IDLE 0
+#define QM_GAP 1	//  /CS high after a burst
+#define QM_SETUP 2	//video burst: command, address, dummy
+#define QM_DATA 3	//video burst: data
+#define QM_CPU 4	//synthetic CPU burst
+
+void Qpi_mem_model::default_timing(qpi_timing_t *t) {
+	//See notes.txt: a 64-byte read is 14+128 cycles on one chip; with two chips in
+	//parallel a word takes 2 cycles. 2uS at 48MHz is 96 cycles.
+	t->setup=14;
+	t->word=2;
+	t->cs_gap=2;
+	t->cs_max=96;
+	t->split=0;
+	t->cpu_load=0;
+	t->cpu_words=16;
+	t->seed=1;
+}
+
+bool Qpi_mem_model::parse_timing(const char *str, qpi_timing_t *t) {
+	char *buf=strdup(str);
+	bool ok=true;
+	for (char *tok=strtok(buf, ","); tok!=NULL && ok; tok=strtok(NULL, ",")) {
+		char *val=strchr(tok, '=');
+		if (val==NULL) {
+			ok=false;
+			break;
+		}
+		*val++=0;
+		char *end;
+		long v=strtol(val, &end, 0);
+		if (*val==0 || *end!=0 || v<0) {
+			ok=false;
+		} else if (strcmp(tok, "setup")==0) {
+			t->setup=v;
+		} else if (strcmp(tok, "word")==0 && v>0) {
+			t->word=v;
+		} else if (strcmp(tok, "gap")==0) {
+			t->cs_gap=v;
+		} else if (strcmp(tok, "csmax")==0 && v>0) {
+			t->cs_max=v;
+		} else if (strcmp(tok, "split")==0) {
+			t->split=v?1:0;
+		} else if (strcmp(tok, "cpu")==0 && v<=100) {
+			t->cpu_load=v;
+		} else if (strcmp(tok, "cpuwords")==0 && v>0) {
+			t->cpu_words=v;
+		} else if (strcmp(tok, "seed")==0) {
+			t->seed=v;
+		} else {
+			ok=false;
+		}
+	}
+	free(buf);
+	return ok;
+}
+
+Qpi_mem_model::Qpi_mem_model(uint8_t *mem, uint32_t size, const qpi_timing_t *timing) {
+	m_mem=mem;
+	m_size=size;
+	m_t=*timing;
+	memset(&m_stats, 0, sizeof(m_stats));
+	m_state=QM_IDLE;
+	m_delay=0;
+	m_cs_low=0;
+	m_addr=0;
+	m_resume=0;
+	m_cpu_pending=0;
+	m_rnd=m_t.seed?m_t.seed:1;
+}
+
+//xorshift32; we want the CPU traffic to be the same on every run.
+uint32_t Qpi_mem_model::rnd() {
+	m_rnd^=m_rnd<<13;
+	m_rnd^=m_rnd>>17;
+	m_rnd^=m_rnd<<5;
+	return m_rnd;
+}
+
+//Randomly queues a CPU burst so that on average cpu_load percent of the time would be
+//spent on CPU bursts if the bus were otherwise idle.
+void Qpi_mem_model::cpu_gen() {
+	if (m_cpu_pending || m_t.cpu_load==0) return;
+	uint32_t burst=m_t.setup+m_t.cpu_words*m_t.word+m_t.cs_gap;
+	if (rnd()%(burst*100) < (uint32_t)m_t.cpu_load) m_cpu_pending=1;
+}
+
+void Qpi_mem_model::end_burst(int resume) {
+	if (m_cs_low > m_stats.cs_low_max) m_stats.cs_low_max=m_cs_low;
+	if (m_cs_low > m_t.cs_max) m_stats.cs_violations++;
+	m_state=QM_GAP;
+	m_delay=m_t.cs_gap;
+	m_resume=resume;
+}
+
+void Qpi_mem_model::start_vid_burst() {
+	m_state=QM_SETUP;
+	m_delay=m_t.setup;
+	m_cs_low=0;
+}
+
+void Qpi_mem_model::eval(int do_read, uint32_t addr, uint32_t *rdata, int *next_word, int *is_idle) {
+	*next_word=0;
+	m_stats.cycles++;
+	cpu_gen();
+
+	if (m_state==QM_SETUP || m_state==QM_DATA || m_state==QM_CPU) m_cs_low++;
+	if (m_delay) m_delay--;
+
+	if (m_state==QM_CPU) {
+		m_stats.cpu_busy++;
+		if (do_read) m_stats.vid_wait++;
+		if (m_delay==0) end_burst(0);
+	} else if (m_state==QM_GAP) {
+		if (m_resume) m_stats.vid_busy++;
+		if (m_delay==0) {
+			if (m_resume && do_read) {
+				//Video DMA still holds the bus; carry on with the next part of the burst.
+				m_stats.vid_setup+=m_t.setup;
+				start_vid_burst();
+			} else {
+				m_state=QM_IDLE;
+			}
+			m_resume=0;
+		}
+	} else if (m_state==QM_IDLE) {
+		//The video DMA is the higher priority master.
+		if (do_read) {
+			m_addr=addr;
+			m_stats.vid_bursts++;
+			m_stats.vid_setup+=m_t.setup;
+			start_vid_burst();
+		} else if (m_cpu_pending) {
+			m_cpu_pending=0;
+			m_stats.cpu_bursts++;
+			m_state=QM_CPU;
+			m_delay=m_t.setup+m_t.cpu_words*m_t.word;
+			m_cs_low=0;
+		}
+	} else if (!do_read) {
+		//Master ended the burst
+		end_burst(0);
+	} else {
+		m_stats.vid_busy++;
+		if (m_state==QM_SETUP) {
+			if (m_delay==0) {
+				m_state=QM_DATA;
+				m_delay=m_t.word;
+			}
+		} else if (m_delay==0) {
+			uint32_t a=m_addr % m_size;
+			*rdata=m_mem[a] | (m_mem[(a+1)%m_size]<<8) | (m_mem[(a+2)%m_size]<<16) | (m_mem[(a+3)%m_size]<<24);
+			*next_word=1;
+			m_addr+=4;
+			m_stats.vid_words++;
+			m_delay=m_t.word;
+			if (m_t.split && m_cs_low+m_t.word > m_t.cs_max) {
+				//Next word would keep /CS low for too long: release it so the chip can
+				//refresh, then re-issue the read at the current address.
+				m_stats.cs_splits++;
+				end_burst(1);
+			}
+		}
+	}
+	*is_idle=(m_state==QM_IDLE || (m_state==QM_GAP && !m_resume) || m_state==QM_CPU)?1:0;
+}
+
+void Qpi_mem_model::report(FILE *f) {
+	qpi_stats_t *s=&m_stats;
+	double cyc=s->cycles?s->cycles:1;
+	fprintf(f, "QPI model: setup %d, %d cycles/word, /CS gap %d, /CS max %d%s, CPU load %d%%\n",
+			m_t.setup, m_t.word, m_t.cs_gap, m_t.cs_max, m_t.split?" (split)":"", m_t.cpu_load);
+	fprintf(f, "Video: %llu bursts, %llu words (%.1f words/burst), bus busy %.1f%% of %llu cycles\n",
+			(unsigned long long)s->vid_bursts, (unsigned long long)s->vid_words,
+			s->vid_bursts?(double)s->vid_words/s->vid_bursts:0.0, s->vid_busy*100.0/cyc,
+			(unsigned long long)s->cycles);
+	fprintf(f, "Video: %llu cycles burst setup, %llu cycles waiting for CPU bursts\n",
+			(unsigned long long)s->vid_setup, (unsigned long long)s->vid_wait);
+	fprintf(f, "CPU: %llu bursts, bus busy %.1f%%\n",
+			(unsigned long long)s->cpu_bursts, s->cpu_busy*100.0/cyc);
+	fprintf(f, "/CS: longest low time %d cycles, %llu bursts over the %d cycle limit, %llu bursts split\n",
+			s->cs_low_max, (unsigned long long)s->cs_violations, m_t.cs_max,
+			(unsigned long long)s->cs_splits);
+}
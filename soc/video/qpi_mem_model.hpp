@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+//Timing of the memory behind the video DMA, in clk cycles. Defaults approximate the two
+//interleaved PSRAM chips behind qpimem_iface_2x2w at 48MHz.
+typedef struct {
+	int setup;		//command, address and dummy cycles before the first word of a burst
+	int word;		//cycles per 32-bit word
+	int cs_gap;		//minimum cycles /CS stays high between bursts
+	int cs_max;		//maximum cycles /CS may be low (tCEM, 2uS) before the chip needs a refresh gap
+	int split;		//if 1, bursts longer than cs_max are split like a compliant iface would
+	int cpu_load;	//percentage of memory time the synthetic CPU traffic tries to use
+	int cpu_words;	//words per CPU burst (a qpimem_cache line)
+	uint32_t seed;	//seed for the CPU traffic generator
+} qpi_timing_t;
+
+//Statistics gathered by Qpi_mem_model.
+typedef struct {
+	uint64_t cycles;
+	uint64_t vid_bursts;
+	uint64_t vid_words;
+	uint64_t vid_busy;		//cycles the bus was in use for video bursts
+	uint64_t vid_wait;		//cycles the video DMA requested data while the CPU had the bus
+	uint64_t vid_setup;		//cycles spent in burst setup for video bursts, incl. split bursts
+	uint64_t cpu_bursts;
+	uint64_t cpu_busy;		//cycles the CPU traffic occupied the bus
+	uint64_t cs_splits;		//video bursts split because of cs_max
+	uint64_t cs_violations;	//bursts that kept /CS low longer than cs_max
+	int cs_low_max;			//longest /CS low time seen
+} qpi_stats_t;
+
+//Models the memory the video linerenderer DMA reads from: a byte array behind a QPI
+//interface with burst setup, per-/CS timing and refresh gaps, shared with a synthetic
+//CPU that gets the bus whenever the video DMA does not use it (the video master has
+//priority in qpimem_arbiter, but can't preempt a burst that is in progress).
+class Qpi_mem_model {
+	public:
+	Qpi_mem_model(uint8_t *mem, uint32_t size, const qpi_timing_t *timing);
+	//Call on each rising clk edge, before evaluating the model.
+	void eval(int do_read, uint32_t addr, uint32_t *rdata, int *next_word, int *is_idle);
+	const qpi_stats_t *get_stats() { return &m_stats; }
+	void report(FILE *f);
+
+	//Fills in the default timing.
+	static void default_timing(qpi_timing_t *timing);
+	//Parses a list like 'setup=14,word=2,cpu=30' on top of the current timing. Returns
+	//false on an unknown key or bad value.
+	static bool parse_timing(const char *str, qpi_timing_t *timing);
+
+	private:
+	uint32_t rnd();
+	void cpu_gen();
+	void end_burst(int resume);
+	void start_vid_burst();
+
+	uint8_t *m_mem;
+	uint32_t m_size;
+	qpi_timing_t m_t;
+	qpi_stats_t m_stats;
+
+	int m_state;
+	int m_delay;
+	int m_cs_low;
+	uint32_t m_addr;
+	int m_resume; //in QM_GAP: video burst continues after the gap
+	int m_cpu_pending;
+	uint32_t m_rnd;
+};
@@ -5,8 +5,11 @@
 #include "verilator_setup.hpp"
 #include "verilator_options.hpp"
 #include "video_renderer.hpp"
+#include "qpi_mem_model.hpp"
 #include <gd.h>
 #include <stdint.h>
+#include <string.h>
+#include <limits.h>
 
 #include "../ipl/gloss/mach_defines.h"
 
@@ -22,6 +25,7 @@ void load_tilemap(const char *file) {
 	gdImagePtr im=gdImageCreateFromPng(f);
 	int tx=0, ty=0;
 	int tile;
+	uint32_t words[32];
 	for (tile=0; tile<512; tile++) {
 		for (int y=0; y<16; y++) {
 			uint64_t p;
@@ -31,9 +35,10 @@ void load_tilemap(const char *file) {
 //				c=x; //HACK
 				p|=((uint64_t)c)<<60ULL;
 			}
-			tb_write(TILEMEM_OFF+(tile*32+y*2+0)*4, p&0xFFFFFFFF, tile>=3);
-			tb_write(TILEMEM_OFF+(tile*32+y*2+1)*4, p>>32ULL, tile>=3);
+			words[y*2+0]=p&0xFFFFFFFF;
+			words[y*2+1]=p>>32ULL;
 		}
+		tb_load_words(TILEMEM_OFF+tile*32*4, words, 32, tile>=3);
 
 		tx+=16;
 		if (tx>=gdImageSX(im)) {
@@ -58,42 +63,57 @@ void load_tilemap(const char *file) {
 	fclose(f);
 }
 
-// Simulates a 1MB block of flash memory that takes 4 cycles to produce a result.
-// Used by video memory controller.
-int qpi_cur_adr;
-int qpi_state=0;
-uint8_t qpi_mem[1024*1024];
-void qpi_eval(int clk, int qpi_addr, int qpi_do_read, int *qpi_is_idle, int *qpi_next_word, uint32_t *qpi_rdata) {
-	if (clk) {
-		*qpi_next_word=0;
-		if (qpi_state==0) {
-			if (qpi_do_read) {
-//				printf("Read from %x\n", qpi_addr);
-				qpi_cur_adr=qpi_addr;
-				*qpi_is_idle=0;
-				qpi_state=1;
-			} else {
-				*qpi_is_idle=1;
-			}
-		} else if (qpi_state==4) {
-			qpi_state=1;
-			*qpi_next_word=1;
-			qpi_cur_adr &= 0xffffc;
-			(*qpi_rdata)=qpi_mem[qpi_cur_adr++];
-			(*qpi_rdata)|=qpi_mem[qpi_cur_adr++]<<8;
-			(*qpi_rdata)|=qpi_mem[qpi_cur_adr++]<<16;
-			(*qpi_rdata)|=qpi_mem[qpi_cur_adr++]<<24;
-
-			if (!qpi_do_read) {
-				*qpi_is_idle=1;
-				qpi_state=0;
-			}
-		} else  {
-			qpi_state++;
+// Writes a frame of packed RGB pixels to a PNG file. Returns 0 on success.
+int write_png(const char *file, const uint8_t *rgb, int w, int h) {
+	gdImagePtr im=gdImageCreateTrueColor(w, h);
+	for (int y=0; y<h; y++) {
+		for (int x=0; x<w; x++) {
+			const uint8_t *p=&rgb[(y*w+x)*3];
+			gdImageSetPixel(im, x, y, gdTrueColor(p[0], p[1], p[2]));
+		}
+	}
+	FILE *f=fopen(file, "wb");
+	if (f==NULL) {
+		perror(file);
+		gdImageDestroy(im);
+		return 1;
+	}
+	gdImagePng(im, f);
+	fclose(f);
+	gdImageDestroy(im);
+	return 0;
+}
+
+// Compares a frame of packed RGB pixels to a PNG file. Returns the amount of pixels that
+// differ, or -1 if the file can't be read or has a different size.
+int compare_png(const char *file, const uint8_t *rgb, int w, int h) {
+	FILE *f=fopen(file, "rb");
+	if (f==NULL) {
+		perror(file);
+		return -1;
+	}
+	gdImagePtr im=gdImageCreateFromPng(f);
+	fclose(f);
+	if (im==NULL || gdImageSX(im)!=w || gdImageSY(im)!=h) {
+		printf("%s: not a %dx%d PNG\n", file, w, h);
+		if (im) gdImageDestroy(im);
+		return -1;
+	}
+	int diff=0;
+	for (int y=0; y<h; y++) {
+		for (int x=0; x<w; x++) {
+			const uint8_t *p=&rgb[(y*w+x)*3];
+			int c=gdImageGetTrueColorPixel(im, x, y);
+			if (gdTrueColorGetRed(c)!=p[0] || gdTrueColorGetGreen(c)!=p[1] || gdTrueColorGetBlue(c)!=p[2]) diff++;
 		}
 	}
+	gdImageDestroy(im);
+	return diff;
 }
 
+// 1MB of memory the video DMA reads from; timing is done by Qpi_mem_model.
+uint8_t qpi_mem[1024*1024];
+
 // Loads an image from a png file into qpi memory at 8 bits resolution
 // Returns the width of the image
 unsigned load_png_to_qpi(const char *file, size_t addr) {
@@ -188,80 +208,67 @@ void setup6() {
 	load_default_palette();
 	tb_write(REG_OFF+2*4, 0x10000+2); // tileA
 	int i=0;
-	tb_write(COPPER_OFF+(i++)*4, COPPER_OP_WAIT(5, 5));
-	tb_write(COPPER_OFF+(i++)*4, COPPER_OP_WRITE((REG_OFF+GFX_TILEA_OFF), 1));
+	tb_load(COPPER_OFF+(i++)*4, COPPER_OP_WAIT(5, 5));
+	tb_load(COPPER_OFF+(i++)*4, COPPER_OP_WRITE((REG_OFF+GFX_TILEA_OFF), 1));
 	printf("Op %x\n", COPPER_OP_WRITE((REG_OFF+GFX_TILEA_OFF), 1));
-	tb_write(COPPER_OFF+(i++)*4, 64*4);
-	tb_write(COPPER_OFF+(i++)*4, COPPER_OP_WAIT(5, 6));
-	tb_write(COPPER_OFF+(i++)*4, COPPER_OP_WRITE((REG_OFF+GFX_TILEA_OFF), 1));
-	tb_write(COPPER_OFF+(i++)*4, 64*8);
-	tb_write(COPPER_OFF+(i++)*4, COPPER_OP_WAIT(5, 7));
-	tb_write(COPPER_OFF+(i++)*4, COPPER_OP_WRITE((REG_OFF+GFX_TILEA_OFF), 1));
-	tb_write(COPPER_OFF+(i++)*4, 64*9);
-	tb_write(COPPER_OFF+(i++)*4, COPPER_OP_WAIT(5, 8));
-	tb_write(COPPER_OFF+(i++)*4, COPPER_OP_WRITE((REG_OFF+GFX_TILEA_OFF), 1));
-	tb_write(COPPER_OFF+(i++)*4, 64*10);
-	tb_write(COPPER_OFF+(i++)*4, COPPER_OP_WAIT(0, 0));
-	tb_write(COPPER_OFF+(i++)*4, COPPER_OP_WRITE((REG_OFF+GFX_TILEA_OFF), 1));
-	tb_write(COPPER_OFF+(i++)*4, 0);
-	tb_write(COPPER_OFF+(i++)*4, COPPER_OP_RESET);
+	tb_load(COPPER_OFF+(i++)*4, 64*4);
+	tb_load(COPPER_OFF+(i++)*4, COPPER_OP_WAIT(5, 6));
+	tb_load(COPPER_OFF+(i++)*4, COPPER_OP_WRITE((REG_OFF+GFX_TILEA_OFF), 1));
+	tb_load(COPPER_OFF+(i++)*4, 64*8);
+	tb_load(COPPER_OFF+(i++)*4, COPPER_OP_WAIT(5, 7));
+	tb_load(COPPER_OFF+(i++)*4, COPPER_OP_WRITE((REG_OFF+GFX_TILEA_OFF), 1));
+	tb_load(COPPER_OFF+(i++)*4, 64*9);
+	tb_load(COPPER_OFF+(i++)*4, COPPER_OP_WAIT(5, 8));
+	tb_load(COPPER_OFF+(i++)*4, COPPER_OP_WRITE((REG_OFF+GFX_TILEA_OFF), 1));
+	tb_load(COPPER_OFF+(i++)*4, 64*10);
+	tb_load(COPPER_OFF+(i++)*4, COPPER_OP_WAIT(0, 0));
+	tb_load(COPPER_OFF+(i++)*4, COPPER_OP_WRITE((REG_OFF+GFX_TILEA_OFF), 1));
+	tb_load(COPPER_OFF+(i++)*4, 0);
+	tb_load(COPPER_OFF+(i++)*4, COPPER_OP_RESET);
 	tb_write(REG_OFF+GFX_COPPER_CTL_REG, (1<<31));
 }
 
 
-// Array of all setups - defined in verilator_options.hpp
-setup_fn setups[] = {
-	setup1,
-	setup2,
-	setup3,
-	setup4,
-	setup5,
-	setup6,
-	NULL
-};
-
-int main(int argc, char **argv) {
-	CmdLineOptions options = CmdLineOptions::parse(argc, argv);
-	
-	// Initialize Verilators variables
-	Verilated::commandArgs(argc, argv);
-	Verilated::traceEverOn(true);
-
-	// Create an instance of our module under test
-	// Vvid contains a line renderer and video memory controller wired together
-	init_test_bench(options.trace_on);
-
-	// Video renderer - shows HDMI output in GUI and simulates hdmi-encoder.v
-	Video_renderer *vid=new Video_renderer(true);
-
-	// Toggle reset signal.
-	// We do this before setup as reset resets many of the line_render's registers
-	toggle_reset();
+// Main display loop state
+// Runs two clocks
+// 1. tb->clk is the base system clock
+// 2. tb->pixelclk runs about 1/4 the speed of the system clock
+int fetch_next=0;
+int next_line=0;
+int next_field=0;
+float pixelclk_pos=0;
+int qpi_is_idle=0, qpi_next_word=0;
+uint32_t qpi_rdata=0;
+
+// Measurements of the video pipeline, gathered by run_fields.
+typedef struct {
+	int fields;				// fields measured
+	int underruns;			// display lines shown before the renderer finished them
+	int worst_underruns;	// most underruns in a single field
+	uint64_t cycles;
+	uint64_t qpi_words;		// words fetched by the framebuffer DMA
+	uint64_t qpi_idle;		// cycles qpi_do_read was low
+	uint64_t render_cycles;	// cycles the renderer had a free line to work on
+	int min_slack;			// least pixels the renderer was ahead of the display
+} vid_stats_t;
+
+// Runs the simulation for num_fields fields. The first field is not measured, as it
+// starts in the middle of whatever happened before (reset, setup, reconfiguration).
+void run_fields(Video_renderer *vid, Qpi_mem_model *qpi, int num_fields, vid_stats_t *st) {
+	memset(st, 0, sizeof(*st));
+	st->min_slack=INT_MAX;
+	int disp_line=0;
+	int field_underruns=0;
+	uint64_t start_words=0;
 
-	// Call the selected setup
-	options.setup();
-
-	// Main display loop
-	// Runs two clocks
-	// 1. tb->clk is the base system clock
-	// 2. tb->pixelclk runs about 1/4 the speed of the system clock
-	int fetch_next=0;
-	int next_line=0;
-	int next_field=0;
-	float pixelclk_pos=0;
-	int qpi_is_idle=0, qpi_next_word=0;
-	uint32_t qpi_rdata=0;
-	int layer=0;
-
-	// Main loop - count fields
 	int field = 0;
-	while (field < options.num_fields) {
+	while (field < num_fields) {
 		// Toggle main clock high
 		tb->pixelclk = (pixelclk_pos>0.5)?1:0;
 		tb->clk = !tb->clk;
 
 		// Drive memory
-		qpi_eval(tb->clk, tb->qpi_addr, tb->qpi_do_read, &qpi_is_idle, &qpi_next_word, &qpi_rdata);
+		qpi->eval(tb->qpi_do_read, tb->qpi_addr, &qpi_rdata, &qpi_next_word, &qpi_is_idle);
 		tb->qpi_rdata=qpi_rdata;
 		tb->qpi_is_idle=qpi_is_idle;
 		tb->qpi_next_word=qpi_next_word;
@@ -271,28 +278,208 @@ int main(int argc, char **argv) {
 		tb->clk = !tb->clk;
 		tb_step();
 
+		int line=tb->vid__DOT__video_mem__DOT__curr_vid_addr>>9;
+		int rline=tb->vid__DOT__linerenderer__DOT__write_vid_addr>>9;
+		if (field>0) {
+			st->cycles++;
+			if (!tb->qpi_do_read) st->qpi_idle++;
+			// Same condition the renderer uses to decide there's room in the line memory
+			if (rline<320 && ((rline&3)!=(line&3) || tb->vid__DOT__video_mem__DOT__preload)) {
+				st->render_cycles++;
+			}
+		}
+		// The line memory holds 4 lines; the renderer stalls while it would overwrite the
+		// line on display, so if it is still at or before the line the display moves to,
+		// that line shows stale data.
+		if (line!=disp_line) {
+			disp_line=line;
+			if (line>0 && line<320 && rline<=line) field_underruns++;
+		}
+
 		// Drive video output based on pixel clock
 		pixelclk_pos=pixelclk_pos+0.26;
 		if (pixelclk_pos>1.0) {
 			pixelclk_pos-=1.0;
 			vid->next_pixel(tb->red, tb->green, tb->blue, &fetch_next, &next_line, &next_field);
 			tb->fetch_next=fetch_next;
+			if (fetch_next && field>0 && line>0 && line<320 && rline<320) {
+				int slack=(rline*480+(tb->vid__DOT__linerenderer__DOT__write_vid_addr&0x1ff))-
+						(line*480+(tb->vid__DOT__video_mem__DOT__curr_vid_addr&0x1ff));
+				if (slack<st->min_slack) st->min_slack=slack;
+			}
 			// Count fields
 			if (tb->next_field==1 && next_field==0) {
-				printf("Finished field: %d\n", field);
+				printf("Finished field: %d, %d line underruns\n", field, field_underruns);
+				if (field>0) {
+					st->fields++;
+					st->underruns+=field_underruns;
+					if (field_underruns>st->worst_underruns) st->worst_underruns=field_underruns;
+				} else {
+					start_words=qpi->get_stats()->vid_words;
+				}
+				field_underruns=0;
 				field++;
 			}
 			tb->next_field=next_field;
 			tb->next_line=next_line;
 		}
 	}
+	st->qpi_words=qpi->get_stats()->vid_words-start_words;
+}
+
+// Layer configurations for the benchmark
+typedef struct {
+	const char *name;
+	uint32_t layeren;
+	bool copper;
+} bench_cfg_t;
+
+static const bench_cfg_t bench_cfgs[]={
+	{"fb8", GFX_LAYEREN_FB|GFX_LAYEREN_FB_8BIT, false},
+	{"fb4", GFX_LAYEREN_FB, false},
+	{"tilea", GFX_LAYEREN_TILEA, false},
+	{"tileb", GFX_LAYEREN_TILEB, false},
+	{"tilea+tileb", GFX_LAYEREN_TILEA|GFX_LAYEREN_TILEB, false},
+	{"sprites", GFX_LAYEREN_SPR, false},
+	{"tilea+copper", GFX_LAYEREN_TILEA, true},
+	{"fb8+tilea+tileb+sprites", GFX_LAYEREN_FB|GFX_LAYEREN_FB_8BIT|GFX_LAYEREN_TILEA|GFX_LAYEREN_TILEB|GFX_LAYEREN_SPR, false},
+	{"fb4+tilea+tileb+sprites+copper", GFX_LAYEREN_FB|GFX_LAYEREN_TILEA|GFX_LAYEREN_TILEB|GFX_LAYEREN_SPR, true},
+	{NULL, 0, false}
+};
+
+// Loads everything all layers need: the background as framebuffer, the tileset in both
+// tilemaps, a row of sprites and a copper list that scrolls tile layer A on every line.
+void bench_setup() {
+	FILE *f=fopen("background.raw", "r");
+	if (!f) perror("raw fb data");
+	for (int i=0; i<320 && f; i++) {
+		fread(&qpi_mem[512*i], 480, 1, f);
+	}
+	if (f) fclose(f);
+	tb_write(REG_OFF+GFX_FBADDR_REG, 0);
+	tb_write(REG_OFF+GFX_FBPITCH_REG, (0 << GFX_FBPITCH_PAL_OFF) + 512);
+
+	load_tilemap("tileset.png");
+	load_default_palette();
+	for (int i=0; i<64*64; i++) {
+		tb_load(TILEMAPB_OFF+i*4, i&0xff, true);
+	}
+	for (int i=0; i<16; i++) {
+		set_sprite(i, 16+i*28, 32+i*16, 16, 16, i);
+	}
+
+	int i=0;
+	for (int y=0; y<320; y++) {
+		tb_load(COPPER_OFF+(i++)*4, COPPER_OP_WAIT(0, y));
+		tb_load(COPPER_OFF+(i++)*4, COPPER_OP_WRITE((REG_OFF+GFX_TILEA_OFF), 1));
+		tb_load(COPPER_OFF+(i++)*4, ((y&63)*64)<<GFX_TILEA_X_OFF_OFF);
+	}
+	tb_load(COPPER_OFF+(i++)*4, COPPER_OP_RESET);
+}
+
+// Runs every layer configuration in bench_cfgs for num_fields fields and writes the
+// results as CSV, one line per configuration.
+void run_bench(const char *file, Video_renderer *vid, Qpi_mem_model *qpi, int num_fields) {
+	FILE *f=fopen(file, "w");
+	if (f==NULL) {
+		perror(file);
+		exit(EXIT_FAILURE);
+	}
+	bench_setup();
+	fprintf(f, "config,fields,words_per_line,qpi_idle_per_line,render_cycles_per_line,min_slack_px,underruns\n");
+	for (const bench_cfg_t *c=bench_cfgs; c->name; c++) {
+		printf("Benchmarking %s\n", c->name);
+		tb_write(REG_OFF+GFX_COPPER_CTL_REG, c->copper?GFX_COPPER_CTL_RUN:0);
+		tb_write(REG_OFF+GFX_LAYEREN_REG, c->layeren);
+		vid_stats_t st;
+		run_fields(vid, qpi, num_fields, &st);
+		double lines=st.fields*320.0;
+		fprintf(f, "%s,%d,%.2f,%.1f,%.1f,%d,%d\n", c->name, st.fields, st.qpi_words/lines,
+				st.qpi_idle/lines, st.render_cycles/lines, (st.min_slack==INT_MAX)?-1:st.min_slack,
+				st.underruns);
+		fflush(f);
+	}
+	fclose(f);
+}
+
+// Array of all setups - defined in verilator_options.hpp
+setup_fn setups[] = {
+	setup1,
+	setup2,
+	setup3,
+	setup4,
+	setup5,
+	setup6,
+	NULL
+};
+
+int main(int argc, char **argv) {
+	CmdLineOptions options = CmdLineOptions::parse(argc, argv);
+	
+	// Initialize Verilators variables
+	Verilated::commandArgs(argc, argv);
+	Verilated::traceEverOn(true);
+
+	// Create an instance of our module under test
+	// Vvid contains a line renderer and video memory controller wired together
+	init_test_bench(options.trace_on);
+	tb_use_bus = options.use_bus;
+
+	// Video renderer - shows HDMI output in GUI and simulates hdmi-encoder.v
+	Video_renderer *vid=new Video_renderer(!options.batch);
+
+	// Toggle reset signal.
+	// We do this before setup as reset resets many of the line_render's registers
+	toggle_reset();
+
+	Qpi_mem_model qpi(qpi_mem, sizeof(qpi_mem), &options.qpi_timing);
+	vid_stats_t st;
+	if (options.bench_file) {
+		// The benchmark does its own setup
+		run_bench(options.bench_file, vid, &qpi, options.num_fields);
+	} else {
+		// Call the selected setup
+		options.setup();
+		run_fields(vid, &qpi, options.num_fields, &st);
+	}
 
 	if (trace) {
 		trace->flush();
 		trace->close();
 	}
 
-	printf("Press ENTER to exit\n");
-	getc(stdin);
-	exit(EXIT_SUCCESS);
+	qpi.report(stdout);
+	if (options.bench_file) {
+		printf("Wrote benchmark results to %s\n", options.bench_file);
+	} else if (st.underruns) {
+		printf("Line underruns: %d (worst field %d); the video memory can't keep up with this mode\n",
+				st.underruns, st.worst_underruns);
+	} else {
+		printf("Line underruns: none\n");
+	}
+
+	// The last completed field is what the golden images are made of.
+	const uint8_t *frame=vid->get_frame();
+	printf("Frame hash: %016llx\n", (unsigned long long)vid->get_frame_hash());
+	if (options.out_png) {
+		if (write_png(options.out_png, frame, VIDEO_RENDERER_W, VIDEO_RENDERER_H)) exit(EXIT_FAILURE);
+		printf("Wrote %s\n", options.out_png);
+	}
+	int ret=EXIT_SUCCESS;
+	if (options.golden_png) {
+		int diff=compare_png(options.golden_png, frame, VIDEO_RENDERER_W, VIDEO_RENDERER_H);
+		if (diff==0) {
+			printf("Result: PASS, matches %s\n", options.golden_png);
+		} else {
+			if (diff>0) printf("Result: FAIL, %d pixels differ from %s\n", diff, options.golden_png);
+			else printf("Result: FAIL, can't compare against %s\n", options.golden_png);
+			ret=EXIT_FAILURE;
+		}
+	}
+
+	if (!options.batch) {
+		printf("Press ENTER to exit\n");
+		getc(stdin);
+	}
+	exit(ret);
 }
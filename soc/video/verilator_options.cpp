@@ -11,7 +11,10 @@ unsigned int setup_count() {
 }
 
 CmdLineOptions::CmdLineOptions():
-	num_fields(3), trace_on(false) {}
+	num_fields(3), trace_on(false), use_bus(false), batch(false),
+	golden_png(NULL), out_png(NULL), bench_file(NULL) {
+	Qpi_mem_model::default_timing(&qpi_timing);
+}
 
 void CmdLineOptions::dump() {
 	printf("CmdLineOptions{%u, %s}", num_fields, trace_on ? "true" : "false");
@@ -19,10 +22,20 @@ void CmdLineOptions::dump() {
 
 static void errExit(char *prog_name, const char *msg, char opt) {
     fprintf(stderr, "Option '%c': %s\n"
-	"Usage: %s [-f fields] [-t] [-s x]\n"
+	"Usage: %s [-f fields] [-t] [-s x] [-w] [-n] [-g golden.png] [-o out.png]\n"
+	"      [-q key=val,...] [-b results.csv]\n"
 	"  -f: number of HDMI fields to run consecutively\n"
-	"  -t: trace execution to a .vcd file\n",
-	"  -s: specify setup\n",
+	"  -t: trace execution to a .vcd file\n"
+	"  -s: specify setup\n"
+	"  -w: load video memories through the bus instead of directly\n"
+	"  -n: no display, exit when done\n"
+	"  -g: compare the last field against this image; implies -n\n"
+	"  -o: write the last field to this image\n"
+	"  -q: QPI memory timing, in clk cycles: setup, word, gap, csmax (max /CS low time),\n"
+	"      split (1 to split bursts at csmax), cpu (CPU traffic load in %%), cpuwords, seed\n"
+	"  -b: benchmark all layer configurations and write the results to this CSV file;\n"
+	"      each configuration runs for the number of fields given with -f (at least 2).\n"
+	"      Implies -n\n",
 	   opt, msg, prog_name);
     exit(EXIT_FAILURE);
 }
@@ -49,7 +62,7 @@ static unsigned int readPosNum(char *prog_name, unsigned int max, char opt, char
 CmdLineOptions CmdLineOptions::parse(int argc, char**argv) {
 	CmdLineOptions result;
 	int opt;
-	while ((opt = getopt(argc, argv, "f:ts:")) != -1) {
+	while ((opt = getopt(argc, argv, "f:ts:wng:o:q:b:")) != -1) {
 	switch (opt) {
 		case 'f':
 			result.num_fields = readPosNum(argv[0], 1000, 'f', optarg);
@@ -57,6 +70,28 @@ CmdLineOptions CmdLineOptions::parse(int argc, char**argv) {
 		case 't':
 			result.trace_on = true;
 			break;
+		case 'w':
+			result.use_bus = true;
+			break;
+		case 'n':
+			result.batch = true;
+			break;
+		case 'g':
+			result.golden_png = optarg;
+			result.batch = true;
+			break;
+		case 'o':
+			result.out_png = optarg;
+			break;
+		case 'q':
+			if (!Qpi_mem_model::parse_timing(optarg, &result.qpi_timing)) {
+				errExit(argv[0], "Invalid memory timing", opt);
+			}
+			break;
+		case 'b':
+			result.bench_file = optarg;
+			result.batch = true;
+			break;
 		case 's':
 			result.setup = setups[readPosNum(argv[0], setup_count(), 's', optarg) - 1];
 			break;
@@ -64,5 +99,8 @@ CmdLineOptions CmdLineOptions::parse(int argc, char**argv) {
             errExit(argv[0], "Unknown", opt);
 		}
 	}
+	if (result.bench_file && result.num_fields < 2) {
+		errExit(argv[0], "Benchmark needs at least 2 fields", 'f');
+	}
 	return result;
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "qpi_mem_model.hpp"
+
 // Setup function routines
 typedef void (*setup_fn)();
 
@@ -24,6 +26,22 @@ public:
 	// Whether we should trace (generates large files)
 	bool trace_on;
 
+	// Whether setup should write video memories through the bus instead of the backdoor
+	bool use_bus;
+
+	// Run without display and don't wait for ENTER at the end
+	bool batch;
+	// If not NULL, compare the last field against this PNG; the exit code says if it matched.
+	const char *golden_png;
+	// If not NULL, write the last field to this PNG.
+	const char *out_png;
+
+	// Timing of the memory model the video DMA reads from
+	qpi_timing_t qpi_timing;
+
+	// If not NULL, run the layer benchmark and write the results as CSV to this file
+	const char *bench_file;
+
 	// Factory method: creates from command line
 	static CmdLineOptions parse(int argc, char**argv);
 
@@ -8,6 +8,7 @@ double sc_time_stamp() {
 }
 Vvid *tb = NULL;
 VerilatedVcdC *trace = NULL;
+bool tb_use_bus = false;
 
 // Evaluate model, advance time and optionally trace
 void tb_step(bool trace_exempt) { 
@@ -41,6 +42,40 @@ void tb_write(int addr, int data, bool trace_exempt) {
 	tb->wstrb=0x0;
 }
 
+// Backdoor write. Decodes addresses the same way the CPU interface of vid_linerenderer does.
+void tb_load(int addr, uint32_t data, bool trace_exempt) {
+	if (tb_use_bus || (addr&0x3E000)==0) {
+		tb_write(addr, data, trace_exempt);
+		return;
+	}
+	if ((addr&0x3E000)==0x2000) {
+		tb->vid__DOT__linerenderer__DOT__palettemem__DOT__mem[(addr>>2)&0x1ff]=data;
+	} else if ((addr&0x3C000)==0x4000) {
+		tb->vid__DOT__linerenderer__DOT__tilemapa__DOT__mem[(addr>>2)&0xfff]=data&0x3ffff;
+	} else if ((addr&0x3C000)==0x8000) {
+		tb->vid__DOT__linerenderer__DOT__tilemapb__DOT__mem[(addr>>2)&0xfff]=data&0x3ffff;
+	} else if ((addr&0x3E000)==0xC000) {
+		//64-bit words; even addresses are the low half
+		int i=(addr>>2)&0x1ff;
+		QData *w=&tb->vid__DOT__linerenderer__DOT__spriteeng__DOT__spritemem__DOT__mem[i>>1];
+		if (i&1) {
+			*w=(*w&0xffffffffULL)|((QData)data<<32);
+		} else {
+			*w=(*w&0xffffffff00000000ULL)|data;
+		}
+	} else if ((addr&0x30000)==0x10000) {
+		tb->vid__DOT__linerenderer__DOT__tilemem__DOT__mem[(addr>>2)&0x3fff]=data;
+	} else if ((addr&0x30000)==0x20000) {
+		tb->vid__DOT__linerenderer__DOT__copper_mem__DOT__mem[(addr>>2)&0x7ff]=data;
+	} else {
+		tb_write(addr, data, trace_exempt);
+	}
+}
+
+void tb_load_words(int addr, const uint32_t *data, int count, bool trace_exempt) {
+	for (int i=0; i<count; i++) tb_load(addr+i*4, data[i], trace_exempt);
+}
+
 // Send reset signal to test bench
 void toggle_reset() {
 	tb->reset=1;
@@ -63,13 +98,13 @@ void load_default_palette() {
 		p|=vgapal[i*3+1]<<8;
 		p|=vgapal[i*3+2]<<16;
 		p|=(0xff<<24);
-		tb_write(PAL_OFF+(i*4), p);
-		tb_write(PAL_OFF+((i+256)*4), p);
+		tb_load(PAL_OFF+(i*4), p);
+		tb_load(PAL_OFF+((i+256)*4), p);
 	}
 
 	// Set some of the remaining palette colors
-	tb_write(PAL_OFF+(0x100*4), 0xffff00ff);
-	tb_write(PAL_OFF+((0x1ff)*4), 0x10ff00ff);
+	tb_load(PAL_OFF+(0x100*4), 0xffff00ff);
+	tb_load(PAL_OFF+((0x1ff)*4), 0x10ff00ff);
 }
 
 // Set a sprite's position, scale and tile number
@@ -80,8 +115,8 @@ void set_sprite(int no, int x, int y, int sx, int sy, int tileno) {
 	sa=(y<<16)|x;
 	sb=sx|(sy<<8)|(tileno<<16);
 	printf("Sprite %d: %08X %08X\n", no, sa, sb);
-	tb_write(SPRITE_OFF+no*8, sa);
-	tb_write(SPRITE_OFF+no*8+4, sb);
+	tb_load(SPRITE_OFF+no*8, sa);
+	tb_load(SPRITE_OFF+no*8+4, sb);
 }
 
 // Load a tile into memory from a 256 char string
@@ -103,7 +138,7 @@ void load_tile(int tile, const char *s) {
 		eight_pix = (v << 28) | (eight_pix >> 4);
 		if (i % 8 == 7) {
 			uint32_t addr = TILEMEM_OFF+(tile*32+i/8)*4;
-			tb_write(addr, eight_pix);
+			tb_load(addr, eight_pix);
 		}
 
 	}
@@ -32,6 +32,15 @@ void init_test_bench(bool trace_on);
 // be properly interpreted.
 void tb_write(int addr, int data, bool trace_exempt=false);
 
+// If set, tb_load goes through tb_write. Otherwise, it writes straight into the memory
+// arrays of the model, which takes no simulated time.
+extern bool tb_use_bus;
+
+// Write a word to the palette, tilemaps, sprites, tile memory or copper memory for setup.
+// Registers can't be written through the backdoor; writes to those always use tb_write.
+void tb_load(int addr, uint32_t data, bool trace_exempt=false);
+void tb_load_words(int addr, const uint32_t *data, int count, bool trace_exempt=false);
+
 // Send reset signal to test bench
 void toggle_reset();
 
@@ -15,15 +15,27 @@
  */
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/select.h>
 #include "video_renderer.hpp"
+#include "ppm_write.hpp"
+#include "frame_hash.hpp"
+#include "../sim_checkpoint.hpp"
 
-//This emulates the HDMI encoder, and instead shows the image in a SDL window.
+//This emulates the HDMI encoder, and instead shows the image in a SDL window. It also keeps
+//the image in memory, so headless (-DHEADLESS=1, no SDL) builds can grab it from there.
 
 #define SCALE 2
 
 Video_renderer::Video_renderer(bool show_display) {
 	do_display=show_display;
+#if HEADLESS
+	if (do_display) {
+		printf("Video_renderer: headless build, not showing display\n");
+		do_display=false;
+	}
+#else
 	if (do_display) {
 		if (SDL_Init(SDL_INIT_VIDEO) < 0) {
 			printf("Error initializing sdl!\n");
@@ -42,18 +54,61 @@ Video_renderer::Video_renderer(bool show_display) {
 		SDL_FillRect(screen_surf, NULL, SDL_MapRGB(screen_surf->format, 0xff, 0, 0xff));
 		SDL_UpdateWindowSurface(window);
 	}
+	last_update=0;
+#endif
+	frame_cur=new uint8_t[VIDEO_RENDERER_W*VIDEO_RENDERER_H*3]();
+	frame_done=new uint8_t[VIDEO_RENDERER_W*VIDEO_RENDERER_H*3]();
+	frame_count=0;
 	beam_x=0;
 	beam_y=0;
 }
 
+const uint8_t *Video_renderer::get_frame() {
+	return frame_done;
+}
+
+int Video_renderer::get_frame_count() {
+	return frame_count;
+}
+
+uint64_t Video_renderer::get_frame_hash() {
+	return frame_hash(frame_done, VIDEO_RENDERER_W, VIDEO_RENDERER_H);
+}
+
+int Video_renderer::write_ppm(const char *file) {
+	return ppm_write(file, frame_done, VIDEO_RENDERER_W, VIDEO_RENDERER_H);
+}
+
+int Video_renderer::save(FILE *f) {
+	CP_SAVE(f, beam_x);
+	CP_SAVE(f, beam_y);
+	CP_SAVE(f, frame_count);
+	return CP_RESULT(f);
+}
+
+int Video_renderer::restore(FILE *f) {
+	CP_RESTORE(f, beam_x);
+	CP_RESTORE(f, beam_y);
+	CP_RESTORE(f, frame_count);
+	return CP_RESULT(f);
+}
+
 int Video_renderer::next_pixel(int red, int green, int blue, int *fetch_next, int *next_line, int *next_field) {
-	SDL_Rect r;
 	if (beam_x<640 && beam_y<480) {
-		r.x=beam_x*SCALE;
-		r.y=beam_y*SCALE;
-		r.w=SCALE;
-		r.h=SCALE;
-		if (do_display) SDL_FillRect(screen_surf, &r, SDL_MapRGB(screen_surf->format, red, green, blue));
+		uint8_t *p=&frame_cur[(beam_y*VIDEO_RENDERER_W+beam_x)*3];
+		p[0]=red;
+		p[1]=green;
+		p[2]=blue;
+#if !HEADLESS
+		if (do_display) {
+			SDL_Rect r;
+			r.x=beam_x*SCALE;
+			r.y=beam_y*SCALE;
+			r.w=SCALE;
+			r.h=SCALE;
+			SDL_FillRect(screen_surf, &r, SDL_MapRGB(screen_surf->format, red, green, blue));
+		}
+#endif
 		*fetch_next=1;
 	} else {
 		*fetch_next=0;
@@ -62,6 +117,7 @@ int Video_renderer::next_pixel(int red, int green, int blue, int *fetch_next, in
 	*next_field=(beam_y==480)?1:0;
 	beam_x++;
 	if (beam_x==796) {
+#if !HEADLESS
 		if (do_display) {
 			Uint32 time_since_last=SDL_GetTicks()-last_update;
 			if (time_since_last>100) {
@@ -69,8 +125,16 @@ int Video_renderer::next_pixel(int red, int green, int blue, int *fetch_next, in
 				last_update=SDL_GetTicks();
 			}
 		}
+#endif
 		beam_x=0;
 		beam_y++;
+		if (beam_y==480) {
+			//Visible part is done.
+			uint8_t *t=frame_done;
+			frame_done=frame_cur;
+			frame_cur=t;
+			frame_count++;
+		}
 		if (beam_y==523) {
 			beam_y=0;
 		}
@@ -1,21 +1,42 @@
-
 #pragma once
 
+#include <stdint.h>
+#include <stdio.h>
+#if !HEADLESS
 #include <SDL.h>
+#endif
 
 
 using namespace std;
 
+#define VIDEO_RENDERER_W 640
+#define VIDEO_RENDERER_H 480
+
 class Video_renderer {
 	public:
 	Video_renderer(bool show_display);
 	int next_pixel(int red, int green, int blue, int *fetch_next, int *next_line, int *next_field);
+	//Last completed frame, VIDEO_RENDERER_W*VIDEO_RENDERER_H packed RGB pixels.
+	const uint8_t *get_frame();
+	//Amount of frames completed so far
+	int get_frame_count();
+	//Hash of the last completed frame
+	uint64_t get_frame_hash();
+	int write_ppm(const char *file);
+	//Only the position of the beam/write pointer is saved, not the image itself.
+	int save(FILE *f);
+	int restore(FILE *f);
 
 	private:
+#if !HEADLESS
 	SDL_Surface *screen_surf;
 	SDL_Window *window;
+	Uint32 last_update;
+#endif
+	uint8_t *frame_cur;
+	uint8_t *frame_done;
+	int frame_count;
 	int beam_x;
 	int beam_y;
-	Uint32 last_update;
 	bool do_display;
 };